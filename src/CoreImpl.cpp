@@ -9,9 +9,15 @@
 #endif
 
 bool CoreImpl::begin() {
+    memset(&broker_pending_publishes, 0, sizeof(broker_pending_publishes));
+    memset(&retained_fetches, 0, sizeof(retained_fetches));
     if (persistent != nullptr && mqtt != nullptr && mqttsn != nullptr && system != nullptr) {
-        if (persistent->begin() && mqtt->begin() && mqttsn->begin()) {
-            return true;
+        if (persistent->begin()) {
+            // before the broker connection, the first resubscribe already needs the threshold
+            aggregated_subscriptions.set_threshold(persistent->get_subscription_aggregation_threshold());
+            if (mqtt->begin() && mqttsn->begin()) {
+                return true;
+            }
         }
     }
     return false;
@@ -42,9 +48,12 @@ void CoreImpl::loop() {
 
     if (!persistent->is_mqttsn_online() || !persistent->is_mqtt_online()) {
         if (persistent->is_mqttsn_online() && !persistent->is_mqtt_online()) {
-            // only mqttsn is online => disconnect all connected client
-            process_mqtt_offline_procedure();
-            return;
+            if (persistent->get_spool_capacity() == 0) {
+                // only mqttsn is online => disconnect all connected client
+                process_mqtt_offline_procedure();
+                return;
+            }
+            // clients stay connected, their QoS 1 publishes are spooled until the broker is back
         } else if (!persistent->is_mqttsn_online() && persistent->is_mqtt_online()) {
             // only mqtt is online => publish will-message and disconnect
             process_mqttsn_offline_procedure();
@@ -57,89 +66,319 @@ void CoreImpl::loop() {
         }
     }
 
-    bool has_heart_beaten = system->has_beaten();
+    handle_retransmissions();
+
+    handle_advertise();
 
-    // TODO write advertise here
-    // if hasbeaten and > advertise duration and core->mqtt/sn connecte) => send advertise package
+    handle_broker_statistics();
+
+    handle_spool();
+
+    handle_broker_pending_publishes();
+
+    // the client pass may span several loop calls, so control messages are handled in between
+    uint32_t loop_start = system->get_microseconds();
+
+    if (client_cursor == 0) {
+        // start a new pass
+        pass_has_heart_beaten = system->has_beaten();
+        pass_elapsed_time = 0;
+        if (pass_has_heart_beaten) {
+            pass_elapsed_time = system->get_elapsed_time();
+        }
 #if CORE_DEBUG
-    if (has_heart_beaten) {
-        logger->start_log("check client for timeout", 3);
-    }
+        if (pass_has_heart_beaten) {
+            logger->start_log("check client for timeout", 3);
+        }
 #endif
+        memset(&pass_last_client_address, 0, sizeof(device_address));
+        persistent->get_last_client_address(&pass_last_client_address);
+        if (is_address_empty(&pass_last_client_address)) {
+#if CORE_DEBUG
+            logger->log("no clients connected", 3);
+#endif
+            return;
+        }
+    }
 
     // create buckets for to the client data
-    device_address last_client_address;
-    memset(&last_client_address, 0, sizeof(device_address));
-
     char client_id[24];
     device_address address;
     CLIENT_STATUS status;
     uint32_t timeout;
     uint32_t duration;
 
-    uint32_t elapsed_time = 0;
-    if (has_heart_beaten) {
-        elapsed_time = system->get_elapsed_time();
+    while (true) {
+        persistent->get_nth_client(client_cursor, client_id, &address, &status, &duration, &timeout);
+        if (is_address_empty(&address)) {
+            client_cursor = 0;
+            return;
+        }
+        client_cursor++;
+        handle_client(status, client_id, &address, duration, timeout);
+        if (memcmp(&pass_last_client_address, &address, sizeof(device_address)) == 0) {
+            client_cursor = 0;
+            return;
+        }
+        if (loop_budget > 0 && system->get_microseconds() - loop_start >= loop_budget) {
+            // continue with the next client in the next loop call
+            return;
+        }
     }
-    persistent->get_last_client_address(&last_client_address);
+}
 
-    bool is_last_client_address_empty = true;
-    for (uint8_t i = 0; i < sizeof(device_address); i++) {
-        if (last_client_address.bytes[i] != 0) {
-            is_last_client_address_empty = false;
-            break;
+uint32_t CoreImpl::get_next_timeout() {
+    if (client_cursor != 0) {
+        // the client pass continues
+        return 0;
+    }
+    uint32_t timestamp = system->get_timestamp();
+    uint32_t timeout = system->get_heartbeat_remaining();
+    uint32_t deadline;
+    if (retransmissions.get_next_deadline(&deadline)) {
+        shorten_timeout(&timeout, timestamp, deadline);
+    }
+    if (advertising) {
+        if (!advertise_scheduled) {
+            return 0;
         }
+        shorten_timeout(&timeout, timestamp, next_advertise_timestamp);
     }
-    if (is_last_client_address_empty) {
-#if CORE_DEBUG
-        logger->log("no clients connected", 3);
+#if CORE_LOG
+    shorten_timeout(&timeout, timestamp, next_broker_statistics_timestamp);
 #endif
+    uint16_t spooled_count = 0;
+    for (uint16_t i = 0; i < BROKER_PUBLISH_WINDOW; i++) {
+        broker_pending_publish &pending = broker_pending_publishes[i];
+        if (!pending.used) {
+            continue;
+        }
+        if (pending.spooled) {
+            spooled_count++;
+        }
+        if (!pending.acknowledged) {
+            // given up by handle_broker_pending_publishes once the timeout is exceeded
+            shorten_timeout(&timeout, timestamp, pending.timestamp + BROKER_PUBACK_TIMEOUT + 1);
+        }
+    }
+    if (persistent->is_mqtt_online() && persistent->get_spool_count() > spooled_count &&
+        spooled_count < SPOOL_DRAIN_BATCH_SIZE && timeout > SPOOL_RETRY_TIMEOUT) {
+        // the spool was not sent completely, e.g. because the broker refused a publish
+        timeout = SPOOL_RETRY_TIMEOUT;
+    }
+    return timeout;
+}
+
+void CoreImpl::shorten_timeout(uint32_t *timeout, uint32_t timestamp, uint32_t deadline) {
+    if ((int32_t) (deadline - timestamp) <= 0) {
+        *timeout = 0;
+    } else if (deadline - timestamp < *timeout) {
+        *timeout = deadline - timestamp;
+    }
+}
+
+void CoreImpl::handle_broker_statistics() {
+#if CORE_LOG
+    uint32_t timestamp = system->get_timestamp();
+    if ((int32_t) (timestamp - next_broker_statistics_timestamp) < 0) {
+        return;
+    }
+    next_broker_statistics_timestamp = timestamp + BROKER_STATISTICS_LOG_PERIOD;
+    uint32_t dropped_count = mqtt->get_broker_dropped_count();
+    if (dropped_count == logged_broker_dropped_count) {
         return;
     }
+    logged_broker_dropped_count = dropped_count;
+    char uint32_buffer[20];
+    logger->start_log("Dropped PUBLISH from Broker (", 1);
+    sprintf(uint32_buffer, "%lu", (unsigned long) dropped_count);
+    logger->append_log(uint32_buffer);
+    logger->append_log(" total, ");
+    sprintf(uint32_buffer, "%lu", (unsigned long) mqtt->get_broker_oversize_count());
+    logger->append_log(uint32_buffer);
+    logger->append_log(" too large, queue high water mark ");
+    sprintf(uint32_buffer, "%lu", (unsigned long) mqtt->get_broker_high_water_mark());
+    logger->append_log(uint32_buffer);
+    logger->append_log(")");
+#endif
+}
 
-    persistent->get_nth_client(0, client_id, &address, &status, &duration, &timeout);
-    uint64_t i = 1;
-    do {
-        handle_client_publishes(status, client_id, &address);
-        persistent->start_client_transaction(&address);
-        if (status == AWAKE && !persistent->has_client_publishes()) {
-            persistent->set_client_state(ASLEEP);
-            uint8_t transaction_return = persistent->apply_transaction();
-            if (transaction_return == SUCCESS) {
-                mqttsn->send_pingresp(&address);
+void CoreImpl::handle_spool() {
+    if (!persistent->is_mqtt_online() || persistent->get_spool_count() == 0) {
+        return;
+    }
+    // the publishes in flight are the oldest ones of the spool
+    uint16_t in_flight_count = 0;
+    for (uint16_t i = 0; i < BROKER_PUBLISH_WINDOW; i++) {
+        if (broker_pending_publishes[i].used && broker_pending_publishes[i].spooled) {
+            in_flight_count++;
+        }
+    }
+    char topic_name[255];
+    uint8_t data[255];
+    uint8_t data_len;
+    uint8_t qos;
+    bool retain;
+    while (in_flight_count < SPOOL_DRAIN_BATCH_SIZE) {
+        int32_t pending_position = find_broker_pending_publish(nullptr, 0);
+        if (pending_position == -1) {
+            // the window is full, try again later
+            return;
+        }
+        memset(&topic_name, 0, sizeof(topic_name));
+        memset(&data, 0, sizeof(data));
+        if (!persistent->get_spool_publish(in_flight_count, topic_name, data, &data_len, &qos, &retain)) {
+            return;
+        }
+        uint16_t packet_id = 0;
+        if (!mqtt->publish_async(topic_name, data, data_len, retain, &packet_id)) {
+            // try again later
+#if CORE_LOG
+            logger->log("Spooled PUBLISH - SEND FAILURE", 1);
+#endif
+            return;
+        }
+        broker_pending_publish &pending = broker_pending_publishes[pending_position];
+        memset(&pending, 0, sizeof(broker_pending_publish));
+        pending.timestamp = system->get_timestamp();
+        pending.packet_id = packet_id;
+        pending.msg_id = in_flight_count;
+        pending.spooled = true;
+        pending.used = true;
+        in_flight_count++;
+    }
+}
+
+void CoreImpl::remove_acknowledged_spool_publishes() {
+    bool removed = true;
+    while (removed) {
+        removed = false;
+        for (uint16_t i = 0; i < BROKER_PUBLISH_WINDOW; i++) {
+            broker_pending_publish &pending = broker_pending_publishes[i];
+            if (!pending.used || !pending.spooled || !pending.acknowledged || pending.msg_id != 0) {
+                continue;
             }
-        } else {
-            uint8_t transaction_return = persistent->apply_transaction();
+            persistent->remove_next_spool_publish();
+            pending.used = false;
+            // the next one is the oldest now
+            for (uint16_t j = 0; j < BROKER_PUBLISH_WINDOW; j++) {
+                if (broker_pending_publishes[j].used && broker_pending_publishes[j].spooled) {
+                    broker_pending_publishes[j].msg_id--;
+                }
+            }
+            removed = true;
+            break;
         }
-        if (has_heart_beaten) {
-            handle_timeout(status, duration, elapsed_time, client_id, address, timeout);
+    }
+}
+
+void CoreImpl::handle_broker_pending_publishes() {
+    uint32_t timestamp = system->get_timestamp();
+    bool spool_timed_out = false;
+    for (uint16_t i = 0; i < BROKER_PUBLISH_WINDOW; i++) {
+        broker_pending_publish &pending = broker_pending_publishes[i];
+        if (pending.used && !pending.acknowledged && timestamp - pending.timestamp > BROKER_PUBACK_TIMEOUT) {
+            if (pending.spooled) {
+                spool_timed_out = true;
+                continue;
+            }
+            pending.used = false;
+#if CORE_LOG
+            logger->log("Forwarded PUBLISH - NO PUBACK FROM BROKER", 1);
+#endif
         }
-        persistent->get_nth_client(i++, client_id, &address, &status, &duration, &timeout);
-        bool is_address_empty = true;
-        for (uint8_t i = 0; i < sizeof(device_address); i++) {
-            if (address.bytes[i] != 0) {
-                is_address_empty = false;
-                break;
+    }
+    if (spool_timed_out) {
+        // the spool is removed in order, so handle_spool sends all publishes in flight again starting with the oldest
+        for (uint16_t i = 0; i < BROKER_PUBLISH_WINDOW; i++) {
+            if (broker_pending_publishes[i].spooled) {
+                broker_pending_publishes[i].used = false;
             }
         }
-        if (is_address_empty) {
-            return;
+#if CORE_LOG
+        logger->log("Spooled PUBLISH - NO PUBACK FROM BROKER", 1);
+#endif
+    }
+}
+
+int32_t CoreImpl::find_broker_pending_publish(device_address *address, uint16_t msg_id) {
+    for (uint16_t i = 0; i < BROKER_PUBLISH_WINDOW; i++) {
+        broker_pending_publish &pending = broker_pending_publishes[i];
+        if (address == nullptr) {
+            if (!pending.used) {
+                return i;
+            }
+        } else if (pending.used && pending.msg_id == msg_id &&
+                   memcmp(&pending.address, address, sizeof(device_address)) == 0) {
+            return i;
         }
-    } while (memcmp(&last_client_address, &address, sizeof(device_address)) != 0);
-    handle_client_publishes(status, client_id, &address);
-    persistent->start_client_transaction(&address);
+    }
+    return -1;
+}
+
+bool CoreImpl::spool_publish(const char *topic_name, const uint8_t *data, uint16_t data_len, bool retain) {
+    if (data_len > UINT8_MAX) {
+        return false;
+    }
+    if (persistent->get_spool_count() >= persistent->get_spool_capacity()) {
+        // dropping the oldest publish would drop one in flight, its PUBACK would then remove the wrong one
+        for (uint16_t i = 0; i < BROKER_PUBLISH_WINDOW; i++) {
+            if (broker_pending_publishes[i].used && broker_pending_publishes[i].spooled) {
+#if CORE_LOG
+                logger->append_log(" - SPOOL FULL AND DRAINING");
+#endif
+                return false;
+            }
+        }
+    }
+    return persistent->add_spool_publish(topic_name, data, (uint8_t) data_len, 1, retain);
+}
+
+CORE_RESULT CoreImpl::get_client_queue_depth(const char *client_id, uint16_t *publish_count,
+                                             uint32_t *publish_bytes) {
+    *publish_count = 0;
+    *publish_bytes = 0;
+    persistent->start_client_transaction(client_id);
+    if (!persistent->client_exist()) {
+        persistent->apply_transaction();
+        return CLIENTNONEXISTENCE;
+    }
+    persistent->get_client_publish_queue_depth(publish_count, publish_bytes);
+    if (persistent->apply_transaction() != SUCCESS) {
+        return ZERO;
+    }
+    return SUCCESS;
+}
+
+void CoreImpl::set_loop_budget(uint32_t microseconds) {
+    this->loop_budget = microseconds;
+}
+
+void CoreImpl::handle_client(CLIENT_STATUS status, char *client_id, device_address *address, uint32_t duration,
+                             uint32_t timeout) {
+    handle_client_publishes(status, client_id, address);
+    persistent->start_client_transaction(address);
     if (status == AWAKE && !persistent->has_client_publishes()) {
         persistent->set_client_state(ASLEEP);
         uint8_t transaction_return = persistent->apply_transaction();
         if (transaction_return == SUCCESS) {
-            mqttsn->send_pingresp(&address);
+            mqttsn->send_pingresp(address);
         }
     } else {
         uint8_t transaction_return = persistent->apply_transaction();
     }
-    if (has_heart_beaten) {
-        handle_timeout(status, duration, elapsed_time, client_id, address, timeout);
+    if (pass_has_heart_beaten) {
+        handle_timeout(status, duration, pass_elapsed_time, client_id, *address, timeout);
+    }
+}
+
+bool CoreImpl::is_address_empty(device_address *address) {
+    for (uint8_t i = 0; i < sizeof(device_address); i++) {
+        if (address->bytes[i] != 0) {
+            return false;
+        }
     }
+    return true;
 }
 
 void
@@ -275,6 +514,10 @@ CoreImpl::add_client(const char *client_id, uint16_t duration, bool clean_sessio
 
     uint8_t result = persistent->apply_transaction();
     if (result == SUCCESS) {
+        if (clean_session) {
+            // a new session starts its msg ids from scratch
+            duplicates.forget(address);
+        }
 #if CORE_LOG
         logger->set_current_log_lvl(1);
         logger->append_log(" - SUCCESS");
@@ -441,7 +684,7 @@ CoreImpl::publish(device_address *address, const uint8_t *data, uint16_t data_le
 #if CORE_LOG
     logger->start_log("Received PUBLISH", 1);
 #endif
-    if (!persistent->is_mqtt_online()) {
+    if (!persistent->is_mqtt_online() && (qos != 1 || persistent->get_spool_capacity() == 0)) {
 #if CORE_LOG
         logger->append_log(" - REJECTED MQTT OFFLINE");
 #endif
@@ -567,14 +810,75 @@ CoreImpl::publish(device_address *address, const uint8_t *data, uint16_t data_le
     if (qos == -1) {
         qos = 0;
     }
-    bool mqtt_result = mqtt->publish(topic_name, data, data_len, (uint8_t) qos, retain);
+    if (qos == 1 && dup && duplicates.contains(address, msg_id, system->get_timestamp())) {
+        // the PUBACK got lost, the original is already forwarded: only acknowledge again
+#if CORE_LOG
+        logger->append_log(" - DUPLICATE");
+#endif
+        return SUCCESS;
+    }
+    if (qos == 1 && dup && find_broker_pending_publish(address, msg_id) != -1) {
+        // the original still awaits the PUBACK of the broker, which is forwarded to the client
+#if CORE_LOG
+        logger->append_log(" - DUPLICATE PUBACK PENDING");
+#endif
+        return PUBACKPENDING;
+    }
+    bool mqtt_result = false;
+    // QoS 1 publishes queue up behind the spooled ones, so their order is kept
+    if (persistent->is_mqtt_online() && (qos != 1 || persistent->get_spool_count() == 0)) {
+        int32_t pending_position = -1;
+        if (qos == 1) {
+            pending_position = find_broker_pending_publish(nullptr, 0);
+        }
+        if (pending_position != -1) {
+            // pipelined: the broker's PUBACK arrives later through notify_mqtt_puback_arrived
+            uint16_t packet_id = 0;
+            mqtt_result = mqtt->publish_async(topic_name, data, data_len, retain, &packet_id);
+            if (mqtt_result) {
+                broker_pending_publish &pending = broker_pending_publishes[pending_position];
+                memcpy(&pending.address, address, sizeof(device_address));
+                pending.timestamp = system->get_timestamp();
+                pending.packet_id = packet_id;
+                pending.msg_id = msg_id;
+                pending.topic_id = topic_id;
+                pending.spooled = false;
+                pending.acknowledged = false;
+                pending.used = true;
+#if CORE_LOG
+                logger->append_log(" - SEND PUBACK PENDING");
+#endif
+                return PUBACKPENDING;
+            }
+        } else {
+            // QoS 0, or all pipelined publishes await their PUBACK: wait for the broker
+            mqtt_result = mqtt->publish(topic_name, data, data_len, (uint8_t) qos, retain);
+        }
+    }
 
+    if (!mqtt_result && qos == 1 && spool_publish(topic_name, data, data_len, retain)) {
+        duplicates.remember(address, msg_id, system->get_timestamp());
+#if CORE_LOG
+        logger->append_log(" - SPOOLED");
+#endif
+        return SUCCESS;
+    }
+    if (!mqtt_result && qos == 1 && persistent->get_spool_capacity() > 0 && data_len <= UINT8_MAX) {
+        // the spool is full, the client retries later
+#if CORE_LOG
+        logger->append_log(" - SPOOL FULL");
+#endif
+        return FULL;
+    }
     if (!mqtt_result) {
 #if CORE_LOG
         logger->append_log(" - SEND FAILURE");
 #endif
         return ZERO;
     }
+    if (qos == 1) {
+        duplicates.remember(address, msg_id, system->get_timestamp());
+    }
 #if CORE_LOG
     logger->append_log(" - SEND");
 #endif
@@ -720,8 +1024,9 @@ CoreImpl::add_subscription(device_address *address, uint16_t topic_id, uint16_t
         return TOPICIDNONEXISTENCE;
     }
 
+    bool covered = false;
     if (subscribe) {
-        if (!mqtt->subscribe(topic_name, 1)) {
+        if (!subscribe_topic(topic_name, &covered)) {
             persistent->decrement_global_subscription_count(topic_name);
 #if CORE_LOG
             logger->set_current_log_lvl(1);
@@ -732,6 +1037,14 @@ CoreImpl::add_subscription(device_address *address, uint16_t topic_id, uint16_t
     }
 
     if (result == SUCCESS) {
+        if (subscribe && !covered) {
+            // a new subscription of the gateway gets the retained message from the broker
+        } else if (retained_messages.contains(topic_name)) {
+            queue_retained_message(address, topic_name, *new_topic_id, *granted_qos);
+        } else {
+            // the cache only keeps some retained messages and drops them with newer publishes
+            fetch_retained_message(address, topic_name, *new_topic_id, *granted_qos);
+        }
 #if CORE_LOG
         logger->set_current_log_lvl(1);
         logger->append_log(") - SUCCESS");
@@ -775,7 +1088,7 @@ CoreImpl::delete_subscription(device_address *address, uint16_t topic_id, uint16
         return TOPICIDNONEXISTENCE;
     }
     if (unsubscribe) {
-        if (!mqtt->unsubscribe(topic_name)) {
+        if (!unsubscribe_topic(topic_name)) {
             return ZERO;
         }
     }
@@ -809,7 +1122,7 @@ CORE_RESULT CoreImpl::delete_subscription(device_address *address, char *topic_n
         return TOPICIDNONEXISTENCE;
     }
     if (unsubscribe) {
-        if (!mqtt->unsubscribe(topic_name)) {
+        if (!unsubscribe_topic(topic_name)) {
             return ZERO;
         }
     }
@@ -941,6 +1254,7 @@ CORE_RESULT CoreImpl::notify_regack_arrived(device_address *address, uint16_t to
     persistent->start_client_transaction(address);
     if (persistent->get_client_await_message_type() == MQTTSN_REGACK &&
         persistent->get_client_await_msg_id() == msg_id) {
+        retransmissions.cancel(address, msg_id, MQTTSN_REGISTER);
         if (return_code == ACCEPTED) {
             persistent->set_topic_known(topic_id, true);
             persistent->set_client_await_message(MQTTSN_PINGREQ);
@@ -979,13 +1293,20 @@ CORE_RESULT CoreImpl::notify_regack_arrived(device_address *address, uint16_t to
     }
 
     if (result == SUCCESS) {
+        deliver_awake_client_publishes(address);
         return SUCCESS;
     }
+    return ZERO;
 }
 
 CORE_RESULT CoreImpl::notify_puback_arrived(device_address *address, uint16_t msg_id, uint16_t topic_id,
                                             return_code_t return_code) {
     persistent->start_client_transaction(address);
+    if (persistent->get_client_await_message_type() == MQTTSN_PUBACK &&
+        persistent->get_client_await_msg_id() == msg_id) {
+        retransmissions.cancel(address, msg_id, MQTTSN_PUBLISH);
+        persistent->set_client_await_message(MQTTSN_PINGREQ);
+    }
     if (return_code == ACCEPTED) {
         persistent->remove_publish_by_msg_id(msg_id);
     } else if (return_code == REJECTED_CONGESTION) {
@@ -1016,6 +1337,7 @@ CORE_RESULT CoreImpl::notify_puback_arrived(device_address *address, uint16_t ms
     }
 
     if (result == SUCCESS) {
+        deliver_awake_client_publishes(address);
         return SUCCESS;
     }
     return ZERO;
@@ -1032,16 +1354,23 @@ CORE_RESULT CoreImpl::set_awake(device_address *address) {
     }
 
     if (result == SUCCESS) {
+        deliver_awake_client_publishes(address);
         return SUCCESS;
     }
     return ZERO;
 }
 
 CORE_RESULT CoreImpl::get_gateway_id(uint8_t *gateway_id) {
-    if (persistent->get_gateway_id(gateway_id)) {
-        return SUCCESS;
+    if (this->gateway_id == 0) {
+        // the gateway id does not change while running, load it only once
+        uint8_t loaded_gateway_id = 0;
+        if (!persistent->get_gateway_id(&loaded_gateway_id)) {
+            return ZERO;
+        }
+        this->gateway_id = loaded_gateway_id;
     }
-    return ZERO;
+    *gateway_id = this->gateway_id;
+    return SUCCESS;
 }
 
 CORE_RESULT CoreImpl::notify_mqttsn_disconnected() {
@@ -1053,6 +1382,11 @@ CORE_RESULT CoreImpl::notify_mqttsn_disconnected() {
 }
 
 CORE_RESULT CoreImpl::notify_mqtt_disconnected() {
+    // retained messages may change while we are offline
+    retained_messages.clear();
+    memset(&retained_fetches, 0, sizeof(retained_fetches));
+    // PUBACKs of the lost connection never arrive, the clients retransmit their publishes
+    memset(&broker_pending_publishes, 0, sizeof(broker_pending_publishes));
     uint8_t result = persistent->set_mqtt_disconnected();
     if (result == SUCCESS) {
         return SUCCESS;
@@ -1074,6 +1408,10 @@ CORE_RESULT CoreImpl::publish(char *topic_name, uint8_t *data, uint32_t data_len
     logger->append_log(topic_name);
     logger->append_log("')");
 #endif
+    retained_messages.update(topic_name, data, data_length, retain);
+    if (retain && deliver_fetched_retained_message(topic_name)) {
+        return SUCCESS;
+    }
     if (data_length > mqttsn->get_maximum_publish_payload_length()) {
 #if CORE_LOG
         logger->append_log(" - TOO MUCH PAYLOAD");
@@ -1088,6 +1426,13 @@ CORE_RESULT CoreImpl::publish(char *topic_name, uint8_t *data, uint32_t data_len
     logger->append_log(uint16_buf);
     logger->append_log(")");
 #endif
+    if (subscription_count == 0) {
+        // e.g. a topic only matched by a covering filter, the retained message is cached above
+#if CORE_DEBUG
+        logger->append_log(" - no subscribers");
+#endif
+        return SUCCESS;
+    }
 
     // TODO implement message saving
 #if CORE_LOG
@@ -1121,10 +1466,18 @@ CORE_RESULT CoreImpl::publish(char *topic_name, uint8_t *data, uint32_t data_len
         return SUCCESS;
     }
     // TODO fix loop (endless) // later
+    // the payload is saved once in the shared message store, the clients only queue a reference to it
+    uint16_t message_id = 0;
+    // predefined topics are known by all clients, they are delivered without registration
+    uint16_t predefined_topic_id = 0;
+    if (!persistent->get_predefined_topic_id(topic_name, &predefined_topic_id)) {
+        predefined_topic_id = 0;
+    }
     persistent->get_nth_client(0, client_id, &address, &status, &duration, &timeout);
     uint64_t i = 1;
     do {
-        handle_receive_mqtt_publish_for_client(topic_name, data, data_length, address, retain);
+        handle_receive_mqtt_publish_for_client(topic_name, data, data_length, address, retain, &message_id,
+                                               predefined_topic_id);
         persistent->get_nth_client(i++, client_id, &address, &status, &duration, &timeout);
 
         bool is_address_empty = true;
@@ -1140,12 +1493,17 @@ CORE_RESULT CoreImpl::publish(char *topic_name, uint8_t *data, uint32_t data_len
 
     } while (memcmp(&last_client_address, &address, sizeof(device_address)) != 0);
 
+    if (message_id != 0) {
+        // the queued publishes hold their own references
+        persistent->release_shared_message(message_id);
+    }
     return SUCCESS;
 }
 
 void CoreImpl::handle_receive_mqtt_publish_for_client(const char *topic_name, uint8_t *data, uint32_t data_length,
                                                       device_address &address,
-                                                      bool retain) {
+                                                      bool retain, uint16_t *message_id,
+                                                      uint16_t predefined_topic_id) {
     uint8_t transaction_return;
     persistent->start_client_transaction(&address);
     if ((persistent->get_client_status() == ACTIVE ||
@@ -1154,8 +1512,47 @@ void CoreImpl::handle_receive_mqtt_publish_for_client(const char *topic_name, ui
         int8_t qos = persistent->get_subscription_qos(topic_name);
         uint16_t topic_id = persistent->get_subscription_topic_id(topic_name);
 
+        if (qos == 0 && persistent->get_client_status() == ACTIVE &&
+            !persistent->has_client_publishes() &&
+            (predefined_topic_id != 0 || persistent->is_topic_known(topic_id))) {
+            // nothing to acknowledge and nothing queued before: send directly without saving the message
+            transaction_return = persistent->apply_transaction();
+            if (transaction_return == SUCCESS) {
+                if (predefined_topic_id != 0) {
+                    mqttsn->send_publish(&address, data, (uint8_t) data_length, 0, predefined_topic_id, false,
+                                         retain, 0, false);
+                } else {
+                    mqttsn->send_publish(&address, data, (uint8_t) data_length, 0, topic_id, true, retain, 0,
+                                         false);
+                }
+            }
+#if CORE_DEBUG
+            if (transaction_return != SUCCESS) {
+                logger->start_log(" - error", 3);
+                return;
+            }
+            logger->start_log(" - send directly", 3);
+#endif
+            return;
+        }
+
         // message are saved first, then processed during loop in handle_client_publish
-        persistent->add_new_client_publish(data, (uint8_t) data_length, topic_id, retain, (uint8_t) qos);
+        bool queued = queue_client_publish(message_id, data, (uint8_t) data_length, topic_id, predefined_topic_id,
+                                           retain, (uint8_t) qos);
+#if CORE_DEBUG
+        // the depth is kept in the client entry, reading it needs no scan
+        uint16_t publish_count = 0;
+        uint32_t publish_bytes = 0;
+        persistent->get_client_publish_queue_depth(&publish_count, &publish_bytes);
+        char uint32_buf[20];
+        logger->start_log(queued ? " - queued, depth " : " - dropped, depth ", 3);
+        sprintf(uint32_buf, "%d", publish_count);
+        logger->append_log(uint32_buf);
+        logger->append_log(" (");
+        sprintf(uint32_buf, "%d", publish_bytes);
+        logger->append_log(uint32_buf);
+        logger->append_log(" bytes)");
+#endif
 
     }
     // we cannot do anything with the return value, except logging
@@ -1193,11 +1590,32 @@ CORE_RESULT CoreImpl::get_mqtt_will(char *will_topic, char *will_msg, uint8_t *w
 CORE_RESULT CoreImpl::notify_mqtt_connected() {
     uint8_t result = persistent->set_mqtt_connected();
     if (result == SUCCESS) {
+        resubscribe();
         return SUCCESS;
     }
     return ZERO;
 }
 
+CORE_RESULT CoreImpl::notify_mqtt_puback_arrived(uint16_t packet_id) {
+    for (uint16_t i = 0; i < BROKER_PUBLISH_WINDOW; i++) {
+        broker_pending_publish &pending = broker_pending_publishes[i];
+        if (!pending.used || pending.packet_id != packet_id) {
+            continue;
+        }
+        if (pending.spooled) {
+            pending.acknowledged = true;
+            remove_acknowledged_spool_publishes();
+            return SUCCESS;
+        }
+        pending.used = false;
+        mqttsn->send_puback(&pending.address, pending.msg_id, pending.topic_id, ACCEPTED);
+        duplicates.remember(&pending.address, pending.msg_id, system->get_timestamp());
+        return SUCCESS;
+    }
+    // e.g. the PUBACK of a blocking publish
+    return ZERO;
+}
+
 CORE_RESULT CoreImpl::notify_mqttsn_connected() {
     uint8_t result = persistent->set_mqttsn_connected();
     if (result == SUCCESS) {
@@ -1212,42 +1630,298 @@ void CoreImpl::remove_client_subscriptions(const char *client_id) {
     logger->append_log(client_id);
 
 #endif
-    uint16_t client_subscription_count = 0;
-    while ((client_subscription_count = persistent->get_client_subscription_count()) > 0) {
+    // room for several maximum length topic names, so a batch removes more than a single subscription
+    char unsubscribe_topic_names[1024];
+    bool completed = false;
+    while (!completed) {
+        uint16_t unsubscribe_topic_count = persistent->remove_all_subscriptions(unsubscribe_topic_names,
+                                                                                sizeof(unsubscribe_topic_names),
+                                                                                &completed);
+        if (unsubscribe_topic_count > 0) {
+            // the publishes received while unsubscribing are given to the core and need transactions of their own,
+            // the removed subscriptions are already written, so the transaction of the client is restarted afterwards
+            persistent->apply_transaction();
+            // the topics and released covering filters are unsubscribed with pipelined UNSUBSCRIBE packets
+            char broker_topic_names[sizeof(unsubscribe_topic_names)];
+            uint16_t broker_topic_count = 0;
+            uint16_t position = 0;
+            const char *topic_name = unsubscribe_topic_names;
+            for (uint16_t i = 0; i < unsubscribe_topic_count; i++) {
 #if CORE_DEBUG
-        char uint16_buf[20];
-        sprintf(uint16_buf, "%d", client_subscription_count);
-        logger->start_log(" client_subscription_count ", 3);
-        logger->append_log(uint16_buf);
+                logger->start_log("unsusbcribe topic ", 3);
+                logger->append_log(topic_name);
 #endif
-        uint16_t topic_id = persistent->get_nth_subscribed_topic_id(client_subscription_count - (uint16_t) 1);
-        const char *topic_name = persistent->get_topic_name(topic_id);
+                char released_filter[SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1];
+                const char *broker_topic_name = get_unsubscribe_topic(topic_name, released_filter);
+                if (broker_topic_name != nullptr) {
+                    uint16_t broker_topic_name_length = (uint16_t) (strlen(broker_topic_name) + 1);
+                    if (position + broker_topic_name_length > sizeof(broker_topic_names)) {
+                        mqtt->unsubscribe_all(broker_topic_names, broker_topic_count);
+                        broker_topic_count = 0;
+                        position = 0;
+                    }
+                    memcpy(&broker_topic_names[position], broker_topic_name, broker_topic_name_length);
+                    position += broker_topic_name_length;
+                    broker_topic_count++;
+                }
+                topic_name += strlen(topic_name) + 1;
+            }
+            if (broker_topic_count > 0) {
+                mqtt->unsubscribe_all(broker_topic_names, broker_topic_count);
+            }
+            persistent->start_client_transaction(client_id);
+        }
+        if (!completed && unsubscribe_topic_count == 0 && persistent->get_client_subscription_count() == 0) {
+            // persistence error, do not loop forever
+            break;
+        }
+    }
+}
 
-#if CORE_DEBUG
-//        char uint16_buf[20];
-        sprintf(uint16_buf, "%d", topic_id);
-        logger->start_log("topic_id ", 4);
-        logger->append_log(uint16_buf);
-        logger->append_log(" topic_name");
-        logger->append_log(topic_name);
+void CoreImpl::resubscribe() {
+    // each buffer of topic names is subscribed with pipelined SUBSCRIBE packets in a single round trip
+    char topic_names[CORE_RESUBSCRIBE_BUFFER_LENGTH];
+    if (aggregated_subscriptions.get_count() > 0) {
+        // the covering filters first, the topics they cover are left out below
+        uint16_t filter_count = 0;
+        uint16_t position = 0;
+        for (uint16_t i = 0; i < SUBSCRIPTION_AGGREGATOR_CAPACITY; i++) {
+            const char *filter = aggregated_subscriptions.get_filter(i);
+            if (filter == nullptr) {
+                continue;
+            }
+            uint16_t filter_length = (uint16_t) (strlen(filter) + 1);
+            if (position + filter_length > sizeof(topic_names)) {
+                mqtt->subscribe_all(topic_names, filter_count, 1);
+                filter_count = 0;
+                position = 0;
+            }
+            memcpy(&topic_names[position], filter, filter_length);
+            position += filter_length;
+            filter_count++;
+        }
+        if (!mqtt->subscribe_all(topic_names, filter_count, 1)) {
+#if CORE_LOG
+            logger->start_log("resubscribe - SUBSCRIPTION FAILED", 1);
 #endif
-        persistent->delete_subscription(topic_id);
-        persistent->decrement_global_subscription_count(topic_name);
-        uint32_t subscription_count = persistent->get_global_topic_subscription_count(topic_name);
+            if (!persistent->is_mqtt_online()) {
+                return;
+            }
+        }
+    }
+    uint32_t cursor = 0;
+    bool completed = false;
+    while (!completed) {
+        uint16_t topic_count = persistent->get_global_subscriptions(topic_names, sizeof(topic_names), &cursor,
+                                                                    &completed);
+        if (aggregated_subscriptions.get_count() > 0) {
+            // compact the buffer in place, without the covered topics
+            const char *topic_name = topic_names;
+            char *kept_topic_name = topic_names;
+            uint16_t kept_topic_count = 0;
+            for (uint16_t i = 0; i < topic_count; i++) {
+                size_t topic_name_length = strlen(topic_name) + 1;
+                if (!aggregated_subscriptions.is_covered(topic_name)) {
+                    memmove(kept_topic_name, topic_name, topic_name_length);
+                    kept_topic_name += topic_name_length;
+                    kept_topic_count++;
+                }
+                topic_name += topic_name_length;
+            }
+            topic_count = kept_topic_count;
+        }
+        if (topic_count == 0) {
+            continue;
+        }
 #if CORE_DEBUG
-        logger->start_log(" subscriptin count ", 3);
-        sprintf(uint16_buf, "%d", subscription_count);
+        char uint16_buf[6];
+        sprintf(uint16_buf, "%d", topic_count);
+        logger->start_log("resubscribe topics ", 3);
         logger->append_log(uint16_buf);
 #endif
-        if (subscription_count == 0) {
-#if CORE_DEBUG
-            logger->log("unsusbcribe topic", 3);
+        if (!mqtt->subscribe_all(topic_names, topic_count, 1)) {
+#if CORE_LOG
+            logger->start_log("resubscribe - SUBSCRIPTION FAILED", 1);
 #endif
+            if (!persistent->is_mqtt_online()) {
+                break;
+            }
+        }
+    }
+}
+
+bool CoreImpl::subscribe_topic(const char *topic_name, bool *covered) {
+    *covered = false;
+    if (aggregated_subscriptions.is_enabled()) {
+        if (aggregated_subscriptions.cover(topic_name)) {
+            *covered = true;
+            return true;
+        }
+        if (aggregate_subscription(topic_name)) {
+            return true;
+        }
+    }
+    return mqtt->subscribe(topic_name, 1);
+}
+
+bool CoreImpl::aggregate_subscription(const char *topic_name) {
+    if (!aggregated_subscriptions.has_room()) {
+        return false;
+    }
+    // one candidate filter per level of the topic
+    char candidates[SUBSCRIPTION_AGGREGATOR_MAXIMUM_LEVELS][SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1];
+    uint16_t candidate_topic_counts[SUBSCRIPTION_AGGREGATOR_MAXIMUM_LEVELS];
+    uint8_t candidate_count = 0;
+    while (candidate_count < SUBSCRIPTION_AGGREGATOR_MAXIMUM_LEVELS &&
+           SubscriptionAggregator::get_candidate(topic_name, candidate_count, candidates[candidate_count])) {
+        candidate_topic_counts[candidate_count] = 0;
+        if (aggregated_subscriptions.overlaps(candidates[candidate_count])) {
+            // an overlapping filter would count topics twice, the emptied candidate matches no topic
+            candidates[candidate_count][0] = 0;
+        }
+        candidate_count++;
+    }
+    if (candidate_count == 0) {
+        return false;
+    }
+
+    // the global subscription table already contains the topic itself
+    // subscribed filters are skipped by matches, they are neither counted nor unsubscribed below
+    char topic_names[CORE_RESUBSCRIBE_BUFFER_LENGTH];
+    uint32_t cursor = 0;
+    bool completed = false;
+    while (!completed) {
+        uint16_t topic_count = persistent->get_global_subscriptions(topic_names, sizeof(topic_names), &cursor,
+                                                                    &completed);
+        const char *subscribed_topic_name = topic_names;
+        for (uint16_t i = 0; i < topic_count; i++) {
+            for (uint8_t c = 0; c < candidate_count; c++) {
+                if (candidates[c][0] != 0 && SubscriptionAggregator::matches(candidates[c], subscribed_topic_name)) {
+                    candidate_topic_counts[c]++;
+                }
+            }
+            subscribed_topic_name += strlen(subscribed_topic_name) + 1;
+        }
+    }
+
+    uint8_t best = 0;
+    for (uint8_t c = 1; c < candidate_count; c++) {
+        if (candidate_topic_counts[c] > candidate_topic_counts[best]) {
+            best = c;
+        }
+    }
+    if (candidate_topic_counts[best] < aggregated_subscriptions.get_threshold()) {
+        return false;
+    }
+    const char *filter = candidates[best];
+    if (!mqtt->subscribe(filter, 1)) {
+        return false;
+    }
+#if CORE_LOG
+    char uint16_buf[6];
+    sprintf(uint16_buf, "%d", candidate_topic_counts[best]);
+    logger->start_log("aggregate subscription ", 1);
+    logger->append_log(filter);
+    logger->append_log(" covering ");
+    logger->append_log(uint16_buf);
+    logger->append_log(" topics");
+#endif
+
+    // the filter delivers the messages of the siblings now, their own subscriptions are not needed anymore
+    cursor = 0;
+    completed = false;
+    while (!completed) {
+        uint16_t topic_count = persistent->get_global_subscriptions(topic_names, sizeof(topic_names), &cursor,
+                                                                    &completed);
+        const char *subscribed_topic_name = topic_names;
+        for (uint16_t i = 0; i < topic_count; i++) {
+            if (strcmp(subscribed_topic_name, topic_name) != 0 &&
+                SubscriptionAggregator::matches(filter, subscribed_topic_name)) {
+                mqtt->unsubscribe(subscribed_topic_name);
+            }
+            subscribed_topic_name += strlen(subscribed_topic_name) + 1;
+        }
+    }
+    aggregated_subscriptions.add(filter, candidate_topic_counts[best]);
+    return true;
+}
+
+void CoreImpl::fetch_retained_message(device_address *address, const char *topic_name, uint16_t topic_id,
+                                      uint8_t qos) {
+    if (strlen(topic_name) > RETAINED_MESSAGE_TOPIC_LENGTH) {
+        return;
+    }
+    uint32_t timestamp = system->get_timestamp();
+    int32_t fetch_position = -1;
+    for (uint16_t i = 0; i < RETAINED_FETCH_CAPACITY; i++) {
+        if (!retained_fetches[i].used || timestamp - retained_fetches[i].timestamp > RETAINED_FETCH_TIMEOUT) {
+            fetch_position = i;
+            break;
+        }
+    }
+    if (fetch_position == -1) {
+#if CORE_LOG
+        logger->append_log(" - RETAINED NOT FETCHED");
+#endif
+        return;
+    }
+    retained_fetch &fetch = retained_fetches[fetch_position];
+    memset(&fetch, 0, sizeof(retained_fetch));
+    strcpy(fetch.topic_name, topic_name);
+    memcpy(&fetch.address, address, sizeof(device_address));
+    fetch.timestamp = timestamp;
+    fetch.topic_id = topic_id;
+    fetch.qos = qos;
+    fetch.used = true;
+
+    if (aggregated_subscriptions.is_covered(topic_name)) {
+        // the retained message arrives right after the SUBACK, so it is handed to the core while unsubscribing
+        if (mqtt->subscribe(topic_name, 1)) {
             mqtt->unsubscribe(topic_name);
         }
+    } else {
+        // a subscription replaces the existing one, the broker sends the retained message again
+        mqtt->subscribe(topic_name, 1);
     }
 }
 
+bool CoreImpl::deliver_fetched_retained_message(const char *topic_name) {
+    uint32_t timestamp = system->get_timestamp();
+    bool delivered = false;
+    for (uint16_t i = 0; i < RETAINED_FETCH_CAPACITY; i++) {
+        retained_fetch &fetch = retained_fetches[i];
+        if (!fetch.used || timestamp - fetch.timestamp > RETAINED_FETCH_TIMEOUT ||
+            strcmp(fetch.topic_name, topic_name) != 0) {
+            continue;
+        }
+        fetch.used = false;
+        queue_retained_message(&fetch.address, topic_name, fetch.topic_id, fetch.qos);
+        delivered = true;
+    }
+    return delivered;
+}
+
+bool CoreImpl::unsubscribe_topic(const char *topic_name) {
+    char released_filter[SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1];
+    const char *broker_topic_name = get_unsubscribe_topic(topic_name, released_filter);
+    if (broker_topic_name == nullptr) {
+        return true;
+    }
+    return mqtt->unsubscribe(broker_topic_name);
+}
+
+const char *CoreImpl::get_unsubscribe_topic(const char *topic_name, char *released_filter) {
+    retained_messages.remove(topic_name);
+    if (aggregated_subscriptions.uncover(topic_name, released_filter)) {
+        if (released_filter[0] == 0) {
+            // the filter still covers other subscribed topics
+            return nullptr;
+        }
+        return released_filter;
+    }
+    return topic_name;
+}
+
 void CoreImpl::process_mqttsn_offline_procedure() {
     char will_topic[255];
     memset(&will_topic, 0, sizeof(will_topic));
@@ -1375,7 +2049,7 @@ void CoreImpl::set_all_clients_lost() {
     }
 }
 
-void CoreImpl::handle_client_publishes(CLIENT_STATUS status, const char *client_id, device_address *address) {
+bool CoreImpl::handle_client_publishes(CLIENT_STATUS status, const char *client_id, device_address *address) {
     uint8_t transaction_return;
     if (status == AWAKE || status == ACTIVE) {
         persistent->start_client_transaction(address);
@@ -1384,17 +2058,25 @@ void CoreImpl::handle_client_publishes(CLIENT_STATUS status, const char *client_
             memset(&databuffer, 0, sizeof(databuffer));
             uint8_t data_len;
             uint16_t topic_id;
+            bool predefined_topic;
             bool retain;
             bool dup;
             uint8_t qos;
             uint16_t publish_id;
-            persistent->get_next_publish(databuffer, &data_len, &topic_id, &retain, &qos, &dup, &publish_id);
-            if (!persistent->is_topic_known(topic_id)) {
+            persistent->get_next_publish(databuffer, &data_len, &topic_id, &predefined_topic, &retain, &qos, &dup,
+                                         &publish_id);
+            // predefined topic ids are known by all clients
+            if (!predefined_topic && !persistent->is_topic_known(topic_id)) {
                 // register first
                 const char *topic_name = persistent->get_topic_name(topic_id);
                 if (topic_name == nullptr) {
                     transaction_return = persistent->apply_transaction();
-                    return;
+                    return false;
+                }
+                if (!retransmissions.has_room(address)) {
+                    // without tracking the REGACK the REGISTER is never retransmitted, send it in a later pass
+                    transaction_return = persistent->apply_transaction();
+                    return false;
                 }
 
                 uint16_t msg_id = persistent->get_client_await_msg_id();
@@ -1406,21 +2088,32 @@ void CoreImpl::handle_client_publishes(CLIENT_STATUS status, const char *client_
                 transaction_return = persistent->apply_transaction();
                 if (transaction_return == SUCCESS) {
                     mqttsn->send_register(address, topic_id, msg_id, topic_name);
+                    if (!retransmissions.schedule(address, msg_id, topic_id, MQTTSN_REGISTER,
+                                                  system->get_timestamp())) {
+#if CORE_LOG
+                        logger->log("REGISTER not scheduled for retransmission - FULL", 1);
+#endif
+                    }
                 }
-                return;
+                return false;
             }
 
             if (qos == 0) {
                 persistent->remove_publish_by_publish_id(publish_id);
                 transaction_return = persistent->apply_transaction();
                 if (transaction_return == SUCCESS) {
-                    mqttsn->send_publish(address, databuffer, (uint8_t) data_len, 0, topic_id, true, retain,
-                                         (uint8_t) qos,
-                                         false);
-                    return;
+                    return mqttsn->send_publish(address, databuffer, (uint8_t) data_len, 0, topic_id,
+                                                !predefined_topic, retain,
+                                                (uint8_t) qos,
+                                                false);
                 }
-                return;
+                return false;
             } else if (qos == 1) {
+                if (!retransmissions.has_room(address)) {
+                    // without tracking the PUBACK the PUBLISH is never retransmitted, send it in a later pass
+                    transaction_return = persistent->apply_transaction();
+                    return false;
+                }
                 uint16_t msg_id = persistent->get_client_await_msg_id();
                 (msg_id + 1 == 0) ? msg_id = 1 : msg_id += 1;
 
@@ -1428,22 +2121,262 @@ void CoreImpl::handle_client_publishes(CLIENT_STATUS status, const char *client_
                 persistent->set_client_await_message(MQTTSN_PUBACK);
 
                 persistent->set_publish_msg_id(publish_id, msg_id);
+                uint32_t timestamp = system->get_timestamp();
+                persistent->set_publish_retransmission(publish_id, dup,
+                                                       RetransmissionScheduler::get_deadline(timestamp, 0));
 
                 transaction_return = persistent->apply_transaction();
                 if (transaction_return == SUCCESS) {
                     mqttsn->send_publish(address, (uint8_t *) &databuffer, (uint8_t) data_len, msg_id, topic_id,
-                                         true,
+                                         !predefined_topic,
                                          retain,
-                                         (uint8_t) qos, false);
-                    return;
+                                         (uint8_t) qos, dup);
+                    if (!retransmissions.schedule(address, msg_id, topic_id, MQTTSN_PUBLISH, timestamp)) {
+#if CORE_LOG
+                        logger->log("PUBLISH not scheduled for retransmission - FULL", 1);
+#endif
+                    }
+                    return false;
                 }
-                return;
+                return false;
             } else if (qos == 2) {
                 // NOT_SUPPORTED qos 2 is not supported!
             }
         }
         transaction_return = persistent->apply_transaction();
     }
+    return false;
+}
+
+void CoreImpl::deliver_awake_client_publishes(device_address *address) {
+    persistent->start_client_transaction(address);
+    CLIENT_STATUS status = persistent->get_client_status();
+    uint8_t transaction_return = persistent->apply_transaction();
+    if (transaction_return != SUCCESS || status != AWAKE) {
+        return;
+    }
+
+    // QoS 0 publishes need no acknowledge and are send back-to-back,
+    // a QoS 1 publish or a REGISTER stops the burst until its acknowledge arrives
+    while (handle_client_publishes(status, nullptr, address)) {}
+
+    persistent->start_client_transaction(address);
+    if (persistent->get_client_await_message_type() == MQTTSN_PINGREQ && !persistent->has_client_publishes()) {
+        persistent->set_client_state(ASLEEP);
+        transaction_return = persistent->apply_transaction();
+        if (transaction_return == SUCCESS) {
+            mqttsn->send_pingresp(address);
+        }
+        return;
+    }
+    persistent->apply_transaction();
+}
+
+void CoreImpl::set_advertising(bool advertising) {
+    this->advertising = advertising;
+}
+
+void CoreImpl::handle_advertise() {
+    if (!advertising) {
+        return;
+    }
+    uint32_t timestamp = system->get_timestamp();
+    if (!advertise_scheduled) {
+        next_advertise_timestamp = timestamp + system->get_random(((uint32_t) T_SEARCH_GW) * 1000);
+        advertise_scheduled = true;
+        return;
+    }
+    if ((int32_t) (timestamp - next_advertise_timestamp) < 0) {
+        return;
+    }
+
+    uint16_t duration = persistent->get_advertise_duration();
+    if (duration == 0) {
+        duration = T_ADV;
+    }
+    uint8_t gw_id = 0;
+    if (get_gateway_id(&gw_id) == SUCCESS && gw_id > 0) {
+#if CORE_DEBUG
+        char uint16_buf[20];
+        logger->start_log("Send ADVERTISE (g", 2);
+        sprintf(uint16_buf, "%d", gw_id);
+        logger->append_log(uint16_buf);
+        logger->append_log(", d");
+        sprintf(uint16_buf, "%d", duration);
+        logger->append_log(uint16_buf);
+        logger->append_log(")");
+#endif
+        mqttsn->send_advertise(gw_id, duration);
+    }
+    // send the next ADVERTISE up to 10% earlier then announced, so clients never miss it
+    uint32_t period = ((uint32_t) duration) * 1000;
+    next_advertise_timestamp = timestamp + period - system->get_random(period / 10 + 1);
+}
+
+void CoreImpl::handle_retransmissions() {
+    uint32_t timestamp = system->get_timestamp();
+    retransmission_entry entry;
+    while (retransmissions.pop_due(timestamp, &entry)) {
+        handle_retransmission(&entry, timestamp);
+    }
+}
+
+void CoreImpl::handle_retransmission(retransmission_entry *entry, uint32_t timestamp) {
+    uint8_t transaction_return;
+    message_type await_type = entry->type == MQTTSN_PUBLISH ? MQTTSN_PUBACK : MQTTSN_REGACK;
+    persistent->start_client_transaction(&entry->address);
+    if (persistent->get_client_await_message_type() != await_type ||
+        persistent->get_client_await_msg_id() != entry->msg_id) {
+        // acknowledge arrived meanwhile or the client reconnected
+        persistent->apply_transaction();
+        return;
+    }
+#if CORE_LOG
+    logger->start_log("Retransmit ", 1);
+    logger->append_log(entry->type == MQTTSN_PUBLISH ? "PUBLISH" : "REGISTER");
+    char client_id[24];
+    memset(client_id, 0, sizeof(client_id));
+    persistent->get_client_id(client_id);
+    logger->append_log(" to ");
+    logger->append_log(client_id);
+    char uint16_buf[20];
+    logger->append_log(" (t");
+    sprintf(uint16_buf, "%d", entry->topic_id);
+    logger->append_log(uint16_buf);
+    logger->append_log(", m");
+    sprintf(uint16_buf, "%d", entry->msg_id);
+    logger->append_log(uint16_buf);
+    logger->append_log(", r");
+    sprintf(uint16_buf, "%d", entry->retries);
+    logger->append_log(uint16_buf);
+    logger->append_log(")");
+#endif
+
+    uint8_t databuffer[255];
+    memset(&databuffer, 0, sizeof(databuffer));
+    uint8_t data_len = 0;
+    uint16_t topic_id = 0;
+    bool predefined_topic = false;
+    bool retain = false;
+    bool dup = false;
+    uint8_t qos = 0;
+    uint16_t publish_id = 0;
+    if (entry->type == MQTTSN_PUBLISH) {
+        persistent->get_publish_by_msg_id(entry->msg_id, databuffer, &data_len, &topic_id, &predefined_topic,
+                                          &retain, &qos, &dup, &publish_id);
+    }
+
+    CLIENT_STATUS status = persistent->get_client_status();
+    if (status != ACTIVE && status != AWAKE) {
+        // the client fell asleep or disconnected, the message is delivered again when it is back
+        persistent->set_client_await_message(MQTTSN_PINGREQ);
+        if (publish_id != 0) {
+            persistent->set_publish_retransmission(publish_id, true, 0);
+        }
+        persistent->apply_transaction();
+#if CORE_LOG
+        logger->append_log(" - DEFERRED CLIENT NOT ACTIVE");
+#endif
+        return;
+    }
+
+    if (entry->retries >= N_RETRY) {
+        // give up, the client did not acknowledge N_RETRY retransmissions
+        persistent->set_client_await_message(MQTTSN_PINGREQ);
+        if (publish_id != 0) {
+            persistent->set_publish_retransmission(publish_id, true, 0);
+        }
+        persistent->set_client_state(LOST);
+        persistent->apply_transaction();
+#if CORE_LOG
+        logger->append_log(" - NO ACKNOWLEDGE, LOST");
+#endif
+        return;
+    }
+
+    if (entry->type == MQTTSN_PUBLISH) {
+        if (publish_id == 0) {
+            // the publish does not exist anymore
+            persistent->set_client_await_message(MQTTSN_PINGREQ);
+            persistent->apply_transaction();
+#if CORE_LOG
+            logger->append_log(" - PUBLISH REMOVED");
+#endif
+            return;
+        }
+        bool rescheduled = retransmissions.reschedule(entry, timestamp);
+        persistent->set_publish_retransmission(publish_id, true, entry->deadline);
+        transaction_return = persistent->apply_transaction();
+        if (transaction_return == SUCCESS) {
+            mqttsn->send_publish(&entry->address, databuffer, data_len, entry->msg_id, topic_id, !predefined_topic,
+                                 retain, qos, true);
+        }
+#if CORE_LOG
+        if (!rescheduled) {
+            logger->append_log(" - NOT RESCHEDULED FULL");
+        }
+#endif
+        return;
+    }
+
+    const char *topic_name = persistent->get_topic_name(entry->topic_id);
+    if (topic_name == nullptr) {
+        persistent->set_client_await_message(MQTTSN_PINGREQ);
+        persistent->apply_transaction();
+#if CORE_LOG
+        logger->append_log(" - TOPIC ID UNKNOWN");
+#endif
+        return;
+    }
+    bool rescheduled = retransmissions.reschedule(entry, timestamp);
+    transaction_return = persistent->apply_transaction();
+    if (transaction_return == SUCCESS) {
+        mqttsn->send_register(&entry->address, entry->topic_id, entry->msg_id, topic_name);
+    }
+#if CORE_LOG
+    if (!rescheduled) {
+        logger->append_log(" - NOT RESCHEDULED FULL");
+    }
+#endif
+}
+
+void CoreImpl::queue_retained_message(device_address *address, const char *topic_name, uint16_t topic_id,
+                                      uint8_t qos) {
+    uint8_t payload[RETAINED_MESSAGE_PAYLOAD_LENGTH];
+    uint8_t payload_length = 0;
+    if (!retained_messages.get(topic_name, payload, &payload_length)) {
+        return;
+    }
+    if (payload_length > mqttsn->get_maximum_publish_payload_length()) {
+        return;
+    }
+    uint16_t predefined_topic_id = 0;
+    if (!persistent->get_predefined_topic_id(topic_name, &predefined_topic_id)) {
+        predefined_topic_id = 0;
+    }
+    uint16_t message_id = 0;
+    persistent->start_client_transaction(address);
+    bool queued = queue_client_publish(&message_id, payload, payload_length, topic_id, predefined_topic_id, true,
+                                       qos);
+    persistent->apply_transaction();
+    if (message_id != 0) {
+        persistent->release_shared_message(message_id);
+    }
+#if CORE_LOG
+    logger->append_log(queued ? " - RETAINED QUEUED" : " - RETAINED DROPPED");
+#endif
+}
+
+bool CoreImpl::queue_client_publish(uint16_t *message_id, uint8_t *data, uint8_t data_length, uint16_t topic_id,
+                                    uint16_t predefined_topic_id, bool retain, uint8_t qos) {
+    if (*message_id == 0) {
+        *message_id = persistent->add_shared_message(data, data_length);
+    }
+    if (predefined_topic_id != 0) {
+        return persistent->add_client_shared_publish(*message_id, data_length, predefined_topic_id, true, retain,
+                                                     qos);
+    }
+    return persistent->add_client_shared_publish(*message_id, data_length, topic_id, false, retain, qos);
 }
 
 void CoreImpl::append_device_address(device_address *pAddress) {
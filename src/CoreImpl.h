@@ -7,6 +7,61 @@
 
 
 #include "CoreInterface.h"
+#include "RetransmissionScheduler.h"
+#include "DuplicatePublishCache.h"
+#include "RetainedMessageCache.h"
+#include "SubscriptionAggregator.h"
+
+#ifndef SPOOL_DRAIN_BATCH_SIZE
+#define SPOOL_DRAIN_BATCH_SIZE 8 // spooled publishes awaiting the PUBACK of the broker at the same time
+#endif
+
+#ifndef BROKER_PUBLISH_WINDOW
+#define BROKER_PUBLISH_WINDOW 16 // client QoS 1 publishes awaiting the PUBACK of the broker at the same time
+#endif
+
+// a publish not acknowledged by the broker within T_RETRY is given up, the client retransmits it anyway
+#define BROKER_PUBACK_TIMEOUT (T_RETRY * 1000UL)
+
+#define SPOOL_RETRY_TIMEOUT 100 // milliseconds until the spool sends again after the broker refused a publish
+
+struct broker_pending_publish {
+    device_address address;
+    uint32_t timestamp;
+    uint16_t packet_id;
+    uint16_t msg_id;
+    uint16_t topic_id;
+    bool spooled; // a publish of the spool without a client, msg_id holds its position in the spool
+    bool acknowledged; // of a spooled publish, it is removed from the spool once all older ones are acknowledged
+    bool used;
+};
+
+#ifndef RETAINED_FETCH_CAPACITY
+#define RETAINED_FETCH_CAPACITY 8 // client subscriptions waiting for a retained message not in the cache
+#endif
+
+#define RETAINED_FETCH_TIMEOUT 10000 // milliseconds the broker has to send a fetched retained message
+
+struct retained_fetch {
+    char topic_name[RETAINED_MESSAGE_TOPIC_LENGTH + 1];
+    device_address address;
+    uint32_t timestamp;
+    uint16_t topic_id;
+    uint8_t qos;
+    bool used;
+};
+
+#ifndef CORE_LOOP_BUDGET_US
+#define CORE_LOOP_BUDGET_US 20000 // microseconds a single loop call may spend on the clients, 0 for no limit
+#endif
+
+#ifndef BROKER_STATISTICS_LOG_PERIOD
+#define BROKER_STATISTICS_LOG_PERIOD 60000 // milliseconds between the logs of the publishes dropped from the broker
+#endif
+
+#ifndef CORE_RESUBSCRIBE_BUFFER_LENGTH
+#define CORE_RESUBSCRIBE_BUFFER_LENGTH 4096 // bytes of topic names resubscribed per round trip, at least 255
+#endif
 
 class CoreImpl : public Core{
 private:
@@ -15,6 +70,27 @@ private:
     MqttSnMessageHandler *mqttsn = nullptr;
     LoggerInterface *logger = nullptr;
     System *system = nullptr;
+    RetransmissionScheduler retransmissions;
+    DuplicatePublishCache duplicates;
+    RetainedMessageCache retained_messages;
+    SubscriptionAggregator aggregated_subscriptions;
+    // QoS 1 publishes of clients forwarded with publish_async, the client gets its PUBACK with the broker's PUBACK
+    broker_pending_publish broker_pending_publishes[BROKER_PUBLISH_WINDOW];
+    // subscriptions which get their retained message from the broker instead of the cache
+    retained_fetch retained_fetches[RETAINED_FETCH_CAPACITY];
+    uint8_t gateway_id = 0;
+    bool advertising = true;
+    bool advertise_scheduled = false;
+    uint32_t next_advertise_timestamp = 0;
+    uint32_t next_broker_statistics_timestamp = 0;
+    uint32_t logged_broker_dropped_count = 0;
+
+    // state of the client pass, resumed by the next loop call if the loop budget is spent
+    uint32_t loop_budget = CORE_LOOP_BUDGET_US;
+    uint64_t client_cursor = 0;
+    device_address pass_last_client_address;
+    bool pass_has_heart_beaten = false;
+    uint32_t pass_elapsed_time = 0;
 
 
 public:
@@ -32,6 +108,13 @@ public:
 
     virtual void loop();
 
+    /**
+     * Gets the time until loop has to run again if no message arrives, e.g. for the epoll_wait of an event loop.
+     * Considers the retransmissions, the advertise, the PUBACKs of the broker and the client timeouts.
+     * @return the milliseconds until the next timer of the core is due, 0 if loop has to run right away
+     */
+    uint32_t get_next_timeout();
+
     virtual CORE_RESULT
     add_client(const char *client_id,  uint16_t duration, bool clean_session,device_address *address);
 
@@ -88,23 +171,192 @@ public:
 
     virtual CORE_RESULT notify_mqtt_connected();
 
+    virtual CORE_RESULT notify_mqtt_puback_arrived(uint16_t packet_id);
+
     virtual CORE_RESULT notify_mqttsn_connected();
+
+    /**
+     * Enables or disables the periodic ADVERTISE broadcast, enabled by default.
+     * Disable it if several cores share the same network.
+     */
+    void set_advertising(bool advertising);
+
+    /**
+     * Limits the time a single loop call spends on the clients (saved publishes, timeouts).
+     * If the budget is spent, the next loop call continues with the next client.
+     * So a large number of clients does not delay the handling of received messages.
+     * Retransmissions and ADVERTISE are handled in each loop call before the clients.
+     * @param microseconds budget, 0 to handle all clients in each loop call
+     */
+    void set_loop_budget(uint32_t microseconds);
+
+    /**
+     * Gets the depth of the publish queue of a client for monitoring, it is read from the client entry.
+     * Call it outside of client transactions.
+     * @param publish_count number of queued publishes
+     * @param publish_bytes sum of the payload lengths of the queued publishes
+     * @return CLIENTNONEXISTENCE if the client is unknown
+     */
+    CORE_RESULT get_client_queue_depth(const char *client_id, uint16_t *publish_count, uint32_t *publish_bytes);
 private:
+    /**
+     * Removes all subscriptions of the client and unsubscribes the topics nobody else subscribed, with as few
+     * round trips to the broker as possible.
+     * Call it inside the transaction of the client, the transaction is interrupted while unsubscribing at the broker.
+     */
     void remove_client_subscriptions(const char *client_id);
+
+    /**
+     * Subscribes all topics of the global subscription table at the broker again.
+     * The broker connection uses a clean session, so the subscriptions are lost with each reconnect.
+     */
+    void resubscribe();
+
+    /**
+     * Subscribes a topic at the broker, the gateway's first client subscribed to it.
+     * With subscription aggregation enabled a topic covered by a filter is not subscribed on its own and a topic
+     * completing a group of topics differing in a single level is subscribed with a new covering filter.
+     * @param covered set to true if an existing filter covers the topic, so the broker sends no retained message
+     * @return false if the subscription at the broker failed
+     */
+    bool subscribe_topic(const char *topic_name, bool *covered);
+
+    /**
+     * Subscribes a covering filter for the topic if it and its subscribed siblings reach the aggregation threshold.
+     * The siblings subscribed on their own are unsubscribed at the broker afterwards.
+     * @return false if no filter is subscribed, the topic has to be subscribed on its own
+     */
+    bool aggregate_subscription(const char *topic_name);
+
+    /**
+     * Lets the broker send the retained message of the topic again, for a client subscription whose retained
+     * message is not cached (anymore). The topic is subscribed again, a topic covered by a filter is subscribed
+     * and unsubscribed on its own.
+     * The retained message is only delivered to the clients waiting for it, see deliver_fetched_retained_message.
+     */
+    void fetch_retained_message(device_address *address, const char *topic_name, uint16_t topic_id, uint8_t qos);
+
+    /**
+     * Queues a retained message from the broker for the clients which fetched it.
+     * The other subscribers of the topic got the retained message with their own subscription.
+     * @return true if a client fetched the retained message
+     */
+    bool deliver_fetched_retained_message(const char *topic_name);
+
+    /**
+     * Unsubscribes a topic at the broker, the gateway's last client unsubscribed from it.
+     * A topic covered by a filter only unsubscribes the filter if it covers no other topic anymore.
+     * @return false if the unsubscription at the broker failed
+     */
+    bool unsubscribe_topic(const char *topic_name);
+
+    /**
+     * Removes a topic the gateway's last client unsubscribed from the caches and the covering filters.
+     * @param released_filter buffer with at least SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1 bytes
+     * @return the topic or the released covering filter to unsubscribe at the broker, nullptr if a filter still
+     * covers other topics
+     */
+    const char *get_unsubscribe_topic(const char *topic_name, char *released_filter);
     void process_mqttsn_offline_procedure();
     void process_mqtt_offline_procedure();
 
     void set_all_clients_lost();
 
+    void handle_client(CLIENT_STATUS status, char *client_id, device_address *address, uint32_t duration,
+                       uint32_t timeout);
+
+    bool is_address_empty(device_address *address);
+
     void handle_timeout(const CLIENT_STATUS &status, uint32_t duration, uint32_t elapsed_time, char *client_id,
                         device_address &address,
                         uint32_t &timeout);
 
+    /**
+     * Queues or sends the publish for a single client.
+     * @param message_id of the payload in the shared message store, saved with the first client queueing the
+     * publish, 0 until then
+     * @param predefined_topic_id of the topic name, 0 if it is not predefined and must be registered
+     */
     void handle_receive_mqtt_publish_for_client(const char *topic_name, uint8_t *data, uint32_t data_length,
                                                 device_address &address,
-                                                bool retain);
-
-    void handle_client_publishes(CLIENT_STATUS status, const char *client_id, device_address *address);
+                                                bool retain, uint16_t *message_id, uint16_t predefined_topic_id);
+
+    /**
+     * Sends the next saved publish (or the REGISTER needed for it) to the client.
+     * @return true if a publish was send which needs no acknowledge and further publishes can be send right away
+     */
+    bool handle_client_publishes(CLIENT_STATUS status, const char *client_id, device_address *address);
+
+    /**
+     * Streams the saved publishes of an AWAKE client back-to-back, limited by the messages in flight.
+     * When no more publishes are left the client is set ASLEEP and a PINGRESP ends the awake window.
+     */
+    void deliver_awake_client_publishes(device_address *address);
+
+    void handle_retransmissions();
+
+    /**
+     * Broadcasts an ADVERTISE every advertise duration seconds (T_ADV if not configured).
+     * The first ADVERTISE is send within T_SEARCH_GW seconds, all ADVERTISE are jittered
+     * so gateways powered on together do not collide.
+     */
+    void handle_advertise();
+
+    void handle_retransmission(retransmission_entry *entry, uint32_t timestamp);
+
+    /**
+     * Shortens the timeout to the time left until the deadline, to 0 if the deadline passed.
+     */
+    static void shorten_timeout(uint32_t *timeout, uint32_t timestamp, uint32_t deadline);
+
+    /**
+     * Logs the publishes from the broker dropped by the MqttMessageHandler every BROKER_STATISTICS_LOG_PERIOD,
+     * if more were dropped since the last log.
+     */
+    void handle_broker_statistics();
+
+    /**
+     * Sends the publishes spooled during a broker outage with publish_async, up to SPOOL_DRAIN_BATCH_SIZE of them
+     * await their PUBACK at the same time. They are tracked in the broker_pending_publishes like client publishes.
+     */
+    void handle_spool();
+
+    /**
+     * Removes the acknowledged publishes from the head of the spool, the spool is only removed in order.
+     */
+    void remove_acknowledged_spool_publishes();
+
+    /**
+     * Gives up the publishes the broker did not acknowledge within BROKER_PUBACK_TIMEOUT.
+     */
+    void handle_broker_pending_publishes();
+
+    /**
+     * @return the position of the pending publish of the client with the msg_id,
+     * of a free entry if address is nullptr, -1 if none is found
+     */
+    int32_t find_broker_pending_publish(device_address *address, uint16_t msg_id);
+
+    /**
+     * Spools a QoS 1 publish of a client, while the broker is offline or the publish failed.
+     * A full spool is never shortened while spooled publishes are in flight, the publish is rejected instead.
+     * @return true if the publish is spooled
+     */
+    bool spool_publish(const char *topic_name, const uint8_t *data, uint16_t data_len, bool retain);
+
+    /**
+     * Queues the cached retained message of the topic for a client which just subscribed to it,
+     * so it is send right after the SUBACK without a round trip to the broker.
+     */
+    void queue_retained_message(device_address *address, const char *topic_name, uint16_t topic_id, uint8_t qos);
+
+    /**
+     * Queues a publish for the client in the current transaction.
+     * Publishes to predefined topics are queued with their predefined topic id, so they are delivered without
+     * a REGISTER round trip.
+     */
+    bool queue_client_publish(uint16_t *message_id, uint8_t *data, uint8_t data_length, uint16_t topic_id,
+                              uint16_t predefined_topic_id, bool retain, uint8_t qos);
 
     void append_device_address(device_address *pAddress);
 };
@@ -137,6 +137,12 @@ public:    // gateway connection status
 
     virtual CORE_RESULT notify_mqtt_connected() = 0;
 
+    /**
+     * The broker acknowledged a publish send by MqttMessageHandlerInterface::publish_async.
+     * @param packet_id of the acknowledged publish
+     */
+    virtual CORE_RESULT notify_mqtt_puback_arrived(uint16_t packet_id) = 0;
+
     virtual CORE_RESULT notify_mqttsn_connected() = 0;
 };
 
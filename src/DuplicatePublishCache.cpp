@@ -0,0 +1,75 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <string.h>
+#include "DuplicatePublishCache.h"
+
+DuplicatePublishCache::DuplicatePublishCache() {
+    memset(&clients, 0, sizeof(clients));
+}
+
+void DuplicatePublishCache::remember(device_address *address, uint16_t msg_id, uint32_t timestamp) {
+    int32_t position = find(address);
+    if (position == -1) {
+        position = find_replaceable(timestamp);
+        memset(&clients[position], 0, sizeof(duplicate_cache_client));
+        memcpy(&clients[position].address, address, sizeof(device_address));
+        clients[position].used = true;
+    }
+    duplicate_cache_client &client = clients[position];
+    client.last_seen = timestamp;
+    client.msg_ids[client.next] = msg_id;
+    client.timestamps[client.next] = timestamp;
+    client.next = (uint8_t) ((client.next + 1) % DUPLICATE_PUBLISH_CACHE_WINDOW);
+}
+
+bool DuplicatePublishCache::contains(device_address *address, uint16_t msg_id, uint32_t timestamp) {
+    if (msg_id == 0) {
+        return false;
+    }
+    int32_t position = find(address);
+    if (position == -1) {
+        return false;
+    }
+    duplicate_cache_client &client = clients[position];
+    for (uint8_t i = 0; i < DUPLICATE_PUBLISH_CACHE_WINDOW; i++) {
+        if (client.msg_ids[i] == msg_id && timestamp - client.timestamps[i] <= DUPLICATE_PUBLISH_CACHE_LIFETIME) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DuplicatePublishCache::forget(device_address *address) {
+    int32_t position = find(address);
+    if (position == -1) {
+        return;
+    }
+    memset(&clients[position], 0, sizeof(duplicate_cache_client));
+}
+
+int32_t DuplicatePublishCache::find(device_address *address) {
+    for (uint16_t i = 0; i < DUPLICATE_PUBLISH_CACHE_CLIENTS; i++) {
+        if (clients[i].used && memcmp(&clients[i].address, address, sizeof(device_address)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint16_t DuplicatePublishCache::find_replaceable(uint32_t timestamp) {
+    uint16_t oldest = 0;
+    uint32_t oldest_age = 0;
+    for (uint16_t i = 0; i < DUPLICATE_PUBLISH_CACHE_CLIENTS; i++) {
+        if (!clients[i].used) {
+            return i;
+        }
+        uint32_t age = timestamp - clients[i].last_seen;
+        if (age > oldest_age) {
+            oldest = i;
+            oldest_age = age;
+        }
+    }
+    return oldest;
+}
@@ -0,0 +1,70 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_DUPLICATEPUBLISHCACHE_H
+#define GATEWAY_DUPLICATEPUBLISHCACHE_H
+
+#include <stdint.h>
+#include "global_defines.h"
+#include "mqttsn_messages.h"
+
+#ifndef DUPLICATE_PUBLISH_CACHE_CLIENTS
+#define DUPLICATE_PUBLISH_CACHE_CLIENTS 32 // clients tracked at the same time
+#endif
+
+#ifndef DUPLICATE_PUBLISH_CACHE_WINDOW
+#define DUPLICATE_PUBLISH_CACHE_WINDOW 4 // msg ids remembered per client
+#endif
+
+// a client retransmits a PUBLISH at most N_RETRY times every T_RETRY seconds
+#define DUPLICATE_PUBLISH_CACHE_LIFETIME (T_RETRY * N_RETRY * 1000UL)
+
+struct duplicate_cache_client {
+    device_address address;
+    uint32_t last_seen;
+    uint16_t msg_ids[DUPLICATE_PUBLISH_CACHE_WINDOW];
+    uint32_t timestamps[DUPLICATE_PUBLISH_CACHE_WINDOW];
+    uint8_t next;
+    bool used;
+};
+
+/**
+ * Remembers the msg ids of the last QoS 1 PUBLISH messages received from each client and forwarded to the broker.
+ * If the PUBACK of the gateway is lost, the client retransmits the PUBLISH with the dup flag set. Such a duplicate
+ * is found in the cache and only acknowledged again instead of forwarding it a second time.
+ * Each client has a ring of DUPLICATE_PUBLISH_CACHE_WINDOW msg ids, entries are valid for the retransmission
+ * period of the client. If all client slots are used the least recently seen client is replaced.
+ */
+class DuplicatePublishCache {
+private:
+    duplicate_cache_client clients[DUPLICATE_PUBLISH_CACHE_CLIENTS];
+
+public:
+    DuplicatePublishCache();
+
+    /**
+     * Adds the msg id of a forwarded PUBLISH for the client.
+     * @param timestamp in milliseconds when the PUBLISH was forwarded
+     */
+    void remember(device_address *address, uint16_t msg_id, uint32_t timestamp);
+
+    /**
+     * @param timestamp current time in milliseconds
+     * @return true if a PUBLISH with the msg id was forwarded for the client within the lifetime of the cache
+     */
+    bool contains(device_address *address, uint16_t msg_id, uint32_t timestamp);
+
+    /**
+     * Forgets all msg ids of the client.
+     */
+    void forget(device_address *address);
+
+private:
+    int32_t find(device_address *address);
+
+    uint16_t find_replaceable(uint32_t timestamp);
+};
+
+
+#endif //GATEWAY_DUPLICATEPUBLISHCACHE_H
@@ -1,5 +1,7 @@
 #include <termios.h>
 #include <fcntl.h>
+#include <random>
+#include <thread>
 #include "Arduino.h"
 
 void SerialMock::begin(uint64_t) {
@@ -37,37 +39,40 @@ void delay(uint64_t time) {
     return;
 }
 
-int64_t timerValue = 0;
-bool timerValueCalled = false;
+// set once before main, so millis reads no state other threads write
+static const std::chrono::steady_clock::time_point timerStart = std::chrono::steady_clock::now();
 
 int64_t millis() {
-    if (!timerValueCalled) {
-        std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch()
-        );
-        timerValue = ms.count();
-        timerValueCalled = true;
-        return 0;
-    }
+    // the steady clock does not jump with the system time, callers truncate to 32 bit like on the Arduino
     std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch()
+            std::chrono::steady_clock::now() - timerStart
     );
-    int64_t diff = ms.count() - timerValue;
-    if (diff > UINT32_MAX) {
-        // overflow
-        timerValue = diff - UINT32_MAX;
-        return timerValue;
-    }
-    return diff;
+    return ms.count();
+}
+
+int64_t micros() {
+    // only used for differences, so the steady clock needs no offset
+    std::chrono::microseconds us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+    );
+    return (uint32_t) us.count();
 }
 
 void yield() { }
 
+// each thread has its own generator, seeded once on first use, so shards do not share one
+thread_local std::minstd_rand randomGenerator(
+        (uint32_t) std::chrono::steady_clock::now().time_since_epoch().count() ^
+        (uint32_t) std::hash<std::thread::id>()(std::this_thread::get_id()));
+
 int64_t random(int64_t min, int64_t max) {
-    return rand() % max + min;
+    if (max <= min) {
+        return min;
+    }
+    return min + (int64_t) (randomGenerator() % (uint64_t) (max - min));
 }
 
 void randomSeed(uint16_t seed) {
-
+    randomGenerator.seed(seed);
 }
 
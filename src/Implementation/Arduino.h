@@ -21,6 +21,8 @@ extern void delay(uint64_t time);
 
 extern int64_t millis();
 
+extern int64_t micros();
+
 extern void yield();
 
 extern int64_t random(int64_t min, int64_t max);
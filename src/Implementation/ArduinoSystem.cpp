@@ -18,6 +18,14 @@ bool ArduinoSystem::has_beaten() {
     return false;
 }
 
+uint32_t ArduinoSystem::get_heartbeat_remaining() {
+    uint32_t elapsed = millis() - heartbeat_current;
+    if (elapsed > heartbeat_period) {
+        return 0;
+    }
+    return heartbeat_period - elapsed + 1;
+}
+
 uint32_t ArduinoSystem::get_elapsed_time() {
     uint32_t current = millis();
     uint32_t elapsed_time = current - elapsed_current;
@@ -25,6 +33,21 @@ uint32_t ArduinoSystem::get_elapsed_time() {
     return elapsed_time;
 }
 
+uint32_t ArduinoSystem::get_timestamp() {
+    return millis();
+}
+
+uint32_t ArduinoSystem::get_microseconds() {
+    return (uint32_t) micros();
+}
+
+uint32_t ArduinoSystem::get_random(uint32_t max) {
+    if (max == 0) {
+        return 0;
+    }
+    return (uint32_t) random(0, max);
+}
+
 void ArduinoSystem::sleep(uint32_t duration) {
     delay(duration);
 }
@@ -33,12 +33,39 @@ public:
      */
     virtual bool has_beaten();
 
+    /**
+     * Gets the time until has_beaten returns true, e.g. to sleep until then.
+     * @return the milliseconds until the next heartbeat, 0 if it is due
+     */
+    virtual uint32_t get_heartbeat_remaining();
+
     /**
      * Get the elapsed time between two calls of this function.
      * @return the elapsed time between two calls
      */
     virtual uint32_t get_elapsed_time();
 
+    /**
+     * Gets the milliseconds since the System was started.
+     * The value overflows, compare timestamps only by their difference.
+     * @return the current timestamp in milliseconds
+     */
+    virtual uint32_t get_timestamp();
+
+    /**
+     * Gets the microseconds since the System was started, e.g. to measure short durations.
+     * The value overflows, compare timestamps only by their difference.
+     * @return the current timestamp in microseconds
+     */
+    virtual uint32_t get_microseconds();
+
+    /**
+     * Gets a random number, e.g. to jitter broadcasts.
+     * @param max upper bound (exclusive)
+     * @return a random number between 0 and max - 1, 0 if max is 0
+     */
+    virtual uint32_t get_random(uint32_t max);
+
     /**
      * Lets the execution sleep for some seconds.
      */
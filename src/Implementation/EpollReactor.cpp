@@ -0,0 +1,104 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include "EpollReactor.h"
+
+bool EpollReactor::begin(Gateway *gateway, UdpSocketImpl *udpSocket, PahoMqttMessageHandler *mqtt) {
+    if (gateway == nullptr || udpSocket == nullptr || mqtt == nullptr || !gateway->initialized) {
+        return false;
+    }
+    this->gateway = gateway;
+    this->udpSocket = udpSocket;
+    this->mqtt = mqtt;
+
+    if ((epoll_fd = epoll_create1(0)) == -1) {
+        return false;
+    }
+    watch_sockets();
+    return true;
+}
+
+bool EpollReactor::loop() {
+    struct epoll_event events[REACTOR_MAXIMUM_EVENTS];
+    int ready = epoll_wait(epoll_fd, events, REACTOR_MAXIMUM_EVENTS, get_timeout());
+    if (ready == -1) {
+        return errno == EINTR;
+    }
+    if (ready == 0) {
+        handle_timeout();
+    }
+    for (int i = 0; i < ready; i++) {
+        int fd = events[i].data.fd;
+        if (fd == udp_fd) {
+            udpSocket->receive_available();
+        } else if (fd == broker_fd) {
+            handle_broker_event();
+        }
+    }
+    gateway->coreInterface.loop();
+    watch_sockets();
+    return true;
+}
+
+bool EpollReactor::watch(int fd, uint32_t events) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0) {
+        return true;
+    }
+    // already watched, e.g. a reconnected socket got the number of the closed one
+    return errno == EEXIST && epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+void EpollReactor::watch_sockets() {
+    // closed sockets are removed by epoll itself, reconnected ones have to be watched again
+    udp_fd = udpSocket->s;
+    if (udp_fd >= 0) {
+        watch(udp_fd, EPOLLIN);
+    }
+    bool writable = false;
+    broker_fd = mqtt->getSocket();
+    if (broker_fd < 0) {
+        broker_fd = mqtt->getConnectingSocket(&writable);
+    }
+    if (broker_fd >= 0) {
+        // the TCP handshake is done once the socket is writable, the CONNACK and later packets make it readable
+        watch(broker_fd, writable ? EPOLLOUT : EPOLLIN);
+    }
+}
+
+int EpollReactor::get_timeout() {
+    if (udpSocket->s < 0) {
+        return REACTOR_RECONNECT_MS;
+    }
+    uint32_t timeout = gateway->coreInterface.get_next_timeout();
+    int32_t broker_timeout = mqtt->getNextTimeout();
+    if (broker_timeout >= 0 && (uint32_t) broker_timeout < timeout) {
+        timeout = (uint32_t) broker_timeout;
+    }
+    return timeout > INT32_MAX ? INT32_MAX : (int) timeout;
+}
+
+void EpollReactor::handle_timeout() {
+    if (udpSocket->s < 0) {
+        // reconnects the socket
+        udpSocket->loop();
+    }
+    handle_broker_event();
+}
+
+void EpollReactor::handle_broker_event() {
+    if (mqtt->getSocket() < 0) {
+        // advances the non-blocking connect to the broker
+        mqtt->loop();
+    } else {
+        // reads the packets and sends the keep alive if due
+        mqtt->receive_available();
+    }
+}
@@ -0,0 +1,67 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_EPOLLREACTOR_H
+#define GATEWAY_EPOLLREACTOR_H
+
+#include <paho/PahoMqttMessageHandler.h>
+#include "../Gateway.h"
+#include "UdpSocketImpl.h"
+
+#define REACTOR_RECONNECT_MS 100 // period the closed UDP socket is reopened
+#define REACTOR_MAXIMUM_EVENTS 4
+
+/**
+ * Linux only event loop replacing the polling Gateway::loop.
+ * Instead of waiting up to 300 ms on the UDP socket and again on the broker connection, it waits with epoll
+ * on both sockets and handles whichever becomes ready first.
+ * The core loop runs after each event and when the wait times out. The timeout is the time until the next timer
+ * of the core (retransmission, advertise, client timeouts) or of the broker connection (keep alive, connect) is due.
+ * While connecting, the broker socket is watched for the TCP handshake and the CONNACK.
+ *
+ * Usage (instead of gateway.loop()):
+ *  EpollReactor reactor;
+ *  reactor.begin(&gateway, &udpSocket, &mqtt);
+ *  while (true) { reactor.loop(); }
+ */
+class EpollReactor {
+private:
+    Gateway *gateway = nullptr;
+    UdpSocketImpl *udpSocket = nullptr;
+    PahoMqttMessageHandler *mqtt = nullptr;
+    int epoll_fd = -1;
+    int udp_fd = -1;
+    int broker_fd = -1;
+
+public:
+    /**
+     * Creates the epoll instance, call it after gateway.begin().
+     * Do not combine it with the ingress or broker threads of the UdpSocketImpl and PahoMqttMessageHandler.
+     * @return true if epoll is ready
+     */
+    bool begin(Gateway *gateway, UdpSocketImpl *udpSocket, PahoMqttMessageHandler *mqtt);
+
+    /**
+     * Waits for the next event and handles it.
+     * @return false if epoll failed
+     */
+    bool loop();
+
+private:
+    bool watch(int fd, uint32_t events);
+
+    void watch_sockets();
+
+    /**
+     * @return the milliseconds until the next timer of the core or the broker connection is due
+     */
+    int get_timeout();
+
+    void handle_timeout();
+
+    void handle_broker_event();
+};
+
+
+#endif //GATEWAY_EPOLLREACTOR_H
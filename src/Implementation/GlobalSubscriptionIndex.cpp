@@ -0,0 +1,102 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <string.h>
+#include "GlobalSubscriptionIndex.h"
+
+GlobalSubscriptionIndex::GlobalSubscriptionIndex() {
+    clear();
+}
+
+void GlobalSubscriptionIndex::clear() {
+    memset(&entries, 0, sizeof(entries));
+    topic_count = 0;
+    free_entry_count = 0;
+    entry_count = 0;
+}
+
+uint32_t GlobalSubscriptionIndex::hash(const char *topic_name) {
+    // FNV-1a
+    uint32_t topic_hash = 2166136261u;
+    for (const char *c = topic_name; *c != 0; c++) {
+        topic_hash ^= (uint8_t) *c;
+        topic_hash *= 16777619u;
+    }
+    return topic_hash;
+}
+
+int32_t GlobalSubscriptionIndex::find(uint32_t topic_hash, uint16_t *probe) {
+    while (*probe < GLOBAL_SUBSCRIPTION_INDEX_CAPACITY) {
+        uint32_t slot = (topic_hash + *probe) & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1);
+        *probe += 1;
+        if (!entries[slot].used) {
+            // end of the probe sequence
+            break;
+        }
+        if (entries[slot].topic_hash == topic_hash) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+uint16_t GlobalSubscriptionIndex::get_entry_number(int32_t slot) {
+    return entries[slot].entry_number;
+}
+
+bool GlobalSubscriptionIndex::add(uint32_t topic_hash, uint16_t entry_number) {
+    if (!has_room()) {
+        return false;
+    }
+    uint32_t slot = topic_hash & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1);
+    while (entries[slot].used) {
+        slot = (slot + 1) & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1);
+    }
+    entries[slot].topic_hash = topic_hash;
+    entries[slot].entry_number = entry_number;
+    entries[slot].used = true;
+    topic_count++;
+    return true;
+}
+
+void GlobalSubscriptionIndex::remove(int32_t slot) {
+    add_free_entry(entries[slot].entry_number);
+    // backward shift deletion, the probe sequences of the following slots stay unbroken without tombstones
+    uint32_t empty = (uint32_t) slot;
+    uint32_t next = (empty + 1) & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1);
+    while (entries[next].used) {
+        uint32_t home = entries[next].topic_hash & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1);
+        uint32_t distance_to_home = (next - home) & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1);
+        uint32_t distance_to_empty = (next - empty) & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1);
+        if (distance_to_home >= distance_to_empty) {
+            entries[empty] = entries[next];
+            empty = next;
+        }
+        next = (next + 1) & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1);
+    }
+    memset(&entries[empty], 0, sizeof(global_subscription_index_entry));
+    topic_count--;
+}
+
+bool GlobalSubscriptionIndex::has_room() {
+    return topic_count < GLOBAL_SUBSCRIPTION_INDEX_MAXIMUM_TOPICS;
+}
+
+void GlobalSubscriptionIndex::add_free_entry(uint16_t entry_number) {
+    // if there is no room the entry stays empty until SDPersistentImpl compacts MQTT.SUB at the next start
+    if (free_entry_count < GLOBAL_SUBSCRIPTION_INDEX_FREE_ENTRIES) {
+        free_entries[free_entry_count++] = entry_number;
+    }
+}
+
+uint16_t GlobalSubscriptionIndex::take_free_entry() {
+    if (free_entry_count > 0) {
+        return free_entries[--free_entry_count];
+    }
+    return entry_count++;
+}
+
+void GlobalSubscriptionIndex::set_entry_count(uint16_t entry_count) {
+    this->entry_count = entry_count;
+}
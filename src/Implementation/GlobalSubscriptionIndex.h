@@ -0,0 +1,98 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_GLOBALSUBSCRIPTIONINDEX_H
+#define GATEWAY_GLOBALSUBSCRIPTIONINDEX_H
+
+#include <stdint.h>
+
+#ifndef GLOBAL_SUBSCRIPTION_INDEX_CAPACITY
+#define GLOBAL_SUBSCRIPTION_INDEX_CAPACITY 1024 // slots of the hash table, must be a power of two
+#endif
+
+// at most three quarters of the slots are used, so a probe sequence stays short
+#define GLOBAL_SUBSCRIPTION_INDEX_MAXIMUM_TOPICS (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY / 4 * 3)
+
+#ifndef GLOBAL_SUBSCRIPTION_INDEX_FREE_ENTRIES
+#define GLOBAL_SUBSCRIPTION_INDEX_FREE_ENTRIES 64 // empty MQTT.SUB entries remembered for reuse
+#endif
+
+struct global_subscription_index_entry {
+    uint32_t topic_hash;
+    uint16_t entry_number;
+    bool used;
+};
+
+/**
+ * In-memory index of the global subscription table (MQTT.SUB) of the SDPersistentImpl.
+ * Maps the hash of a topic name to the number of its entry in MQTT.SUB, with linear probing.
+ * Only the hash is kept in memory, so the caller reads the entry of each candidate and compares the topic names.
+ * An unknown topic needs no file access at all, a known topic a single read at the entry.
+ * The empty entries of MQTT.SUB are remembered too, so a new topic is written without searching for a free entry.
+ */
+class GlobalSubscriptionIndex {
+    static_assert((GLOBAL_SUBSCRIPTION_INDEX_CAPACITY & (GLOBAL_SUBSCRIPTION_INDEX_CAPACITY - 1)) == 0,
+                  "GLOBAL_SUBSCRIPTION_INDEX_CAPACITY must be a power of two");
+private:
+    global_subscription_index_entry entries[GLOBAL_SUBSCRIPTION_INDEX_CAPACITY];
+    uint16_t topic_count = 0;
+    uint16_t free_entries[GLOBAL_SUBSCRIPTION_INDEX_FREE_ENTRIES];
+    uint16_t free_entry_count = 0;
+    uint16_t entry_count = 0;
+
+public:
+    GlobalSubscriptionIndex();
+
+    /**
+     * Removes all topics and free entries, e.g. before MQTT.SUB is indexed again.
+     */
+    void clear();
+
+    static uint32_t hash(const char *topic_name);
+
+    /**
+     * Finds the next slot with the given topic hash.
+     * @param probe position in the probe sequence, start with 0 and pass it again to get the next candidate
+     * @return the slot or -1 if there is no further candidate
+     */
+    int32_t find(uint32_t topic_hash, uint16_t *probe);
+
+    /**
+     * @return the number of the MQTT.SUB entry of the slot returned by find
+     */
+    uint16_t get_entry_number(int32_t slot);
+
+    /**
+     * @return false if the index is full, the caller has to fall back to scanning MQTT.SUB
+     */
+    bool add(uint32_t topic_hash, uint16_t entry_number);
+
+    /**
+     * Removes the slot returned by find, the MQTT.SUB entry of the slot becomes free.
+     */
+    void remove(int32_t slot);
+
+    /**
+     * @return true if another topic can be added
+     */
+    bool has_room();
+
+    /**
+     * Remembers an empty MQTT.SUB entry, found while indexing the file.
+     */
+    void add_free_entry(uint16_t entry_number);
+
+    /**
+     * Gets the MQTT.SUB entry for a new topic, a remembered empty entry or a new one at the end of the file.
+     */
+    uint16_t take_free_entry();
+
+    /**
+     * @param entry_count number of entries in MQTT.SUB, new entries are appended after them
+     */
+    void set_entry_count(uint16_t entry_count);
+};
+
+
+#endif //GATEWAY_GLOBALSUBSCRIPTIONINDEX_H
@@ -2,9 +2,11 @@
 #include "../LoggerInterface.h"
 #include "../mqttsn_messages.h"
 #include "SDLinuxFake.h"
+#include "GlobalSubscriptionIndex.h"
 #include "Arduino.h"
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 
 
 #ifndef GATEWAY_PERSISTENTIMPL_H
@@ -16,6 +18,7 @@
 #define MAXIMUM_CLIENT_ID_LENGTH 24
 
 #define MAXIMUM_TOPIC_NAME_LENGTH 255
+#define SUBSCRIPTION_REMOVE_BATCH_SIZE 8 // subscriptions removed by a single MQTT.SUB pass
 
 #define SUBSCRIBE_FILE_ENDING ".SUB"
 
@@ -25,6 +28,16 @@
 
 #define PUBLISH_FILE_ENDING ".PUB"
 
+#define SPOOL_DEFAULT_CAPACITY 64
+
+#define STORE_FORMAT_VERSION 2 // version 1 are the files without STORE.VER, before the shared message store
+
+#define QUEUE_DEFAULT_MAXIMUM_MESSAGES 64
+
+#ifndef PREDEFINED_TOPICS_CACHE_SIZE
+#define PREDEFINED_TOPICS_CACHE_SIZE 16 // predefined topics kept in memory, larger TOPICS.PRE files are read each time
+#endif
+
 class SDPersistentImpl : public PersistentInterface {
 
 private:
@@ -51,6 +64,36 @@ private:
     const char *mqtt_sub = "MQTT.SUB";
     const char *predefined_topic = "TOPICS.PRE";
     const char *mqtt_configuration = "MQTT.CON";
+    const char *mqtt_spool = "MQTT.SPL";
+    const char *mqtt_message_store = "MQTT.MSG";
+    const char *store_version = "STORE.VER";
+
+    // the spool header and configuration are cached, they are read by every loop of the core
+    bool _spool_loaded = false;
+    entry_spool_header _spool_header;
+    uint16_t _spool_capacity = SPOOL_DEFAULT_CAPACITY;
+    bool _spool_drop_oldest = false;
+
+    // limits of the publish queue of each client, read once from the configuration
+    enum QUEUE_OVERFLOW_POLICY : uint8_t {
+        QUEUE_DROP_OLDEST,
+        QUEUE_DROP_NEWEST,
+        QUEUE_DROP_QOS0_FIRST
+    };
+    bool _queue_config_loaded = false;
+    uint16_t _queue_maximum_messages = QUEUE_DEFAULT_MAXIMUM_MESSAGES;
+    uint16_t _queue_maximum_bytes = 0;
+    QUEUE_OVERFLOW_POLICY _queue_overflow_policy = QUEUE_DROP_OLDEST;
+    uint16_t _queue_expiry = 0;
+
+    // TOPICS.PRE does not change while the gateway runs, it is read once by begin
+    entry_registration _predefined_topics[PREDEFINED_TOPICS_CACHE_SIZE];
+    uint16_t _predefined_topic_count = 0;
+    bool _predefined_topics_cached = false;
+
+    // hash index of MQTT.SUB, so the global subscription counts are found without scanning the file
+    GlobalSubscriptionIndex _global_subscriptions;
+    bool _global_subscriptions_indexed = false;
 
 private:
 
@@ -103,6 +146,21 @@ public:
 
         create_file(client_registry);
         create_file(mqtt_sub);
+        create_file(mqtt_spool);
+        create_file(mqtt_message_store);
+        if (!check_store_version()) {
+#if PERSISTENT_DEBUG
+            logger->log("Error starting SDPersistentImpl: unknown format version of the files ", 1);
+#endif
+            return false;
+        }
+        // references held by the core are lost with a restart, only the queued publishes reference messages
+        clear_shared_message_references();
+        rebase_client_publishes();
+        free_unreferenced_shared_messages();
+        compact_global_subscriptions();
+        index_global_subscriptions();
+        load_predefined_topics();
 #if PERSISTENT_DEBUG
         logger->log("SDPersistent ready", 1);
 #endif
@@ -398,11 +456,12 @@ public:
         memcpy(&filename_with_extension[strlen(_entry_client.file_number)], WILL_FILE_ENDING, strlen(WILL_FILE_ENDING));
         delete_file(filename_with_extension);
 
-        // publish messages file
+        // publish messages file, the shared messages are released first
         memset(&filename_with_extension, 0, sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING));
         memcpy(&filename_with_extension, &_entry_client.file_number, strlen(_entry_client.file_number));
         memcpy(&filename_with_extension[strlen(_entry_client.file_number)], PUBLISH_FILE_ENDING,
                strlen(PUBLISH_FILE_ENDING));
+        release_client_publishes(filename_with_extension);
         delete_file(filename_with_extension);
 
         _open_file.close();
@@ -557,6 +616,14 @@ public:
         if (_error) {
             return nullptr;
         }
+        if (_predefined_topics_cached) {
+            for (uint16_t i = 0; i < _predefined_topic_count; i++) {
+                if (_predefined_topics[i].topic_id == topic_id) {
+                    return _predefined_topics[i].topic_name;
+                }
+            }
+            return nullptr;
+        }
         _open_file.flush();
         _open_file.close();
         // CHECKME
@@ -603,7 +670,95 @@ public:
         return nullptr;
     }
 
+    virtual bool get_predefined_topic_id(const char *topic_name, uint16_t *topic_id) {
+        if (_error || topic_name == nullptr) {
+            return false;
+        }
+        if (_predefined_topics_cached) {
+            for (uint16_t i = 0; i < _predefined_topic_count; i++) {
+                if (strcmp(_predefined_topics[i].topic_name, topic_name) == 0) {
+                    *topic_id = _predefined_topics[i].topic_id;
+                    return true;
+                }
+            }
+            return false;
+        }
+        _open_file.flush();
+        _open_file.close();
+        _open_file = SD.open(predefined_topic, FILE_READ);
+
+        char buffer[262];
+        int readChars = 0;
+        do {
+            memset(&buffer, 0, sizeof(buffer));
+            readChars = readLine(buffer, sizeof(buffer));
+            if (readChars > 3) {
+                char *found = strtok(buffer, " ");
+                if (found == NULL) {
+                    continue;
+                }
+                uint32_t found_topic_id = (uint32_t) atoi(found);
+                char *found_topic_name = strtok(NULL, " ");
+                if (found_topic_name == NULL || found_topic_id == 0 || found_topic_id >= UINT16_MAX) {
+                    continue;
+                }
+                if (strcmp(found_topic_name, topic_name) == 0) {
+                    *topic_id = (uint16_t) found_topic_id;
+                    _open_file.close();
+                    return true;
+                }
+            }
+        } while (readChars > 0);
+        _open_file.close();
+        return false;
+    }
+
+
+
+
+    /**
+     * Reads TOPICS.PRE into _predefined_topics, if it has more than PREDEFINED_TOPICS_CACHE_SIZE topics the
+     * predefined topics are looked up in the file instead.
+     */
+    void load_predefined_topics() {
+        _predefined_topics_cached = false;
+        _predefined_topic_count = 0;
+        memset(&_predefined_topics, 0, sizeof(_predefined_topics));
+        _open_file.close();
+        _open_file = SD.open(predefined_topic, FILE_READ);
 
+        char buffer[262];
+        int readChars = 0;
+        do {
+            memset(&buffer, 0, sizeof(buffer));
+            readChars = readLine(buffer, sizeof(buffer));
+            if (readChars > 3) {
+                char *found = strtok(buffer, " ");
+                if (found == NULL) {
+                    continue;
+                }
+                uint32_t found_topic_id = (uint32_t) atoi(found);
+                char *found_topic_name = strtok(NULL, " ");
+                if (found_topic_name == NULL || found_topic_id == 0 || found_topic_id >= UINT16_MAX ||
+                    strlen(found_topic_name) >= MAXIMUM_TOPIC_NAME_LENGTH) {
+                    continue;
+                }
+                if (_predefined_topic_count == PREDEFINED_TOPICS_CACHE_SIZE) {
+                    _open_file.close();
+#if PERSISTENT_DEBUG
+                    logger->log("predefined topics not cached - too many", 1);
+#endif
+                    return;
+                }
+                entry_registration &entry = _predefined_topics[_predefined_topic_count++];
+                entry.topic_id = (uint16_t) found_topic_id;
+                strcpy(entry.topic_name, found_topic_name);
+                entry.known = true;
+            }
+        } while (readChars > 0);
+        _open_file.close();
+        _predefined_topics_cached = true;
+    }
 
 
     virtual void delete_will() {
@@ -799,6 +954,392 @@ public:
     }
 
 
+private:
+
+    /**
+     * Builds the index of MQTT.SUB in a single pass over the file.
+     * If MQTT.SUB contains more topics than the index can hold, the file is scanned by each operation instead.
+     */
+    /**
+     * Moves the used entries of MQTT.SUB to the front, the empty entries are left at the end of the file.
+     * The index only remembers GLOBAL_SUBSCRIPTION_INDEX_FREE_ENTRIES empty entries, so the holes of the last run
+     * would stay unused otherwise. Called by begin before the file is indexed, nothing refers to entry numbers yet.
+     */
+    /**
+     * Converts the files of format version 1, the version is written afterwards.
+     * @return false if the files are of an unknown, newer format version
+     */
+    bool check_store_version() {
+        entry_store_version _entry_store_version;
+        memset(&_entry_store_version, 0, sizeof(entry_store_version));
+        _open_file.close();
+        _open_file = SD.open(store_version, FILE_READ);
+        int readChars = _open_file.read((char *) &_entry_store_version, sizeof(entry_store_version));
+        _open_file.close();
+        if (readChars == sizeof(entry_store_version)) {
+            return _entry_store_version.version == STORE_FORMAT_VERSION;
+        }
+        convert_version_1_clients();
+        _entry_store_version.version = STORE_FORMAT_VERSION;
+        create_file(store_version);
+        _open_file = SD.open(store_version, FILE_WRITE);
+        _open_file.write((uint8_t *) &_entry_store_version, sizeof(entry_store_version));
+        _open_file.close();
+        return true;
+    }
+
+    void convert_version_1_clients() {
+        entry_client_v1 _entry_client_v1;
+        int32_t client_count = 0;
+        _open_file.close();
+        _open_file = SD.open(client_registry, FILE_READ);
+        while (_open_file.read((char *) &_entry_client_v1, sizeof(entry_client_v1)) == sizeof(entry_client_v1)) {
+            client_count++;
+        }
+        _open_file.close();
+
+        // the entries grow, converted from the last to the first no unread entry is overwritten
+        for (int32_t client_position = client_count - 1; client_position >= 0; client_position--) {
+            memset(&_entry_client_v1, 0, sizeof(entry_client_v1));
+            _open_file = SD.open(client_registry, FILE_READ);
+            _open_file.seek(client_position * sizeof(entry_client_v1));
+            _open_file.read((char *) &_entry_client_v1, sizeof(entry_client_v1));
+            _open_file.close();
+
+            entry_client converted_client;
+            memset(&converted_client, 0, sizeof(entry_client));
+            memcpy(&converted_client, &_entry_client_v1, sizeof(entry_client_v1));
+            if (converted_client.client_status != EMPTY) {
+                char filename_with_extension[sizeof(converted_client.file_number) + sizeof(PUBLISH_FILE_ENDING)];
+                get_publish_file_name(converted_client.file_number, filename_with_extension);
+                convert_version_1_publishes(filename_with_extension, &converted_client.queued_publish_count,
+                                            &converted_client.queued_publish_bytes);
+            }
+            _open_file = SD.open(client_registry, FILE_WRITE);
+            _open_file.seek(client_position * sizeof(entry_client));
+            _open_file.write((const char *) &converted_client, sizeof(entry_client));
+            _open_file.close();
+        }
+#if PERSISTENT_DEBUG
+        if (client_count > 0) {
+            char buffer[20];
+            logger->start_log("files of format version 1 converted - ", 2);
+            sprintf(buffer, "%ld", (long) client_count);
+            logger->append_log(buffer);
+            logger->append_log(" clients");
+        }
+#endif
+    }
+
+    /**
+     * Moves the payloads of the publishes into the shared message store.
+     */
+    void convert_version_1_publishes(const char *filename_with_extension, uint16_t *publish_count,
+                                     uint32_t *publish_bytes) {
+        *publish_count = 0;
+        *publish_bytes = 0;
+        uint32_t timestamp = (uint32_t) millis();
+        entry_publish_v1 _entry_publish_v1;
+        entry_publish _entry_publish;
+        uint32_t entry_number = 0;
+        // the entries shrink, converted from the first to the last no unread entry is overwritten
+        while (true) {
+            memset(&_entry_publish_v1, 0, sizeof(entry_publish_v1));
+            _open_file.close();
+            _open_file = SD.open(filename_with_extension, FILE_READ);
+            _open_file.seek(entry_number * sizeof(entry_publish_v1));
+            int readChars = _open_file.read((char *) &_entry_publish_v1, sizeof(entry_publish_v1));
+            _open_file.close();
+            if (readChars != sizeof(entry_publish_v1)) {
+                break;
+            }
+            memset(&_entry_publish, 0, sizeof(entry_publish));
+            if (_entry_publish_v1.publish_id != 0) {
+                uint16_t message_id = add_shared_message(_entry_publish_v1.msg, _entry_publish_v1.msg_length);
+                if (message_id != 0) {
+                    _entry_publish.message_id = message_id;
+                    _entry_publish.msg_length = _entry_publish_v1.msg_length;
+                    _entry_publish.topic_id = _entry_publish_v1.topic_id;
+                    _entry_publish.predefined_topic = false;
+                    _entry_publish.qos = _entry_publish_v1.qos;
+                    _entry_publish.retain = _entry_publish_v1.retain;
+                    _entry_publish.dup = _entry_publish_v1.dup;
+                    _entry_publish.msg_id = _entry_publish_v1.msg_id;
+                    _entry_publish.publish_id = _entry_publish_v1.publish_id;
+                    _entry_publish.retransmition_timeout = 0;
+                    _entry_publish.created = timestamp;
+                    *publish_count += 1;
+                    *publish_bytes += _entry_publish.msg_length;
+                }
+            }
+            _open_file = SD.open(filename_with_extension, FILE_WRITE);
+            _open_file.seek(entry_number * sizeof(entry_publish));
+            _open_file.write((uint8_t *) &_entry_publish, sizeof(entry_publish));
+            _open_file.close();
+            entry_number++;
+        }
+        if (entry_number == 0) {
+            return;
+        }
+        // empty entries over the rest of the old entries, the file ends with a whole entry
+        memset(&_entry_publish, 0, sizeof(entry_publish));
+        _open_file = SD.open(filename_with_extension, FILE_WRITE);
+        _open_file.seek(entry_number * sizeof(entry_publish));
+        for (uint32_t position = entry_number * sizeof(entry_publish);
+             position < entry_number * sizeof(entry_publish_v1); position += sizeof(entry_publish)) {
+            _open_file.write((uint8_t *) &_entry_publish, sizeof(entry_publish));
+        }
+        _open_file.close();
+    }
+
+    /**
+     * The timestamps of the publishes are milliseconds since the start of the gateway.
+     * After a restart they are rebased, the publishes keep their ages relative to the newest publish of the client.
+     * The time the gateway was down is not counted.
+     * Each publish counts as a reference of its message, a publish without its message is removed.
+     */
+    void rebase_client_publishes() {
+        uint32_t timestamp = (uint32_t) millis();
+        entry_client rebased_client;
+        uint32_t client_position = 0;
+        while (true) {
+            memset(&rebased_client, 0, sizeof(entry_client));
+            _open_file.close();
+            _open_file = SD.open(client_registry, FILE_READ);
+            _open_file.seek(client_position * sizeof(entry_client));
+            int readChars = _open_file.read((char *) &rebased_client, sizeof(entry_client));
+            _open_file.close();
+            if (readChars != sizeof(entry_client)) {
+                break;
+            }
+            client_position++;
+            if (rebased_client.client_status == EMPTY) {
+                continue;
+            }
+            char filename_with_extension[sizeof(rebased_client.file_number) + sizeof(PUBLISH_FILE_ENDING)];
+            get_publish_file_name(rebased_client.file_number, filename_with_extension);
+
+            entry_publish _entry_publish;
+            bool has_publishes = false;
+            uint32_t newest_created = 0;
+            uint32_t entry_number = 0;
+            _open_file = SD.open(filename_with_extension, FILE_READ);
+            while (_open_file.read((char *) &_entry_publish, sizeof(entry_publish)) == sizeof(entry_publish)) {
+                if (_entry_publish.publish_id != 0 &&
+                    (!has_publishes || (int32_t) (_entry_publish.created - newest_created) > 0)) {
+                    newest_created = _entry_publish.created;
+                    has_publishes = true;
+                }
+                entry_number++;
+            }
+            _open_file.close();
+            if (!has_publishes) {
+                continue;
+            }
+
+            for (uint32_t publish_position = 0; publish_position < entry_number; publish_position++) {
+                memset(&_entry_publish, 0, sizeof(entry_publish));
+                _open_file = SD.open(filename_with_extension, FILE_READ);
+                _open_file.seek(publish_position * sizeof(entry_publish));
+                _open_file.read((char *) &_entry_publish, sizeof(entry_publish));
+                _open_file.close();
+                if (_entry_publish.publish_id == 0) {
+                    continue;
+                }
+                uint16_t reference_count = 0;
+                if (read_shared_message_reference_count(_entry_publish.message_id, &reference_count) &&
+                    reference_count < UINT16_MAX) {
+                    write_shared_message_reference_count(_entry_publish.message_id, (uint16_t) (reference_count + 1));
+                    _entry_publish.created = timestamp - (newest_created - _entry_publish.created);
+                    // retransmissions are scheduled in memory, the publishes in flight are sent again
+                    _entry_publish.retransmition_timeout = 0;
+                } else {
+#if PERSISTENT_DEBUG
+                    logger->start_log("publish without message removed for ", 2);
+                    logger->append_log(rebased_client.client_id);
+#endif
+                    memset(&_entry_publish, 0, sizeof(entry_publish));
+                }
+                _open_file = SD.open(filename_with_extension, FILE_WRITE);
+                _open_file.seek(publish_position * sizeof(entry_publish));
+                _open_file.write((uint8_t *) &_entry_publish, sizeof(entry_publish));
+                _open_file.close();
+            }
+        }
+    }
+
+    void clear_shared_message_references() {
+        uint32_t message_count = count_shared_messages();
+        for (uint32_t message_id = 1; message_id <= message_count; message_id++) {
+            write_shared_message_reference_count((uint16_t) message_id, 0);
+        }
+    }
+
+    /**
+     * Deletes the messages without reference, e.g. of a restart while the core held its reference.
+     */
+    void free_unreferenced_shared_messages() {
+        uint32_t message_count = count_shared_messages();
+        uint32_t freed_count = 0;
+        entry_message _entry_message;
+        for (uint32_t message_id = 1; message_id <= message_count; message_id++) {
+            memset(&_entry_message, 0, sizeof(entry_message));
+            _open_file.close();
+            _open_file = SD.open(mqtt_message_store, FILE_READ);
+            _open_file.seek((message_id - 1) * sizeof(entry_message));
+            _open_file.read((char *) &_entry_message, sizeof(entry_message));
+            _open_file.close();
+            if (_entry_message.reference_count != 0 || _entry_message.msg_length == 0) {
+                continue;
+            }
+            memset(&_entry_message, 0, sizeof(entry_message));
+            _open_file = SD.open(mqtt_message_store, FILE_WRITE);
+            _open_file.seek((message_id - 1) * sizeof(entry_message));
+            _open_file.write((uint8_t *) &_entry_message, sizeof(entry_message));
+            _open_file.close();
+            freed_count++;
+        }
+#if PERSISTENT_DEBUG
+        if (freed_count > 0) {
+            char buffer[20];
+            logger->start_log("shared messages without reference freed - ", 2);
+            sprintf(buffer, "%lu", (unsigned long) freed_count);
+            logger->append_log(buffer);
+        }
+#endif
+    }
+
+    uint32_t count_shared_messages() {
+        entry_message _entry_message;
+        uint32_t message_count = 0;
+        _open_file.close();
+        _open_file = SD.open(mqtt_message_store, FILE_READ);
+        while (_open_file.read((char *) &_entry_message, sizeof(entry_message)) == sizeof(entry_message)) {
+            message_count++;
+        }
+        _open_file.close();
+        return message_count;
+    }
+
+    void get_publish_file_name(const char *file_number, char *filename_with_extension) {
+        memset(filename_with_extension, 0, sizeof(entry_client::file_number) + sizeof(PUBLISH_FILE_ENDING));
+        memcpy(filename_with_extension, file_number, strnlen(file_number, sizeof(entry_client::file_number)));
+        memcpy(&filename_with_extension[strnlen(file_number, sizeof(entry_client::file_number))],
+               PUBLISH_FILE_ENDING, strlen(PUBLISH_FILE_ENDING));
+    }
+
+    void compact_global_subscriptions() {
+        entry_mqtt_subscription _entry_mqtt_subscription;
+        uint32_t entry_number = 0;
+        uint32_t used_entry_count = 0;
+        while (true) {
+            memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+            _open_file.close();
+            _open_file = SD.open(mqtt_sub, FILE_READ);
+            _open_file.seek(entry_number * sizeof(entry_mqtt_subscription));
+            int readChars = _open_file.read((char *) &_entry_mqtt_subscription, sizeof(entry_mqtt_subscription));
+            _open_file.close();
+            if (readChars != sizeof(entry_mqtt_subscription)) {
+                break;
+            }
+            if (_entry_mqtt_subscription.client_subscription_count != 0) {
+                if (used_entry_count != entry_number) {
+                    // fill the first hole, the entry becomes one
+                    save_global_subscription((uint16_t) used_entry_count, &_entry_mqtt_subscription);
+                    memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+                    save_global_subscription((uint16_t) entry_number, &_entry_mqtt_subscription);
+                }
+                used_entry_count++;
+            } else if (_entry_mqtt_subscription.topic_name[0] != 0) {
+                // a topic nobody subscribes anymore, the index only reuses empty entries
+                memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+                save_global_subscription((uint16_t) entry_number, &_entry_mqtt_subscription);
+            }
+            entry_number++;
+        }
+#if PERSISTENT_DEBUG
+        if (used_entry_count != entry_number) {
+            char buffer[20];
+            logger->start_log("global subscriptions compacted - ", 2);
+            sprintf(buffer, "%lu", (unsigned long) (entry_number - used_entry_count));
+            logger->append_log(buffer);
+            logger->append_log(" empty entries at the end");
+        }
+#endif
+    }
+
+    void index_global_subscriptions() {
+        _global_subscriptions.clear();
+        _global_subscriptions_indexed = true;
+        _open_file.close();
+        _open_file = SD.open(mqtt_sub, FILE_READ);
+
+        entry_mqtt_subscription _entry_mqtt_subscription;
+        uint16_t entry_number = 0;
+        int readChars = 0;
+        do {
+            memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+            uint16_t buffer_size = sizeof(entry_mqtt_subscription);
+            readChars = _open_file.read((char *) &_entry_mqtt_subscription, buffer_size);
+            if (readChars != buffer_size) {
+                break;
+            }
+            if (_entry_mqtt_subscription.client_subscription_count == 0 &&
+                strlen(_entry_mqtt_subscription.topic_name) == 0) {
+                _global_subscriptions.add_free_entry(entry_number);
+            } else if (_entry_mqtt_subscription.client_subscription_count != 0 &&
+                       strlen(_entry_mqtt_subscription.topic_name) < MAXIMUM_TOPIC_NAME_LENGTH) {
+                uint32_t topic_hash = GlobalSubscriptionIndex::hash(_entry_mqtt_subscription.topic_name);
+                if (!_global_subscriptions.add(topic_hash, entry_number)) {
+                    _global_subscriptions_indexed = false;
+                    break;
+                }
+            }
+            entry_number++;
+        } while (readChars > 0);
+        _open_file.close();
+        _global_subscriptions.set_entry_count(entry_number);
+
+#if PERSISTENT_DEBUG
+        logger->log(_global_subscriptions_indexed ? "global subscriptions indexed"
+                                                  : "global subscriptions not indexed - too many topics", 2);
+#endif
+    }
+
+    /**
+     * Finds the topic with the index and reads its MQTT.SUB entry.
+     * @return the slot of the topic in the index or -1 if nobody subscribed to it
+     */
+    int32_t find_global_subscription(const char *topic_name, entry_mqtt_subscription *entry) {
+        uint32_t topic_hash = GlobalSubscriptionIndex::hash(topic_name);
+        uint16_t probe = 0;
+        int32_t slot;
+        while ((slot = _global_subscriptions.find(topic_hash, &probe)) != -1) {
+            // same hash, the topic names decide
+            _open_file.close();
+            _open_file = SD.open(mqtt_sub, FILE_READ);
+            _open_file.seek(_global_subscriptions.get_entry_number(slot) * sizeof(entry_mqtt_subscription));
+            memset(entry, 0, sizeof(entry_mqtt_subscription));
+            int readChars = _open_file.read((char *) entry, sizeof(entry_mqtt_subscription));
+            _open_file.close();
+            if (readChars == sizeof(entry_mqtt_subscription) && entry->client_subscription_count != 0 &&
+                strlen(entry->topic_name) < MAXIMUM_TOPIC_NAME_LENGTH && strcmp(entry->topic_name, topic_name) == 0) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    void save_global_subscription(uint16_t entry_number, entry_mqtt_subscription *entry) {
+        _open_file.close();
+        _open_file = SD.open(mqtt_sub, FILE_WRITE);
+        _open_file.seek(entry_number * sizeof(entry_mqtt_subscription));
+        _open_file.write((const char *) entry, sizeof(entry_mqtt_subscription));
+        _open_file.close();
+    }
+
+public:
+
     virtual bool increment_global_subscription_count(const char *topic_name) {
         if (_error) {
             return false;
@@ -820,6 +1361,37 @@ public:
         logger->append_log(topic_name);
 #endif
 
+        if (_global_subscriptions_indexed) {
+            entry_mqtt_subscription _entry_mqtt_subscription;
+            int32_t slot = find_global_subscription(topic_name, &_entry_mqtt_subscription);
+            if (slot != -1) {
+                _entry_mqtt_subscription.client_subscription_count += 1;
+#if PERSISTENT_DEBUG
+                logger->append_log(" exists - count ");
+                char uint16_buf[6];
+                sprintf(uint16_buf, "%d", _entry_mqtt_subscription.client_subscription_count);
+                logger->append_log(uint16_buf);
+#endif
+                save_global_subscription(_global_subscriptions.get_entry_number(slot), &_entry_mqtt_subscription);
+                return true;
+            }
+            if (_global_subscriptions.has_room()) {
+                uint16_t entry_number = _global_subscriptions.take_free_entry();
+                _global_subscriptions.add(GlobalSubscriptionIndex::hash(topic_name), entry_number);
+                memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+                strcpy((char *) &_entry_mqtt_subscription.topic_name, topic_name);
+                _entry_mqtt_subscription.client_subscription_count = 1;
+#if PERSISTENT_DEBUG
+                logger->append_log(" not exist - count 1");
+#endif
+                save_global_subscription(entry_number, &_entry_mqtt_subscription);
+                return true;
+            }
+            // too many topics, MQTT.SUB is scanned from now on
+            _global_subscriptions_indexed = false;
+            _open_file = SD.open(mqtt_sub, FILE_READ);
+        }
+
         entry_mqtt_subscription _entry_mqtt_subscription;
         uint16_t entry_number = 0;
         int readChars = 0;
@@ -1229,6 +1801,31 @@ private:
         logger->append_log(topic_name);
 #endif
 
+        if (_global_subscriptions_indexed) {
+            entry_mqtt_subscription _entry_mqtt_subscription;
+            int32_t slot = find_global_subscription(topic_name, &_entry_mqtt_subscription);
+            if (slot == -1) {
+#if PERSISTENT_DEBUG
+                logger->append_log(" not exist");
+#endif
+                return true;
+            }
+            uint16_t entry_number = _global_subscriptions.get_entry_number(slot);
+            _entry_mqtt_subscription.client_subscription_count -= 1;
+#if PERSISTENT_DEBUG
+            logger->append_log(" exists - count ");
+            char uint16_buf[6];
+            sprintf(uint16_buf, "%d", _entry_mqtt_subscription.client_subscription_count);
+            logger->append_log(uint16_buf);
+#endif
+            if (_entry_mqtt_subscription.client_subscription_count == 0) {
+                memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+                _global_subscriptions.remove(slot);
+            }
+            save_global_subscription(entry_number, &_entry_mqtt_subscription);
+            return true;
+        }
+
         entry_mqtt_subscription _entry_mqtt_subscription;
         uint16_t entry_number = 0;
         int readChars = 0;
@@ -1279,54 +1876,201 @@ private:
     }
 
 
-
-    virtual void add_client_registration(char *topic_name, uint16_t *new_topic_id) {
+    virtual uint16_t remove_all_subscriptions(char *unsubscribe_topic_names, uint16_t unsubscribe_topic_names_length,
+                                              bool *completed) {
+        *completed = false;
         if (!_transaction_started || _error) {
-            return;
+            return 0;
         }
         if (_not_in_client_registry) {
-            return;
-        }
-        if (strlen(topic_name) > MAXIMUM_TOPIC_NAME_LENGTH) {
-            _error = true;
-            return;
+            *completed = true;
+            return 0;
         }
         _open_file.flush();
         _open_file.close();
 
-        char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(REGISTRATION_FILE_ENDING)];
-
-        // registration file
-        memset(&filename_with_extension, 0, sizeof(_entry_client.file_number) + sizeof(REGISTRATION_FILE_ENDING));
+        // subscription file
+        char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(SUBSCRIBE_FILE_ENDING)];
+        memset(&filename_with_extension, 0, sizeof(_entry_client.file_number) + sizeof(SUBSCRIBE_FILE_ENDING));
         memcpy(&filename_with_extension, &_entry_client.file_number, strlen(_entry_client.file_number));
-        memcpy(&filename_with_extension[strlen(_entry_client.file_number)], REGISTRATION_FILE_ENDING,
-               strlen(REGISTRATION_FILE_ENDING));
-        _open_file = SD.open(filename_with_extension, FILE_READ);
+        memcpy(&filename_with_extension[strlen(_entry_client.file_number)], SUBSCRIBE_FILE_ENDING,
+               strlen(SUBSCRIBE_FILE_ENDING));
+
 #if PERSISTENT_DEBUG
-        logger->start_log("register topic ", 3);
-        logger->append_log(topic_name);
+        logger->start_log("remove_all_subscriptions ", 3);
+        logger->append_log(_entry_client.client_id);
 #endif
 
+        // 1. collect and delete a batch of subscriptions in a single pass over the subscription file
+        char batch_topic_names[SUBSCRIPTION_REMOVE_BATCH_SIZE][MAXIMUM_TOPIC_NAME_LENGTH];
+        uint8_t batch_size = 0;
+        uint16_t batch_topic_names_length = 0;
+        *completed = true;
+
+        _open_file = SD.open(filename_with_extension, FILE_READ);
+        entry_subscription _entry_subscription;
         uint16_t entry_number = 0;
         int readChars = 0;
-        int32_t first_empty_space = -1;
         do {
-            memset(&_registration_entry, 0, sizeof(entry_registration));
-            uint16_t buffer_size = sizeof(entry_registration);
-            readChars = _open_file.read((char *) &_registration_entry, buffer_size);
-            if (readChars == buffer_size) {
-                if (_registration_entry.topic_id == 0 &&
-                    strlen(_registration_entry.topic_name) == 0) {
-                    // empty place found
-                    first_empty_space = entry_number;
-                } else if (_registration_entry.topic_id != 0 &&
-                           strlen(_registration_entry.topic_name) < MAXIMUM_TOPIC_NAME_LENGTH &&
-                           (strcmp(_registration_entry.topic_name, topic_name) == 0)) {
-                    // already_registered
-#if PERSISTENT_DEBUG
-                    logger->append_log(" - already registered topic id ");
-                    char uint16_buf[6];
-                    sprintf(uint16_buf, "%d", _registration_entry.topic_id);
+            memset(&_entry_subscription, 0, sizeof(entry_subscription));
+            uint16_t buffer_size = sizeof(entry_subscription);
+            readChars = _open_file.read((char *) &_entry_subscription, buffer_size);
+            if (readChars == buffer_size && _entry_subscription.topic_id != 0) {
+                uint16_t topic_name_length = (uint16_t) (strnlen(_entry_subscription.topic_name,
+                                                                 MAXIMUM_TOPIC_NAME_LENGTH - 1) + 1);
+                if (batch_size == SUBSCRIPTION_REMOVE_BATCH_SIZE ||
+                    batch_topic_names_length + topic_name_length > unsubscribe_topic_names_length) {
+                    // the rest is removed by the next call
+                    *completed = false;
+                    break;
+                }
+                memset(&batch_topic_names[batch_size], 0, MAXIMUM_TOPIC_NAME_LENGTH);
+                memcpy(&batch_topic_names[batch_size], _entry_subscription.topic_name, topic_name_length - 1);
+                batch_topic_names_length += topic_name_length;
+                batch_size++;
+
+                _open_file.close();
+                _open_file = SD.open(filename_with_extension, FILE_WRITE);
+                memset(&_entry_subscription, 0, sizeof(entry_subscription));
+                _open_file.seek(entry_number * sizeof(entry_subscription));
+                _open_file.write((const char *) &_entry_subscription, sizeof(entry_subscription));
+                _open_file.close();
+                _open_file = SD.open(filename_with_extension, FILE_READ);
+                _open_file.seek((entry_number + 1) * sizeof(entry_subscription));
+            }
+            entry_number++;
+        } while (readChars > 0);
+        _open_file.close();
+
+        if (batch_size == 0) {
+            return 0;
+        }
+
+        // 2. decrement the global subscription counts of the whole batch, by the index or a single pass over MQTT.SUB
+        uint16_t unsubscribe_topic_count = 0;
+        uint16_t unsubscribe_topic_names_position = 0;
+        memset(unsubscribe_topic_names, 0, unsubscribe_topic_names_length);
+
+        if (_global_subscriptions_indexed) {
+            for (uint8_t i = 0; i < batch_size; i++) {
+                entry_mqtt_subscription _entry_mqtt_subscription;
+                int32_t slot = find_global_subscription(batch_topic_names[i], &_entry_mqtt_subscription);
+                if (slot == -1) {
+                    continue;
+                }
+                entry_number = _global_subscriptions.get_entry_number(slot);
+                _entry_mqtt_subscription.client_subscription_count -= 1;
+                if (_entry_mqtt_subscription.client_subscription_count == 0) {
+                    uint16_t topic_name_length = (uint16_t) strlen(batch_topic_names[i]);
+                    memcpy(&unsubscribe_topic_names[unsubscribe_topic_names_position], batch_topic_names[i],
+                           topic_name_length);
+                    unsubscribe_topic_names_position += topic_name_length + 1;
+                    unsubscribe_topic_count++;
+                    memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+                    _global_subscriptions.remove(slot);
+                }
+                save_global_subscription(entry_number, &_entry_mqtt_subscription);
+            }
+        } else {
+            _open_file = SD.open(mqtt_sub, FILE_READ);
+            entry_mqtt_subscription _entry_mqtt_subscription;
+            entry_number = 0;
+            do {
+                memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+                uint16_t buffer_size = sizeof(entry_mqtt_subscription);
+                readChars = _open_file.read((char *) &_entry_mqtt_subscription, buffer_size);
+                if (readChars == buffer_size && _entry_mqtt_subscription.client_subscription_count != 0 &&
+                    strlen(_entry_mqtt_subscription.topic_name) < MAXIMUM_TOPIC_NAME_LENGTH) {
+                    for (uint8_t i = 0; i < batch_size; i++) {
+                        if (strcmp(_entry_mqtt_subscription.topic_name, batch_topic_names[i]) != 0) {
+                            continue;
+                        }
+                        _entry_mqtt_subscription.client_subscription_count -= 1;
+                        if (_entry_mqtt_subscription.client_subscription_count == 0) {
+                            uint16_t topic_name_length = (uint16_t) strlen(batch_topic_names[i]);
+                            memcpy(&unsubscribe_topic_names[unsubscribe_topic_names_position], batch_topic_names[i],
+                                   topic_name_length);
+                            unsubscribe_topic_names_position += topic_name_length + 1;
+                            unsubscribe_topic_count++;
+                            memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+                        }
+                        // save back
+                        _open_file.close();
+                        _open_file = SD.open(mqtt_sub, FILE_WRITE);
+                        _open_file.seek(entry_number * sizeof(entry_mqtt_subscription));
+                        _open_file.write((const char *) &_entry_mqtt_subscription, buffer_size);
+                        _open_file.close();
+                        _open_file = SD.open(mqtt_sub, FILE_READ);
+                        _open_file.seek((entry_number + 1) * sizeof(entry_mqtt_subscription));
+                        break;
+                    }
+                } else if (readChars != 0 && readChars < buffer_size) {
+                    break;
+                }
+                entry_number++;
+            } while (readChars > 0);
+            _open_file.close();
+        }
+
+#if PERSISTENT_DEBUG
+        char uint16_buf[6];
+        logger->append_log(" removed ");
+        sprintf(uint16_buf, "%d", batch_size);
+        logger->append_log(uint16_buf);
+        logger->append_log(" unsubscribe ");
+        sprintf(uint16_buf, "%d", unsubscribe_topic_count);
+        logger->append_log(uint16_buf);
+#endif
+        return unsubscribe_topic_count;
+    }
+
+    virtual void add_client_registration(char *topic_name, uint16_t *new_topic_id) {
+        if (!_transaction_started || _error) {
+            return;
+        }
+        if (_not_in_client_registry) {
+            return;
+        }
+        if (strlen(topic_name) > MAXIMUM_TOPIC_NAME_LENGTH) {
+            _error = true;
+            return;
+        }
+        _open_file.flush();
+        _open_file.close();
+
+        char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(REGISTRATION_FILE_ENDING)];
+
+        // registration file
+        memset(&filename_with_extension, 0, sizeof(_entry_client.file_number) + sizeof(REGISTRATION_FILE_ENDING));
+        memcpy(&filename_with_extension, &_entry_client.file_number, strlen(_entry_client.file_number));
+        memcpy(&filename_with_extension[strlen(_entry_client.file_number)], REGISTRATION_FILE_ENDING,
+               strlen(REGISTRATION_FILE_ENDING));
+        _open_file = SD.open(filename_with_extension, FILE_READ);
+#if PERSISTENT_DEBUG
+        logger->start_log("register topic ", 3);
+        logger->append_log(topic_name);
+#endif
+
+        uint16_t entry_number = 0;
+        int readChars = 0;
+        int32_t first_empty_space = -1;
+        do {
+            memset(&_registration_entry, 0, sizeof(entry_registration));
+            uint16_t buffer_size = sizeof(entry_registration);
+            readChars = _open_file.read((char *) &_registration_entry, buffer_size);
+            if (readChars == buffer_size) {
+                if (_registration_entry.topic_id == 0 &&
+                    strlen(_registration_entry.topic_name) == 0) {
+                    // empty place found
+                    first_empty_space = entry_number;
+                } else if (_registration_entry.topic_id != 0 &&
+                           strlen(_registration_entry.topic_name) < MAXIMUM_TOPIC_NAME_LENGTH &&
+                           (strcmp(_registration_entry.topic_name, topic_name) == 0)) {
+                    // already_registered
+#if PERSISTENT_DEBUG
+                    logger->append_log(" - already registered topic id ");
+                    char uint16_buf[6];
+                    sprintf(uint16_buf, "%d", _registration_entry.topic_id);
                     logger->append_log(uint16_buf);
 #endif
 
@@ -1431,10 +2175,68 @@ public:
             }
             entry_number++;
         } while (readChars > 0);
+#if PERSISTENT_DEBUG
+        logger->append_log(" - not registered");
+#endif
+        return false;
     }
 
-    virtual bool set_topic_known(uint16_t topic_id, bool known){
+    virtual bool set_topic_known(uint16_t topic_id, bool known) {
+        if (!_transaction_started || _error) {
+            return false;
+        }
+        if (_not_in_client_registry) {
+            return false;
+        }
+        if (topic_id == 0) {
+            _error = true;
+            return false;
+        }
+        _open_file.flush();
+        _open_file.close();
+
+        char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(REGISTRATION_FILE_ENDING)];
+
+        // registration file
+        memset(&filename_with_extension, 0, sizeof(_entry_client.file_number) + sizeof(REGISTRATION_FILE_ENDING));
+        memcpy(&filename_with_extension, &_entry_client.file_number, strlen(_entry_client.file_number));
+        memcpy(&filename_with_extension[strlen(_entry_client.file_number)], REGISTRATION_FILE_ENDING,
+               strlen(REGISTRATION_FILE_ENDING));
+        _open_file = SD.open(filename_with_extension, FILE_READ);
+#if PERSISTENT_DEBUG
+        logger->start_log("set_topic_known ", 3);
+        char uint16_buf[6];
+        sprintf(uint16_buf, "%d", topic_id);
+        logger->append_log(uint16_buf);
+        logger->append_log(known ? " - known" : " - unknown");
+#endif
 
+        uint16_t entry_number = 0;
+        int readChars = 0;
+        do {
+            memset(&_registration_entry, 0, sizeof(entry_registration));
+            uint16_t buffer_size = sizeof(entry_registration);
+            readChars = _open_file.read((char *) &_registration_entry, buffer_size);
+            if (readChars == buffer_size) {
+                if (_registration_entry.topic_id == topic_id &&
+                    strlen(_registration_entry.topic_name) < MAXIMUM_TOPIC_NAME_LENGTH) {
+                    _registration_entry.known = known;
+                    _open_file.close();
+                    _open_file = SD.open(filename_with_extension, FILE_WRITE);
+                    _open_file.seek(entry_number * sizeof(entry_registration));
+                    _open_file.write((char *) &_registration_entry, sizeof(entry_registration));
+                    return true;
+                }
+            } else if (readChars != 0 && readChars < buffer_size) {
+                break;
+            }
+            entry_number++;
+        } while (readChars > 0);
+#if PERSISTENT_DEBUG
+        logger->append_log(" - not registered");
+#endif
+        _error = true;
+        return false;
     }
 
 
@@ -1605,7 +2407,7 @@ public:
         if (_not_in_client_registry) {
             return;
         }
-        _entry_client.await_message_id == msg_id;
+        _entry_client.await_message_id = msg_id;
 
         _open_file.close();
         _open_file = SD.open(client_registry, FILE_WRITE);
@@ -1857,6 +2659,23 @@ public:
         logger->append_log(topic_name);
 #endif
 
+        if (_global_subscriptions_indexed) {
+            entry_mqtt_subscription _entry_mqtt_subscription;
+            if (find_global_subscription(topic_name, &_entry_mqtt_subscription) == -1) {
+#if PERSISTENT_DEBUG
+                logger->append_log(" not exist");
+#endif
+                return 0;
+            }
+#if PERSISTENT_DEBUG
+            logger->append_log(" exists - count ");
+            char uint16_buf[6];
+            sprintf(uint16_buf, "%d", _entry_mqtt_subscription.client_subscription_count);
+            logger->append_log(uint16_buf);
+#endif
+            return _entry_mqtt_subscription.client_subscription_count;
+        }
+
         entry_mqtt_subscription _entry_mqtt_subscription;
         uint16_t entry_number = 0;
         int readChars = 0;
@@ -1889,6 +2708,52 @@ public:
         return 0;
     }
 
+    virtual uint16_t get_global_subscriptions(char *topic_names, uint16_t topic_names_length, uint32_t *cursor,
+                                              bool *completed) {
+        *completed = false;
+        _open_file.close();
+        _open_file = SD.open(mqtt_sub, FILE_READ);
+        _open_file.seek(*cursor * sizeof(entry_mqtt_subscription));
+
+        memset(topic_names, 0, topic_names_length);
+        uint16_t topic_count = 0;
+        uint16_t topic_names_position = 0;
+        entry_mqtt_subscription _entry_mqtt_subscription;
+        int readChars = 0;
+        do {
+            memset(&_entry_mqtt_subscription, 0, sizeof(entry_mqtt_subscription));
+            uint16_t buffer_size = sizeof(entry_mqtt_subscription);
+            readChars = _open_file.read((char *) &_entry_mqtt_subscription, buffer_size);
+            if (readChars != buffer_size) {
+                *completed = true;
+                break;
+            }
+            if (_entry_mqtt_subscription.client_subscription_count != 0 &&
+                strlen(_entry_mqtt_subscription.topic_name) > 0) {
+                uint16_t topic_name_length = (uint16_t) (strnlen(_entry_mqtt_subscription.topic_name,
+                                                                 MAXIMUM_TOPIC_NAME_LENGTH - 1) + 1);
+                if (topic_names_position + topic_name_length > topic_names_length) {
+                    // the rest is read by the next call
+                    break;
+                }
+                memcpy(&topic_names[topic_names_position], _entry_mqtt_subscription.topic_name,
+                       topic_name_length - 1);
+                topic_names_position += topic_name_length;
+                topic_count++;
+            }
+            *cursor += 1;
+        } while (readChars > 0);
+        _open_file.close();
+
+#if PERSISTENT_DEBUG
+        logger->start_log("get_global_subscriptions - count ", 3);
+        char uint16_buf[6];
+        sprintf(uint16_buf, "%d", topic_count);
+        logger->append_log(uint16_buf);
+#endif
+        return topic_count;
+    }
+
     // publish
 
     virtual bool has_client_publishes() {
@@ -1898,6 +2763,7 @@ public:
         if (_not_in_client_registry) {
             return false;
         }
+        load_queue_config();
 
         _open_file.close();
         char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING)];
@@ -1908,6 +2774,7 @@ public:
                strlen(PUBLISH_FILE_ENDING));
         _open_file = SD.open(filename_with_extension, FILE_READ);
 
+        uint32_t timestamp = (uint32_t) millis();
         entry_publish _entry_publish;
         int readChars = 0;
         do {
@@ -1915,7 +2782,7 @@ public:
             uint16_t buffer_size = sizeof(entry_publish);
             readChars = _open_file.read((char *) &_entry_publish, buffer_size);
             if (readChars == buffer_size) {
-                if (_entry_publish.publish_id != 0) {
+                if (_entry_publish.publish_id != 0 && !is_publish_expired(&_entry_publish, timestamp)) {
                     // found a non empty publish
                     return true;
                 }
@@ -1929,53 +2796,92 @@ public:
     }
 
 
-    virtual void add_client_publish(uint8_t *data, uint8_t data_len, uint16_t topic_id, bool retain,
+    virtual bool add_client_publish(uint8_t *data, uint8_t data_len, uint16_t topic_id, bool retain,
                                     uint8_t qos, bool dup, uint16_t msg_id) {
         if (!_transaction_started || _error) {
-            return;
+            return false;
         }
         if (_not_in_client_registry) {
-            return;
+            return false;
+        }
+        uint16_t message_id = add_shared_message(data, data_len);
+        if (message_id == 0) {
+            return false;
+        }
+        bool queued = add_client_shared_publish(message_id, data_len, topic_id, false, retain, qos);
+        release_shared_message(message_id);
+        return queued;
+    }
+
+    virtual bool add_client_shared_publish(uint16_t message_id, uint8_t data_len, uint16_t topic_id,
+                                           bool predefined_topic, bool retain, uint8_t qos) {
+        if (!_transaction_started || _error) {
+            return false;
+        }
+        if (_not_in_client_registry) {
+            return false;
+        }
+        if (message_id == 0) {
+            return false;
+        }
+        load_queue_config();
+        if (_queue_maximum_bytes > 0 && data_len > _queue_maximum_bytes) {
+            return false;
         }
 
-        _open_file.close();
         char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING)];
-        // will file
         memset(&filename_with_extension, 0, sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING));
         memcpy(&filename_with_extension, &_entry_client.file_number, strlen(_entry_client.file_number));
         memcpy(&filename_with_extension[strlen(_entry_client.file_number)], PUBLISH_FILE_ENDING,
                strlen(PUBLISH_FILE_ENDING));
-        _open_file = SD.open(filename_with_extension, FILE_READ);
-
 
-        entry_publish _entry_publish;
-        uint16_t  entry_number = 0;
-        int readChars = 0;
+        uint32_t timestamp = (uint32_t) millis();
         int32_t first_empty_space = -1;
-        do {
-            memset(&_entry_publish, 0, sizeof(entry_publish));
-            uint16_t buffer_size = sizeof(entry_publish);
-            readChars = _open_file.read((char *) &_entry_publish, buffer_size);
-            if (readChars == buffer_size) {
-                if (_entry_publish.publish_id == 0) {
-                    first_empty_space = entry_number;
-                }
-
-            } else if (readChars != 0 && readChars < buffer_size) {
+        uint16_t publish_count = 0;
+        uint32_t publish_bytes = 0;
+        // the scan removes expired publishes and finds the free space, repeated after each eviction
+        while (true) {
+            first_empty_space = scan_client_publishes(filename_with_extension, timestamp, &publish_count,
+                                                      &publish_bytes);
+            bool messages_exceeded = _queue_maximum_messages > 0 && publish_count + 1 > _queue_maximum_messages;
+            bool bytes_exceeded = _queue_maximum_bytes > 0 && publish_bytes + data_len > _queue_maximum_bytes;
+            if (!messages_exceeded && !bytes_exceeded) {
                 break;
             }
-            entry_number++;
-        } while (readChars > 0);
+            if (_queue_overflow_policy == QUEUE_DROP_NEWEST) {
+#if PERSISTENT_DEBUG
+                logger->start_log("publish queue full - new publish dropped for ", 2);
+                logger->append_log(_entry_client.client_id);
+#endif
+                return false;
+            }
+            bool evicted = false;
+            if (_queue_overflow_policy == QUEUE_DROP_QOS0_FIRST) {
+                evicted = evict_oldest_client_publish(filename_with_extension, timestamp, true);
+            }
+            if (!evicted) {
+                evicted = evict_oldest_client_publish(filename_with_extension, timestamp, false);
+            }
+            if (!evicted) {
+                // only publishes in flight left
+                return false;
+            }
+#if PERSISTENT_DEBUG
+            logger->start_log("publish queue full - oldest publish dropped for ", 2);
+            logger->append_log(_entry_client.client_id);
+#endif
+        }
 
-        if (first_empty_space == -1) {
-            // no empty space => append
-            first_empty_space = entry_number-1;
+        if (!retain_shared_message(message_id)) {
+            return false;
         }
 
+        entry_publish _entry_publish;
         memset(&_entry_publish, 0, sizeof(entry_publish));
-        memcpy(&_entry_publish.msg, data, data_len);
+        _entry_publish.message_id = message_id;
         _entry_publish.msg_length = data_len;
         _entry_publish.topic_id = topic_id;
+        _entry_publish.predefined_topic = predefined_topic;
         _entry_publish.qos = qos;
         _entry_publish.retain = retain;
         _entry_publish.dup = false;
@@ -1983,16 +2889,33 @@ public:
         // TODO fix type stuff
         _entry_publish.publish_id = first_empty_space+1;
         _entry_publish.retransmition_timeout = 0;
+        _entry_publish.created = timestamp;
 
         _open_file.close();
         _open_file = SD.open(filename_with_extension, FILE_WRITE);
         _open_file.seek(first_empty_space * sizeof(entry_publish));
         _open_file.write((uint8_t *) &_entry_publish, sizeof(entry_publish));
+        _open_file.close();
+        set_client_queue_depth((uint16_t) (publish_count + 1), publish_bytes + data_len);
+        return true;
+    }
+
+    virtual void get_client_publish_queue_depth(uint16_t *publish_count, uint32_t *publish_bytes) {
+        *publish_count = 0;
+        *publish_bytes = 0;
+        if (!_transaction_started || _error) {
+            return;
+        }
+        if (_not_in_client_registry) {
+            return;
+        }
+        *publish_count = _entry_client.queued_publish_count;
+        *publish_bytes = _entry_client.queued_publish_bytes;
     }
 
 
     virtual void
-    get_next_publish(uint8_t *data, uint8_t *data_len, uint16_t *topic_id, bool *retain,
+    get_next_publish(uint8_t *data, uint8_t *data_len, uint16_t *topic_id, bool *predefined_topic, bool *retain,
                      uint8_t *qos, bool *dup, uint16_t *publish_id) {
         if (!_transaction_started || _error) {
             *data_len = 0;
@@ -2004,6 +2927,7 @@ public:
             *publish_id = 0;
             return;
         }
+        load_queue_config();
 
         _open_file.close();
         char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING)];
@@ -2012,29 +2936,15 @@ public:
         memcpy(&filename_with_extension, &_entry_client.file_number, strlen(_entry_client.file_number));
         memcpy(&filename_with_extension[strlen(_entry_client.file_number)], PUBLISH_FILE_ENDING,
                strlen(PUBLISH_FILE_ENDING));
-        _open_file = SD.open(filename_with_extension, FILE_READ);
 
+        // the oldest publish is send first, expired publishes are removed
+        uint32_t timestamp = (uint32_t) millis();
+        uint16_t publish_count = 0;
+        uint32_t publish_bytes = 0;
+        scan_client_publishes(filename_with_extension, timestamp, &publish_count, &publish_bytes);
+        int32_t oldest_publish_entry = find_oldest_client_publish(filename_with_extension, timestamp, false, true);
 
-        entry_publish _entry_publish;
-        uint16_t  entry_number = 0;
-        int readChars = 0;
-        int32_t last_publish_entry = -1;
-        do {
-            memset(&_entry_publish, 0, sizeof(entry_publish));
-            uint16_t buffer_size = sizeof(entry_publish);
-            readChars = _open_file.read((char *) &_entry_publish, buffer_size);
-            if (readChars == buffer_size) {
-                if (_entry_publish.publish_id != 0) {
-                    last_publish_entry = entry_number;
-                }
-
-            } else if (readChars != 0 && readChars < buffer_size) {
-                break;
-            }
-            entry_number++;
-        } while (readChars > 0);
-
-        if (last_publish_entry == -1) {
+        if (oldest_publish_entry == -1) {
             // no empty publish available
             *data_len = 0;
             *publish_id = 0;
@@ -2043,28 +2953,233 @@ public:
 
         _open_file.close();
         _open_file = SD.open(filename_with_extension, FILE_READ);
-        _open_file.seek(last_publish_entry * sizeof(entry_publish));
+        _open_file.seek(oldest_publish_entry * sizeof(entry_publish));
+        entry_publish _entry_publish;
         memset(&_entry_publish, 0, sizeof(entry_publish));
         uint16_t buffer_size = sizeof(entry_publish);
         _open_file.read((char *) &_entry_publish, buffer_size);
 
-        memcpy(data, &_entry_publish.msg, _entry_publish.msg_length);
-        *data_len = _entry_publish.msg_length;
+        if (!read_shared_message(_entry_publish.message_id, data, data_len)) {
+            _error = true;
+            *data_len = 0;
+            *publish_id = 0;
+            return;
+        }
         *topic_id = _entry_publish.topic_id,
+        *predefined_topic = _entry_publish.predefined_topic;
         *retain = _entry_publish.retain;
         *qos = _entry_publish.qos;
         *dup = _entry_publish.dup;
         *publish_id = _entry_publish.publish_id;
     }
 
+private:
 
-    virtual void set_publish_msg_id(uint16_t publish_id, uint16_t msg_id) {
-        if (!_transaction_started || _error) {
-            return;
-        }
-        if (_not_in_client_registry) {
-            return;
-        }
+    bool is_publish_expired(entry_publish *publish, uint32_t timestamp) {
+        // publishes in flight are completed by the retransmission
+        return _queue_expiry > 0 && publish->msg_id == 0 && timestamp - publish->created > _queue_expiry * 1000;
+    }
+
+    /**
+     * Removes the expired publishes and counts the remaining ones.
+     * @return the first empty entry number for a new publish
+     */
+    int32_t scan_client_publishes(const char *filename_with_extension, uint32_t timestamp, uint16_t *publish_count,
+                                  uint32_t *publish_bytes) {
+        *publish_count = 0;
+        *publish_bytes = 0;
+        _open_file.close();
+        _open_file = SD.open(filename_with_extension, FILE_READ);
+
+        entry_publish _entry_publish;
+        uint16_t entry_number = 0;
+        int readChars = 0;
+        int32_t first_empty_space = -1;
+        do {
+            memset(&_entry_publish, 0, sizeof(entry_publish));
+            uint16_t buffer_size = sizeof(entry_publish);
+            readChars = _open_file.read((char *) &_entry_publish, buffer_size);
+            if (readChars == buffer_size) {
+                if (_entry_publish.publish_id != 0 && is_publish_expired(&_entry_publish, timestamp)) {
+#if PERSISTENT_DEBUG
+                    logger->start_log("publish expired for ", 2);
+                    logger->append_log(_entry_client.client_id);
+#endif
+                    release_shared_message(_entry_publish.message_id);
+                    memset(&_entry_publish, 0, sizeof(entry_publish));
+                    _open_file.close();
+                    _open_file = SD.open(filename_with_extension, FILE_WRITE);
+                    _open_file.seek(entry_number * sizeof(entry_publish));
+                    _open_file.write((uint8_t *) &_entry_publish, sizeof(entry_publish));
+                    _open_file.close();
+                    _open_file = SD.open(filename_with_extension, FILE_READ);
+                    _open_file.seek((entry_number + 1) * sizeof(entry_publish));
+                }
+                if (_entry_publish.publish_id == 0) {
+                    if (first_empty_space == -1) {
+                        first_empty_space = entry_number;
+                    }
+                } else {
+                    *publish_count += 1;
+                    *publish_bytes += _entry_publish.msg_length;
+                }
+            } else if (readChars != 0 && readChars < buffer_size) {
+                break;
+            }
+            entry_number++;
+        } while (readChars > 0);
+        _open_file.close();
+
+        if (first_empty_space == -1) {
+            // no empty space => append
+            first_empty_space = entry_number - 1;
+        }
+        // expired publishes were removed
+        set_client_queue_depth(*publish_count, *publish_bytes);
+        return first_empty_space;
+    }
+
+    /**
+     * Writes the depth of the publish queue into the client entry, if it changed.
+     */
+    void set_client_queue_depth(uint16_t publish_count, uint32_t publish_bytes) {
+        if (_entry_client.queued_publish_count == publish_count &&
+            _entry_client.queued_publish_bytes == publish_bytes) {
+            return;
+        }
+        _entry_client.queued_publish_count = publish_count;
+        _entry_client.queued_publish_bytes = publish_bytes;
+        int client_position = parse_file_number_to_int(&_entry_client);
+        _open_file.close();
+        _open_file = SD.open(client_registry, FILE_WRITE);
+        _open_file.seek(client_position * sizeof(entry_client));
+        _open_file.write((const char *) &_entry_client, sizeof(entry_client));
+        _open_file.close();
+    }
+
+    void remove_client_queue_publish(uint8_t msg_length) {
+        uint16_t publish_count = _entry_client.queued_publish_count;
+        uint32_t publish_bytes = _entry_client.queued_publish_bytes;
+        set_client_queue_depth((uint16_t) (publish_count > 0 ? publish_count - 1 : 0),
+                               publish_bytes > msg_length ? publish_bytes - msg_length : 0);
+    }
+
+    /**
+     * @param qos0_only only look at QoS 0 publishes
+     * @param in_flight also look at publishes waiting for their acknowledge
+     * @return the entry number of the oldest publish, -1 if none exists
+     */
+    int32_t find_oldest_client_publish(const char *filename_with_extension, uint32_t timestamp, bool qos0_only,
+                                       bool in_flight) {
+        _open_file.close();
+        _open_file = SD.open(filename_with_extension, FILE_READ);
+
+        entry_publish _entry_publish;
+        uint16_t entry_number = 0;
+        int readChars = 0;
+        int32_t oldest_publish_entry = -1;
+        uint32_t oldest_publish_age = 0;
+        do {
+            memset(&_entry_publish, 0, sizeof(entry_publish));
+            uint16_t buffer_size = sizeof(entry_publish);
+            readChars = _open_file.read((char *) &_entry_publish, buffer_size);
+            if (readChars == buffer_size) {
+                if (_entry_publish.publish_id != 0 &&
+                    (!qos0_only || _entry_publish.qos == 0) &&
+                    (in_flight || _entry_publish.msg_id == 0)) {
+                    // ages instead of timestamps survive the overflow
+                    uint32_t age = timestamp - _entry_publish.created;
+                    if (oldest_publish_entry == -1 || age > oldest_publish_age) {
+                        oldest_publish_entry = entry_number;
+                        oldest_publish_age = age;
+                    }
+                }
+            } else if (readChars != 0 && readChars < buffer_size) {
+                break;
+            }
+            entry_number++;
+        } while (readChars > 0);
+        _open_file.close();
+        return oldest_publish_entry;
+    }
+
+    bool evict_oldest_client_publish(const char *filename_with_extension, uint32_t timestamp, bool qos0_only) {
+        // publishes in flight are never evicted, they are completed by the retransmission
+        int32_t oldest_publish_entry = find_oldest_client_publish(filename_with_extension, timestamp, qos0_only,
+                                                                  false);
+        if (oldest_publish_entry == -1) {
+            return false;
+        }
+        entry_publish _entry_publish;
+        memset(&_entry_publish, 0, sizeof(entry_publish));
+        _open_file.close();
+        _open_file = SD.open(filename_with_extension, FILE_READ);
+        _open_file.seek(oldest_publish_entry * sizeof(entry_publish));
+        _open_file.read((char *) &_entry_publish, sizeof(entry_publish));
+        release_shared_message(_entry_publish.message_id);
+
+        memset(&_entry_publish, 0, sizeof(entry_publish));
+        _open_file.close();
+        _open_file = SD.open(filename_with_extension, FILE_WRITE);
+        _open_file.seek(oldest_publish_entry * sizeof(entry_publish));
+        _open_file.write((uint8_t *) &_entry_publish, sizeof(entry_publish));
+        _open_file.close();
+        return true;
+    }
+
+    void load_queue_config() {
+        if (_queue_config_loaded) {
+            return;
+        }
+        _queue_config_loaded = true;
+
+        _open_file.close();
+        _open_file = SD.open(mqtt_configuration, FILE_READ);
+        const char *q_messages = "queuemessages";
+        const char *q_bytes = "queuebytes";
+        const char *q_drop = "queuedrop";
+        const char *q_expiry = "queueexpiry";
+        char buffer[128];
+        memset(&buffer, 0, sizeof(buffer));
+        while (readLine((char *) &buffer, sizeof(buffer)) > 0) {
+            uint16_t line_length = (uint16_t) (strlen(buffer) + 1);
+            uint16_t value = 0;
+            if (memcmp(&buffer, q_messages, strlen(q_messages)) == 0) {
+                if (parse_uint16_t_after_space(&value, buffer, line_length)) {
+                    _queue_maximum_messages = value;
+                }
+            } else if (memcmp(&buffer, q_bytes, strlen(q_bytes)) == 0) {
+                if (parse_uint16_t_after_space(&value, buffer, line_length)) {
+                    _queue_maximum_bytes = value;
+                }
+            } else if (memcmp(&buffer, q_drop, strlen(q_drop)) == 0) {
+                if (strstr(buffer, "newest") != nullptr) {
+                    _queue_overflow_policy = QUEUE_DROP_NEWEST;
+                } else if (strstr(buffer, "qos0") != nullptr) {
+                    _queue_overflow_policy = QUEUE_DROP_QOS0_FIRST;
+                } else {
+                    _queue_overflow_policy = QUEUE_DROP_OLDEST;
+                }
+            } else if (memcmp(&buffer, q_expiry, strlen(q_expiry)) == 0) {
+                if (parse_uint16_t_after_space(&value, buffer, line_length)) {
+                    _queue_expiry = value;
+                }
+            }
+            memset(&buffer, 0, sizeof(buffer));
+        }
+        _open_file.close();
+    }
+
+public:
+
+
+    virtual void set_publish_msg_id(uint16_t publish_id, uint16_t msg_id) {
+        if (!_transaction_started || _error) {
+            return;
+        }
+        if (_not_in_client_registry) {
+            return;
+        }
 
         _open_file.close();
         char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING)];
@@ -2096,6 +3211,98 @@ public:
 
 
 
+    virtual void
+    get_publish_by_msg_id(uint16_t msg_id, uint8_t *data, uint8_t *data_len, uint16_t *topic_id,
+                          bool *predefined_topic, bool *retain, uint8_t *qos, bool *dup, uint16_t *publish_id) {
+        *data_len = 0;
+        *publish_id = 0;
+        if (!_transaction_started || _error) {
+            return;
+        }
+        if (_not_in_client_registry) {
+            return;
+        }
+        if (msg_id == 0) {
+            // there is no message id which is zero (0)
+            return;
+        }
+
+        _open_file.close();
+        char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING)];
+        // will file
+        memset(&filename_with_extension, 0, sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING));
+        memcpy(&filename_with_extension, &_entry_client.file_number, strlen(_entry_client.file_number));
+        memcpy(&filename_with_extension[strlen(_entry_client.file_number)], PUBLISH_FILE_ENDING,
+               strlen(PUBLISH_FILE_ENDING));
+        _open_file = SD.open(filename_with_extension, FILE_READ);
+
+        entry_publish _entry_publish;
+        int readChars = 0;
+        do {
+            memset(&_entry_publish, 0, sizeof(entry_publish));
+            uint16_t buffer_size = sizeof(entry_publish);
+            readChars = _open_file.read((char *) &_entry_publish, buffer_size);
+            if (readChars == buffer_size) {
+                if (_entry_publish.publish_id != 0 && _entry_publish.msg_id == msg_id) {
+                    // found
+                    if (!read_shared_message(_entry_publish.message_id, data, data_len)) {
+                        _error = true;
+                        *data_len = 0;
+                        return;
+                    }
+                    *topic_id = _entry_publish.topic_id;
+                    *predefined_topic = _entry_publish.predefined_topic;
+                    *retain = _entry_publish.retain;
+                    *qos = _entry_publish.qos;
+                    *dup = _entry_publish.dup;
+                    *publish_id = _entry_publish.publish_id;
+                    return;
+                }
+            } else if (readChars != 0 && readChars < buffer_size) {
+                break;
+            }
+        } while (readChars > 0);
+        // there is no message id with the give msg_id
+    }
+
+    virtual void set_publish_retransmission(uint16_t publish_id, bool dup, uint32_t retransmition_timeout) {
+        if (!_transaction_started || _error) {
+            return;
+        }
+        if (_not_in_client_registry) {
+            return;
+        }
+
+        _open_file.close();
+        char filename_with_extension[sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING)];
+        // will file
+        memset(&filename_with_extension, 0, sizeof(_entry_client.file_number) + sizeof(PUBLISH_FILE_ENDING));
+        memcpy(&filename_with_extension, &_entry_client.file_number, strlen(_entry_client.file_number));
+        memcpy(&filename_with_extension[strlen(_entry_client.file_number)], PUBLISH_FILE_ENDING,
+               strlen(PUBLISH_FILE_ENDING));
+        _open_file = SD.open(filename_with_extension, FILE_READ);
+        _open_file.seek((publish_id-1) * sizeof(entry_publish));
+
+        entry_publish _entry_publish;
+        int readChars = 0;
+        memset(&_entry_publish, 0, sizeof(entry_publish));
+        uint16_t buffer_size = sizeof(entry_publish);
+        readChars = _open_file.read((char *) &_entry_publish, buffer_size);
+        if (readChars == buffer_size) {
+            if (_entry_publish.publish_id == publish_id) {
+                _entry_publish.dup = dup;
+                _entry_publish.retransmition_timeout = retransmition_timeout;
+                _open_file.close();
+                _open_file = SD.open(filename_with_extension, FILE_WRITE);
+                _open_file.seek((publish_id-1) * sizeof(entry_publish));
+                _open_file.write((uint8_t *) &_entry_publish, sizeof(entry_publish));
+            }else{
+                _error = true;
+            }
+        }
+    }
+
+
     virtual void remove_publish_by_msg_id(uint16_t msg_id) {
         if (!_transaction_started || _error) {
             return;
@@ -2106,6 +3313,7 @@ public:
         if (msg_id == 0) {
             // there is no message id which is zero (0)
             _error = true;
+            return;
         }
 
         _open_file.close();
@@ -2129,10 +3337,15 @@ public:
             if (readChars == buffer_size) {
                 if (_entry_publish.msg_id == msg_id) {
                     // found
+                    release_shared_message(_entry_publish.message_id);
+                    uint8_t msg_length = _entry_publish.msg_length;
                     memset(&_entry_publish, 0, sizeof(entry_publish));
+                    _open_file.close();
                     _open_file = SD.open(filename_with_extension, FILE_WRITE);
-                    _open_file.seek(entry_number * sizeof(buffer_size));
-                    _open_file.write((char *) &_entry_publish, sizeof(buffer_size));
+                    _open_file.seek(entry_number * sizeof(entry_publish));
+                    _open_file.write((char *) &_entry_publish, sizeof(entry_publish));
+                    _open_file.close();
+                    remove_client_queue_publish(msg_length);
                     return;
                 }
 
@@ -2170,25 +3383,383 @@ public:
         readChars = _open_file.read((char *) &_entry_publish, buffer_size);
         if (readChars == buffer_size) {
             if (_entry_publish.publish_id == publish_id) {
+                release_shared_message(_entry_publish.message_id);
+                uint8_t msg_length = _entry_publish.msg_length;
                 memset(&_entry_publish, 0, sizeof(entry_publish));
                 _open_file.close();
                 _open_file = SD.open(filename_with_extension, FILE_WRITE);
                 _open_file.seek((publish_id-1) * sizeof(entry_publish));
                 _open_file.write((uint8_t *) &_entry_publish, sizeof(entry_publish));
+                _open_file.close();
+                remove_client_queue_publish(msg_length);
             }else{
                 _error = true;
             }
         }
     }
 
+    // shared message store
+
+    virtual uint16_t add_shared_message(const uint8_t *data, uint8_t data_len) {
+        _open_file.close();
+        _open_file = SD.open(mqtt_message_store, FILE_READ);
+
+        entry_message _entry_message;
+        uint16_t entry_number = 0;
+        int readChars = 0;
+        int32_t first_empty_space = -1;
+        do {
+            memset(&_entry_message, 0, sizeof(entry_message));
+            uint16_t buffer_size = sizeof(entry_message);
+            readChars = _open_file.read((char *) &_entry_message, buffer_size);
+            if (readChars == buffer_size) {
+                if (_entry_message.reference_count == 0) {
+                    first_empty_space = entry_number;
+                    break;
+                }
+            } else if (readChars != 0 && readChars < buffer_size) {
+                break;
+            }
+            entry_number++;
+        } while (readChars > 0);
+
+        if (first_empty_space == -1) {
+            // no empty space => append
+            first_empty_space = entry_number - 1;
+        }
+        if (first_empty_space >= UINT16_MAX) {
+            return 0;
+        }
+
+        memset(&_entry_message, 0, sizeof(entry_message));
+        memcpy(&_entry_message.msg, data, data_len);
+        _entry_message.msg_length = data_len;
+        _entry_message.reference_count = 1;
+
+        _open_file.close();
+        _open_file = SD.open(mqtt_message_store, FILE_WRITE);
+        _open_file.seek(first_empty_space * sizeof(entry_message));
+        _open_file.write((uint8_t *) &_entry_message, sizeof(entry_message));
+        _open_file.close();
+        return (uint16_t) (first_empty_space + 1);
+    }
+
+    virtual void release_shared_message(uint16_t message_id) {
+        uint16_t reference_count = 0;
+        if (!read_shared_message_reference_count(message_id, &reference_count) || reference_count == 0) {
+            return;
+        }
+        if (reference_count == 1) {
+            // last reference: free the whole entry, so the payload does not survive on the card
+            entry_message _entry_message;
+            memset(&_entry_message, 0, sizeof(entry_message));
+            _open_file.close();
+            _open_file = SD.open(mqtt_message_store, FILE_WRITE);
+            _open_file.seek((message_id - 1) * sizeof(entry_message));
+            _open_file.write((uint8_t *) &_entry_message, sizeof(entry_message));
+            _open_file.close();
+            return;
+        }
+        write_shared_message_reference_count(message_id, (uint16_t) (reference_count - 1));
+    }
+
+private:
+
+    bool retain_shared_message(uint16_t message_id) {
+        uint16_t reference_count = 0;
+        if (!read_shared_message_reference_count(message_id, &reference_count) || reference_count == 0 ||
+            reference_count == UINT16_MAX) {
+            return false;
+        }
+        write_shared_message_reference_count(message_id, (uint16_t) (reference_count + 1));
+        return true;
+    }
+
+    bool read_shared_message(uint16_t message_id, uint8_t *data, uint8_t *data_len) {
+        if (message_id == 0) {
+            return false;
+        }
+        entry_message _entry_message;
+        memset(&_entry_message, 0, sizeof(entry_message));
+        _open_file.close();
+        _open_file = SD.open(mqtt_message_store, FILE_READ);
+        _open_file.seek((message_id - 1) * sizeof(entry_message));
+        int readChars = _open_file.read((char *) &_entry_message, sizeof(entry_message));
+        _open_file.close();
+        if (readChars != sizeof(entry_message) || _entry_message.reference_count == 0) {
+            return false;
+        }
+        memcpy(data, &_entry_message.msg, _entry_message.msg_length);
+        *data_len = _entry_message.msg_length;
+        return true;
+    }
+
+    // the reference count is read and written alone, the payload is only written once per message
+
+    bool read_shared_message_reference_count(uint16_t message_id, uint16_t *reference_count) {
+        if (message_id == 0) {
+            return false;
+        }
+        _open_file.close();
+        _open_file = SD.open(mqtt_message_store, FILE_READ);
+        _open_file.seek((message_id - 1) * sizeof(entry_message) + offsetof(entry_message, reference_count));
+        int readChars = _open_file.read((char *) reference_count, sizeof(uint16_t));
+        _open_file.close();
+        return readChars == sizeof(uint16_t);
+    }
+
+    void write_shared_message_reference_count(uint16_t message_id, uint16_t reference_count) {
+        _open_file.close();
+        _open_file = SD.open(mqtt_message_store, FILE_WRITE);
+        _open_file.seek((message_id - 1) * sizeof(entry_message) + offsetof(entry_message, reference_count));
+        _open_file.write((uint8_t *) &reference_count, sizeof(uint16_t));
+        _open_file.close();
+    }
+
+    void release_client_publishes(const char *filename_with_extension) {
+        entry_publish _entry_publish;
+        uint16_t entry_number = 0;
+        while (true) {
+            memset(&_entry_publish, 0, sizeof(entry_publish));
+            _open_file.close();
+            _open_file = SD.open(filename_with_extension, FILE_READ);
+            _open_file.seek(entry_number * sizeof(entry_publish));
+            int readChars = _open_file.read((char *) &_entry_publish, sizeof(entry_publish));
+            if (readChars != sizeof(entry_publish)) {
+                break;
+            }
+            if (_entry_publish.publish_id != 0) {
+                release_shared_message(_entry_publish.message_id);
+            }
+            entry_number++;
+        }
+        _open_file.close();
+    }
+
+public:
+
     // gateway configuration
 
+    virtual bool add_spool_publish(const char *topic_name, const uint8_t *data, uint8_t data_len, uint8_t qos,
+                                   bool retain) {
+        load_spool();
+        if (_spool_capacity == 0) {
+            return false;
+        }
+        if (topic_name == nullptr || strlen(topic_name) == 0 || strlen(topic_name) >= MAXIMUM_TOPIC_NAME_LENGTH) {
+            return false;
+        }
+        if (_spool_header.count >= _spool_capacity) {
+            if (!_spool_drop_oldest) {
+#if PERSISTENT_DEBUG
+                logger->log("spool full - publish rejected", 2);
+#endif
+                return false;
+            }
+#if PERSISTENT_DEBUG
+            logger->log("spool full - oldest publish dropped", 2);
+#endif
+            _spool_header.head = (uint16_t) ((_spool_header.head + 1) % _spool_capacity);
+            _spool_header.count--;
+        }
+        entry_spool _entry_spool;
+        memset(&_entry_spool, 0, sizeof(entry_spool));
+        strcpy(_entry_spool.topic_name, topic_name);
+        memcpy(&_entry_spool.msg, data, data_len);
+        _entry_spool.msg_length = data_len;
+        _entry_spool.qos = qos;
+        _entry_spool.retain = retain;
+
+        uint16_t entry_number = (uint16_t) ((_spool_header.head + _spool_header.count) % _spool_capacity);
+        _open_file.close();
+        _open_file = SD.open(mqtt_spool, FILE_WRITE);
+        _open_file.seek(sizeof(entry_spool_header) + entry_number * sizeof(entry_spool));
+        _open_file.write((const char *) &_entry_spool, sizeof(entry_spool));
+        _open_file.close();
+
+        _spool_header.count++;
+        save_spool_header();
+        return true;
+    }
+
+    virtual bool get_spool_publish(uint16_t position, char *topic_name, uint8_t *data, uint8_t *data_len,
+                                   uint8_t *qos, bool *retain) {
+        load_spool();
+        if (position >= _spool_header.count) {
+            return false;
+        }
+        uint16_t entry_number = (uint16_t) ((_spool_header.head + position) % _spool_capacity);
+        entry_spool _entry_spool;
+        memset(&_entry_spool, 0, sizeof(entry_spool));
+        _open_file.close();
+        _open_file = SD.open(mqtt_spool, FILE_READ);
+        _open_file.seek(sizeof(entry_spool_header) + entry_number * sizeof(entry_spool));
+        int readChars = _open_file.read((char *) &_entry_spool, sizeof(entry_spool));
+        _open_file.close();
+        if (readChars != sizeof(entry_spool) || strlen(_entry_spool.topic_name) >= MAXIMUM_TOPIC_NAME_LENGTH) {
+            return false;
+        }
+        strcpy(topic_name, _entry_spool.topic_name);
+        memcpy(data, &_entry_spool.msg, _entry_spool.msg_length);
+        *data_len = _entry_spool.msg_length;
+        *qos = _entry_spool.qos;
+        *retain = _entry_spool.retain;
+        return true;
+    }
+
+    virtual void remove_next_spool_publish() {
+        load_spool();
+        if (_spool_header.count == 0) {
+            return;
+        }
+        _spool_header.head = (uint16_t) ((_spool_header.head + 1) % _spool_capacity);
+        _spool_header.count--;
+        if (_spool_header.count == 0) {
+            _spool_header.head = 0;
+        }
+        save_spool_header();
+    }
+
+    virtual uint16_t get_spool_count() {
+        load_spool();
+        return _spool_header.count;
+    }
+
+    virtual uint16_t get_spool_capacity() {
+        load_spool();
+        return _spool_capacity;
+    }
+
+private:
+
+    void load_spool() {
+        if (_spool_loaded) {
+            return;
+        }
+        _spool_loaded = true;
+
+        // configuration
+        _open_file.close();
+        _open_file = SD.open(mqtt_configuration, FILE_READ);
+        const char *s_size = "spoolsize";
+        const char *s_drop = "spooldrop";
+        char buffer[128];
+        memset(&buffer, 0, sizeof(buffer));
+        while (readLine((char *) &buffer, sizeof(buffer)) > 0) {
+            uint16_t line_length = (uint16_t) (strlen(buffer) + 1);
+            if (memcmp(&buffer, s_size, strlen(s_size)) == 0) {
+                uint16_t spool_capacity = 0;
+                if (parse_uint16_t_after_space(&spool_capacity, buffer, line_length)) {
+                    _spool_capacity = spool_capacity;
+                }
+            } else if (memcmp(&buffer, s_drop, strlen(s_drop)) == 0) {
+                _spool_drop_oldest = strstr(buffer, "oldest") != nullptr;
+            }
+            memset(&buffer, 0, sizeof(buffer));
+        }
+        _open_file.close();
+
+        // header
+        memset(&_spool_header, 0, sizeof(entry_spool_header));
+        _open_file = SD.open(mqtt_spool, FILE_READ);
+        int readChars = _open_file.read((char *) &_spool_header, sizeof(entry_spool_header));
+        _open_file.close();
+        if (readChars != sizeof(entry_spool_header) || _spool_capacity == 0 ||
+            _spool_header.count > _spool_capacity || _spool_header.head >= _spool_capacity) {
+            // new, corrupt or written with another capacity
+            memset(&_spool_header, 0, sizeof(entry_spool_header));
+            save_spool_header();
+        }
+#if PERSISTENT_DEBUG
+        char uint16_buf[6];
+        logger->start_log("spool loaded - capacity ", 2);
+        sprintf(uint16_buf, "%d", _spool_capacity);
+        logger->append_log(uint16_buf);
+        logger->append_log(" count ");
+        sprintf(uint16_buf, "%d", _spool_header.count);
+        logger->append_log(uint16_buf);
+#endif
+    }
+
+    void save_spool_header() {
+        _open_file.close();
+        _open_file = SD.open(mqtt_spool, FILE_WRITE);
+        _open_file.seek(0);
+        _open_file.write((const char *) &_spool_header, sizeof(entry_spool_header));
+        _open_file.close();
+    }
+
+public:
+
     virtual uint16_t get_advertise_duration() {
-        return 900;
+        _open_file.close();
+        _open_file = SD.open(mqtt_configuration, FILE_READ);
+
+        const char *a_duration = "advertiseduration";
+        uint16_t advertise_duration = 0;
+        bool has_a_duration = false;
+        char buffer[128];
+        memset(&buffer, 0, sizeof(buffer));
+        while (readLine((char *) &buffer, sizeof(buffer)) > 0) {
+            uint16_t line_length = (uint16_t) (strlen(buffer) + 1);
+            if (memcmp(&buffer, a_duration, strlen(a_duration)) == 0) {
+                has_a_duration = parse_uint16_t_after_space(&advertise_duration, buffer, line_length);
+            }
+            memset(&buffer, 0, sizeof(buffer));
+        }
+        _open_file.close();
+        if (!has_a_duration || advertise_duration == 0) {
+            return T_ADV;
+        }
+        return advertise_duration;
+    }
+
+    virtual uint16_t get_subscription_aggregation_threshold() {
+        _open_file.close();
+        _open_file = SD.open(mqtt_configuration, FILE_READ);
+
+        const char *s_aggregate = "subscribeaggregate";
+        uint16_t threshold = 0;
+        char buffer[128];
+        memset(&buffer, 0, sizeof(buffer));
+        while (readLine((char *) &buffer, sizeof(buffer)) > 0) {
+            uint16_t line_length = (uint16_t) (strlen(buffer) + 1);
+            if (memcmp(&buffer, s_aggregate, strlen(s_aggregate)) == 0) {
+                if (!parse_uint16_t_after_space(&threshold, buffer, line_length)) {
+                    threshold = 0;
+                }
+            }
+            memset(&buffer, 0, sizeof(buffer));
+        }
+        _open_file.close();
+        return threshold;
     }
 
     virtual bool get_gateway_id(uint8_t *gateway_id) {
-        return 2;
+#if PERSISTENT_DEBUG
+        logger->log("loading gateway id", 2);
+#endif
+        _open_file.close();
+        _open_file = SD.open(mqtt_configuration, FILE_READ);
+
+        const char *g_id = "gatewayid";
+        bool has_g_id = false;
+        char buffer[128];
+        memset(&buffer, 0, sizeof(buffer));
+        while (readLine((char *) &buffer, sizeof(buffer)) > 0) {
+            uint16_t line_length = (uint16_t) (strlen(buffer) + 1);
+            if (memcmp(&buffer, g_id, strlen(g_id)) == 0) {
+                has_g_id = parse_uint8_t_after_space(gateway_id, buffer, line_length);
+            }
+            memset(&buffer, 0, sizeof(buffer));
+        }
+        _open_file.close();
+#if PERSISTENT_DEBUG
+        if (!has_g_id) {
+            logger->log("Mqtt configuration incomplete missing: gatewayid", 2);
+        }
+#endif
+        return has_g_id;
     }
 
 
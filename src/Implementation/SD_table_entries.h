@@ -7,6 +7,7 @@
 
 #include <cstring>
 #include <cstdio>
+#include <cstddef>
 #include "../global_defines.h"
 #include "../mqttsn_messages.h"
 #include "../core_defines.h"
@@ -37,16 +38,37 @@ struct entry_registration{
     bool known;
 };
 
-struct entry_publish{
+struct entry_message{
     uint8_t msg[255];
     uint8_t msg_length;
+    uint16_t reference_count; // number of publishes referencing the message, 0 if the entry is free
+};
+
+struct entry_publish{
+    uint16_t message_id; // entry number + 1 of the payload in the shared message store
+    uint8_t msg_length;
     uint16_t topic_id;
+    bool predefined_topic; // topic_id is a predefined topic id, no registration needed
     uint8_t qos;
     bool retain;
     bool dup;
     uint16_t msg_id;
     uint16_t publish_id;
-    uint32_t retransmition_timeout; // not used atm
+    uint32_t retransmition_timeout; // timestamp of the next retransmission, 0 if none is scheduled
+    uint32_t created; // timestamp the publish was queued, for eviction and expiry
+};
+
+struct entry_spool_header{
+    uint16_t head; // entry number of the oldest spooled publish
+    uint16_t count;
+};
+
+struct entry_spool{
+    char topic_name[255];
+    uint8_t msg[255];
+    uint8_t msg_length;
+    uint8_t qos;
+    bool retain;
 };
 
 //TODO remove pragma and test
@@ -60,7 +82,43 @@ struct entry_client {
     uint32_t timeout;
     uint16_t await_message_id;
     message_type await_message;
+    uint16_t queued_publish_count; // kept up to date with the .PUB file, so the depth needs no scan
+    uint32_t queued_publish_bytes;
 };
 #pragma pack(pop)
 
+struct entry_store_version{
+    uint16_t version;
+};
+
+// layouts of format version 1, only read to convert the files of an older gateway
+
+struct entry_publish_v1{
+    uint8_t msg[255];
+    uint8_t msg_length;
+    uint16_t topic_id;
+    uint8_t qos;
+    bool retain;
+    bool dup;
+    uint16_t msg_id;
+    uint16_t publish_id;
+    uint32_t retransmition_timeout;
+};
+
+#pragma pack(push, 1)
+struct entry_client_v1 {
+    char client_id[24];
+    char file_number[9];
+    device_address client_address;
+    CLIENT_STATUS client_status;
+    uint32_t duration;
+    uint32_t timeout;
+    uint16_t await_message_id;
+    message_type await_message;
+};
+#pragma pack(pop)
+
+static_assert(offsetof(entry_client, queued_publish_count) == sizeof(entry_client_v1),
+              "entry_client only appends to the layout of format version 1");
+
 #endif //GATEWAY_SD_TABLE_ENTRIES_H
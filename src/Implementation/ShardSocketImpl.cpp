@@ -0,0 +1,138 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "ShardSocketImpl.h"
+
+void ShardSocketImpl::setSocket(int s, device_address *own_address, device_address *broadcast_address) {
+    this->s = s;
+    if (event_fd < 0) {
+        event_fd = eventfd(0, EFD_NONBLOCK);
+    }
+    memcpy(&this->own_address, own_address, sizeof(device_address));
+    memcpy(&this->broadcast_address, broadcast_address, sizeof(device_address));
+}
+
+bool ShardSocketImpl::enqueue(device_address *address, uint8_t *bytes, uint16_t bytes_len) {
+    if (bytes_len > BUFLEN) {
+        inbound.reject();
+        return false;
+    }
+    udp_datagram *slot = inbound.acquire_slot();
+    if (slot == nullptr) {
+        inbound.reject();
+        return false;
+    }
+    // the message parser relies on zero terminated strings, so clear the slot first
+    memset(slot, 0, sizeof(udp_datagram));
+    memcpy(&slot->address, address, sizeof(device_address));
+    memcpy(&slot->bytes, bytes, bytes_len);
+    slot->length = bytes_len;
+    inbound.commit_slot();
+    uint64_t increment = 1;
+    if (write(event_fd, &increment, sizeof(increment)) == -1) {
+        // the counter is already signaled
+    }
+    return true;
+}
+
+uint32_t ShardSocketImpl::get_dropped_count() {
+    return inbound.get_rejected_count();
+}
+
+uint32_t ShardSocketImpl::get_queue_high_water_mark() {
+    return inbound.get_high_water_mark();
+}
+
+bool ShardSocketImpl::begin() {
+    if (mqttsn == nullptr || s < 0 || event_fd < 0) {
+        return false;
+    }
+    mqttsn->notify_socket_connected();
+    return true;
+}
+
+void ShardSocketImpl::setMqttSnMessageHandler(MqttSnMessageHandler *mqttSnMessageHandler) {
+    this->mqttsn = mqttSnMessageHandler;
+}
+
+void ShardSocketImpl::setLogger(LoggerInterface *logger) {
+    this->logger = logger;
+}
+
+device_address *ShardSocketImpl::getBroadcastAddress() {
+    return &broadcast_address;
+}
+
+device_address *ShardSocketImpl::getAddress() {
+    return &own_address;
+}
+
+uint8_t ShardSocketImpl::getMaximumMessageLength() {
+    if (BUFLEN > UINT8_MAX) {
+        return UINT8_MAX;
+    }
+    return (uint8_t) BUFLEN;
+}
+
+bool ShardSocketImpl::send(device_address *destination, uint8_t *bytes, uint16_t bytes_len) {
+    return send(destination, bytes, bytes_len, nullptr, 0);
+}
+
+bool ShardSocketImpl::send(device_address *destination, uint8_t *bytes, uint16_t bytes_len, uint8_t signal_strength) {
+    return send(destination, bytes, bytes_len);
+}
+
+bool ShardSocketImpl::send(device_address *destination, uint8_t *header, uint16_t header_len, const uint8_t *payload,
+                           uint16_t payload_len) {
+    // all shards send on the same socket, so the destination must not be a member
+    struct sockaddr_in si_other;
+    memset(&si_other, 0, sizeof(si_other));
+    si_other.sin_family = AF_INET;
+    memcpy(&si_other.sin_addr.s_addr, &destination->bytes, sizeof(uint32_t));
+    memcpy(&si_other.sin_port, &destination->bytes[sizeof(uint32_t)], sizeof(uint16_t));
+    struct iovec parts[2];
+    parts[0].iov_base = header;
+    parts[0].iov_len = header_len;
+    parts[1].iov_base = (void *) payload;
+    parts[1].iov_len = payload_len;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &si_other;
+    message.msg_namelen = sizeof(si_other);
+    message.msg_iov = parts;
+    message.msg_iovlen = payload_len > 0 ? 2 : 1;
+    if (sendmsg(s, &message, 0) == -1) {
+        // we ignore it
+    }
+    return s >= 0;
+}
+
+bool ShardSocketImpl::loop() {
+    if (inbound.size() == 0) {
+        struct pollfd event;
+        event.fd = event_fd;
+        event.events = POLLIN;
+        event.revents = 0;
+        poll(&event, 1, SHARD_RECEIVE_TIMEOUT_MS);
+    }
+    // reset before dequeuing, a datagram enqueued meanwhile signals again
+    uint64_t signaled;
+    if (read(event_fd, &signaled, sizeof(signaled)) == -1) {
+        // not signaled
+    }
+    // handle at most the datagrams queued so far, so the core loop is not starved
+    uint32_t queued = inbound.size();
+    for (uint32_t i = 0; i < queued; i++) {
+        udp_datagram *datagram = inbound.front();
+        if (datagram == nullptr) {
+            break;
+        }
+        mqttsn->receiveData(&datagram->address, (uint8_t *) &datagram->bytes);
+        inbound.release_slot();
+    }
+    return s >= 0;
+}
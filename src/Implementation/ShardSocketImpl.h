@@ -0,0 +1,80 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_SHARDSOCKETIMPL_H
+#define GATEWAY_SHARDSOCKETIMPL_H
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../SocketInterface.h"
+#include "UdpSocketImpl.h"
+
+#define SHARD_QUEUE_SIZE 64 // datagrams buffered per shard, must be a power of two
+#define SHARD_RECEIVE_TIMEOUT_MS 300 // loop waits this long for a datagram, like the receive timeout of the UdpSocketImpl
+
+/**
+ * SocketInterface of a single shard of the ShardedGateway.
+ * The router thread receives all datagrams on the shared UDP socket and enqueues them to the owning shard.
+ * The shard thread dequeues them in loop and sends its replies directly on the shared UDP socket.
+ * An eventfd signals the enqueued datagrams, so loop blocks on it while the queue is empty instead of spinning.
+ */
+class ShardSocketImpl : public SocketInterface {
+private:
+    int s = -1;
+    int event_fd = -1;
+    MqttSnMessageHandler *mqttsn = nullptr;
+    LoggerInterface *logger = nullptr;
+    device_address own_address;
+    device_address broadcast_address;
+    SpscRingBuffer<udp_datagram, SHARD_QUEUE_SIZE> inbound;
+
+public:
+    /**
+     * Sets the shared UDP socket, it is not closed by the shard.
+     * @param s file descriptor of the bound UDP socket
+     * @param own_address of the UDP socket
+     * @param broadcast_address of the UDP socket
+     */
+    void setSocket(int s, device_address *own_address, device_address *broadcast_address);
+
+    /**
+     * Router thread only: hands a received datagram over to the shard thread and wakes it up.
+     * @return false if the queue of the shard is full and the datagram is dropped
+     */
+    bool enqueue(device_address *address, uint8_t *bytes, uint16_t bytes_len);
+
+    /**
+     * @return number of datagrams dropped because the queue of the shard was full
+     */
+    uint32_t get_dropped_count();
+
+    /**
+     * @return highest number of datagrams queued for the shard at the same time
+     */
+    uint32_t get_queue_high_water_mark();
+
+    bool begin() override;
+
+    void setMqttSnMessageHandler(MqttSnMessageHandler *mqttSnMessageHandler) override;
+
+    void setLogger(LoggerInterface *logger) override;
+
+    device_address *getBroadcastAddress() override;
+
+    device_address *getAddress() override;
+
+    uint8_t getMaximumMessageLength() override;
+
+    bool send(device_address *destination, uint8_t *bytes, uint16_t bytes_len) override;
+
+    bool send(device_address *destination, uint8_t *bytes, uint16_t bytes_len, uint8_t signal_strength) override;
+
+    bool send(device_address *destination, uint8_t *header, uint16_t header_len, const uint8_t *payload,
+              uint16_t payload_len) override;
+
+    bool loop() override;
+};
+
+
+#endif //GATEWAY_SHARDSOCKETIMPL_H
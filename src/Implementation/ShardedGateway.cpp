@@ -0,0 +1,135 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <fstream>
+#include <sys/stat.h>
+#include "ShardedGateway.h"
+
+void ShardedGateway::setLogger(LoggerInterface *logger) {
+    this->logger = logger;
+}
+
+bool ShardedGateway::begin(const char *root_path, uint8_t shard_count) {
+    if (logger == nullptr || shard_count == 0 || shard_count > SHARDED_GATEWAY_MAXIMUM_SHARDS) {
+        return false;
+    }
+    if (!begin_socket()) {
+        logger->log("Error starting sharded gateway: cannot bind socket", 0);
+        return false;
+    }
+    this->shard_count = shard_count;
+
+    for (uint8_t i = 0; i < shard_count; i++) {
+        gateway_shard &shard = shards[i];
+        sprintf(shard.client_id_suffix, "%d", i);
+        shard.root_path = std::string(root_path) + "/SHARD" + shard.client_id_suffix;
+        mkdir(shard.root_path.c_str(), 0755);
+        if (!copy_file(std::string(root_path) + "/MQTT.CON", shard.root_path + "/MQTT.CON")) {
+            logger->log("Error starting sharded gateway: cannot copy MQTT.CON", 0);
+            return false;
+        }
+        // predefined topics are optional
+        copy_file(std::string(root_path) + "/TOPICS.PRE", shard.root_path + "/TOPICS.PRE");
+
+        shard.persistent.setRootPath((char *) shard.root_path.c_str());
+        shard.mqtt.setClientIdSuffix(shard.client_id_suffix);
+        shard.socket.setSocket(udp.s, udp.getAddress(), udp.getBroadcastAddress());
+
+        shard.gateway.setLoggerInterface(&shard.logger);
+        shard.gateway.setSocketInterface(&shard.socket);
+        shard.gateway.setMqttInterface(&shard.mqtt);
+        shard.gateway.setPersistentInterface(&shard.persistent);
+        shard.gateway.setSystemInterface(&shard.system);
+        // all shards share the same socket, only one of them advertises the gateway
+        shard.gateway.coreInterface.set_advertising(i == 0);
+
+        shard.thread = std::thread(run_shard, &shard);
+    }
+
+    char uint8_buf[5];
+    sprintf(uint8_buf, "%d", shard_count);
+    logger->start_log("Sharded gateway ready with ", 1);
+    logger->append_log(uint8_buf);
+    logger->append_log(" shards");
+    return true;
+}
+
+bool ShardedGateway::loop() {
+    if (udp.s < 0) {
+        return false;
+    }
+    struct sockaddr_in si_other;
+    socklen_t slen = sizeof(si_other);
+    ssize_t recv_len = recvfrom(udp.s, buffer, BUFLEN, 0, (struct sockaddr *) &si_other, &slen);
+    if (recv_len <= 0 || recv_len > UINT8_MAX) {
+        return true;
+    }
+    device_address address = udp.getDevice_address(&si_other);
+    shards[get_shard(&address)].socket.enqueue(&address, buffer, (uint16_t) recv_len);
+    return true;
+}
+
+uint8_t ShardedGateway::get_shard(device_address *address) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < sizeof(device_address); i++) {
+        hash ^= address->bytes[i];
+        hash *= 16777619u;
+    }
+    return (uint8_t) (hash % shard_count);
+}
+
+bool ShardedGateway::begin_socket() {
+    // same socket options as the UdpSocketImpl, the router only receives
+    if ((udp.s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+        return false;
+    }
+    memset((char *) &udp.si_me, 0, sizeof(udp.si_me));
+    udp.si_me.sin_family = AF_INET;
+    udp.si_me.sin_port = htons(PORT);
+    udp.si_me.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(udp.s, (struct sockaddr *) &udp.si_me, sizeof(udp.si_me)) == -1) {
+        return false;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = 0;  // 0 Secs Timeout
+    tv.tv_usec = 300000;  // 300 ms Timeout
+    if (setsockopt(udp.s, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(struct timeval)) == -1) {
+        return false;
+    }
+
+    int broadcastEnable = 1;
+    if (setsockopt(udp.s, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) == -1) {
+        return false;
+    }
+    return true;
+}
+
+bool ShardedGateway::copy_file(const std::string &source, const std::string &destination) {
+    std::ifstream source_file(source, std::ios::binary);
+    if (!source_file.is_open()) {
+        return false;
+    }
+    std::ofstream destination_file(destination, std::ios::binary | std::ios::trunc);
+    if (!destination_file.is_open()) {
+        return false;
+    }
+    destination_file << source_file.rdbuf();
+    return true;
+}
+
+void ShardedGateway::run_shard(gateway_shard *shard) {
+    while (!shard->gateway.begin()) {
+        shard->logger.log("Error starting gateway shard components", 0);
+        shard->system.sleep(5000);
+        shard->system.exit();
+    }
+    shard->logger.start_log("Gateway shard ", 1);
+    shard->logger.append_log(shard->client_id_suffix);
+    shard->logger.append_log(" ready");
+    while (true) {
+        shard->gateway.loop();
+    }
+}
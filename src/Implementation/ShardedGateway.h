@@ -0,0 +1,90 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_SHARDEDGATEWAY_H
+#define GATEWAY_SHARDEDGATEWAY_H
+
+#include <string>
+#include <thread>
+#include <paho/PahoMqttMessageHandler.h>
+#include "../Gateway.h"
+#include "SDPersistentImpl.h"
+#include "ArduinoLogger.h"
+#include "ArduinoSystem.h"
+#include "UdpSocketImpl.h"
+#include "ShardSocketImpl.h"
+
+#define SHARDED_GATEWAY_MAXIMUM_SHARDS 16
+
+/**
+ * A complete gateway owning a part of the clients, running in its own thread.
+ */
+struct gateway_shard {
+    Gateway gateway;
+    SDPersistentImpl persistent;
+    PahoMqttMessageHandler mqtt;
+    ArduinoLogger logger;
+    ArduinoSystem system;
+    ShardSocketImpl socket;
+    std::thread thread;
+    std::string root_path;
+    char client_id_suffix[4];
+};
+
+/**
+ * Linux only execution mode spreading the clients over several threads.
+ * Clients are partitioned by a hash of their device_address. Each shard owns the state of its clients:
+ * persistence in a sub directory of the root path, publish queues and its own connection to the broker,
+ * with the shard number appended to the client id. So broker publishes arrive directly at the shard
+ * having subscribers for them.
+ * The router (the thread calling loop) receives the datagrams on the single UDP socket and dispatches them
+ * to the owning shard through a lock-free queue. Replies are send by the shards on the same socket.
+ *
+ * Usage:
+ *  ShardedGateway gateway;
+ *  gateway.setLogger(&logger);
+ *  gateway.begin("/path/to/DB", 4);
+ *  while (true) { gateway.loop(); }
+ */
+class ShardedGateway {
+private:
+    gateway_shard shards[SHARDED_GATEWAY_MAXIMUM_SHARDS];
+    uint8_t shard_count = 0;
+    UdpSocketImpl udp;
+    LoggerInterface *logger = nullptr;
+    uint8_t buffer[BUFLEN];
+
+public:
+    void setLogger(LoggerInterface *logger);
+
+    /**
+     * Opens the UDP socket and starts the shard threads.
+     * The configuration files (MQTT.CON, TOPICS.PRE) are copied from the root path into the directory of each shard.
+     * @param root_path database directory containing the configuration files
+     * @param shard_count number of shards, between 1 and SHARDED_GATEWAY_MAXIMUM_SHARDS
+     * @return true if the socket is bound and all shards are started
+     */
+    bool begin(const char *root_path, uint8_t shard_count);
+
+    /**
+     * Receives a single datagram and dispatches it to the owning shard.
+     * @return false if the socket is broken
+     */
+    bool loop();
+
+    /**
+     * @return the number of the shard owning the client with the given address
+     */
+    uint8_t get_shard(device_address *address);
+
+private:
+    bool begin_socket();
+
+    bool copy_file(const std::string &source, const std::string &destination);
+
+    static void run_shard(gateway_shard *shard);
+};
+
+
+#endif //GATEWAY_SHARDEDGATEWAY_H
@@ -0,0 +1,139 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_SPSCRINGBUFFER_H
+#define GATEWAY_SPSCRINGBUFFER_H
+
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * Bounded lock-free ring buffer for exactly one producer thread and one consumer thread.
+ * All slots are allocated with the ring buffer, nothing is allocated while running.
+ * The producer fills a slot in place (acquire_slot, then commit_slot) or copies with push,
+ * the consumer reads a slot in place (front, then release_slot) or copies with pop.
+ * For backpressure monitoring the ring buffer counts the rejected items and the highest fill level seen.
+ * A producer using acquire_slot has to call reject itself if it drops an item because no slot is free.
+ * @tparam T type of a slot, must be trivially copyable
+ * @tparam CAPACITY number of slots, must be a power of two
+ */
+template<typename T, uint32_t CAPACITY>
+class SpscRingBuffer {
+    static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+private:
+    T slots[CAPACITY];
+    std::atomic<uint32_t> head{0}; // next slot to read, written by the consumer
+    std::atomic<uint32_t> tail{0}; // next slot to write, written by the producer
+    std::atomic<uint32_t> rejected_count{0}; // written by the producer
+    std::atomic<uint32_t> high_water_mark{0}; // written by the producer
+
+public:
+
+    /**
+     * Producer: gets the next free slot without publishing it.
+     * @return the free slot or nullptr if the ring buffer is full
+     */
+    T *acquire_slot() {
+        uint32_t current_tail = tail.load(std::memory_order_relaxed);
+        if (current_tail - head.load(std::memory_order_acquire) >= CAPACITY) {
+            return nullptr;
+        }
+        return &slots[current_tail & (CAPACITY - 1)];
+    }
+
+    /**
+     * Producer: publishes the slot returned by acquire_slot to the consumer.
+     */
+    void commit_slot() {
+        uint32_t new_tail = tail.load(std::memory_order_relaxed) + 1;
+        tail.store(new_tail, std::memory_order_release);
+        uint32_t used = new_tail - head.load(std::memory_order_acquire);
+        if (used > high_water_mark.load(std::memory_order_relaxed)) {
+            high_water_mark.store(used, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Producer: counts a dropped item, e.g. because acquire_slot returned no slot or the item is too large.
+     */
+    void reject() {
+        rejected_count.store(rejected_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Producer: copies the item into the next free slot.
+     * @return false if the ring buffer is full
+     */
+    bool push(const T &item) {
+        T *slot = acquire_slot();
+        if (slot == nullptr) {
+            reject();
+            return false;
+        }
+        *slot = item;
+        commit_slot();
+        return true;
+    }
+
+    /**
+     * Consumer: gets the oldest slot without removing it.
+     * @return the oldest slot or nullptr if the ring buffer is empty
+     */
+    T *front() {
+        uint32_t current_head = head.load(std::memory_order_relaxed);
+        if (current_head == tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &slots[current_head & (CAPACITY - 1)];
+    }
+
+    /**
+     * Consumer: hands the slot returned by front back to the producer.
+     */
+    void release_slot() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /**
+     * Consumer: copies the oldest item out of the ring buffer.
+     * @return false if the ring buffer is empty
+     */
+    bool pop(T &item) {
+        T *slot = front();
+        if (slot == nullptr) {
+            return false;
+        }
+        item = *slot;
+        release_slot();
+        return true;
+    }
+
+    /**
+     * @return the number of used slots, only a snapshot if called concurrently
+     */
+    uint32_t size() {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    uint32_t capacity() {
+        return CAPACITY;
+    }
+
+    /**
+     * @return the number of items rejected by the producer side, mostly because the ring buffer was full
+     */
+    uint32_t get_rejected_count() {
+        return rejected_count.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return the highest number of used slots seen so far, near the capacity means the consumer is too slow
+     */
+    uint32_t get_high_water_mark() {
+        return high_water_mark.load(std::memory_order_relaxed);
+    }
+};
+
+
+#endif //GATEWAY_SPSCRINGBUFFER_H
@@ -9,7 +9,8 @@ bool UdpSocketImpl::begin() {
     }
 
     //create a UDP socket
-    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    int socket_fd;
+    if ((socket_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
         return false;
     }
 
@@ -21,7 +22,8 @@ bool UdpSocketImpl::begin() {
     si_me.sin_addr.s_addr = htonl(INADDR_ANY);
 
     //bind socket to port
-    if (bind(s, (struct sockaddr *) &si_me, sizeof(si_me)) == -1) {
+    if (bind(socket_fd, (struct sockaddr *) &si_me, sizeof(si_me)) == -1) {
+        close(socket_fd);
         return false;
     }
 
@@ -33,18 +35,90 @@ bool UdpSocketImpl::begin() {
     tv.tv_usec = 300000;  // 300 ms Timeout
 
 
-    if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(struct timeval)) == -1) {
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv, sizeof(struct timeval)) == -1) {
+        close(socket_fd);
         return false;
     }
 
     // enable broadcast
     int broadcastEnable = 1;
-    if (setsockopt(s, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) == -1) {
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable)) == -1) {
+        close(socket_fd);
         return false;
     }
+    // the ingress thread only sees the socket once it is ready
+    s = socket_fd;
     if (s >= 0) {
         mqttsn->notify_socket_connected();
     }
+    if (s >= 0 && ingress_thread_enabled && !ingress_thread_started.exchange(true)) {
+        std::thread(run_ingress_thread, this).detach();
+    }
+    return s >= 0;
+}
+
+void UdpSocketImpl::setIngressThread(bool enabled) {
+    this->ingress_thread_enabled = enabled;
+}
+
+uint32_t UdpSocketImpl::get_ingress_dropped_count() {
+    return ingress.get_rejected_count();
+}
+
+uint32_t UdpSocketImpl::get_ingress_high_water_mark() {
+    return ingress.get_high_water_mark();
+}
+
+void UdpSocketImpl::run_ingress_thread(UdpSocketImpl *udpSocket) {
+    while (true) {
+        udpSocket->receive_ingress();
+    }
+}
+
+void UdpSocketImpl::receive_ingress() {
+    int socket = s;
+    if (socket < 0) {
+        // loop reconnects the socket
+        usleep(10000);
+        return;
+    }
+    struct sockaddr_in si_ingress;
+    socklen_t slen_ingress = sizeof(si_ingress);
+    udp_datagram *slot = ingress.acquire_slot();
+    if (slot == nullptr) {
+        // queue is full: keep on receiving to empty the kernel buffer, but drop the datagram
+        uint8_t drop_buffer[BUFLEN];
+        if (recvfrom(socket, drop_buffer, BUFLEN, 0, (struct sockaddr *) &si_ingress, &slen_ingress) != -1) {
+            ingress.reject();
+        }
+        return;
+    }
+    // the message parser relies on zero terminated strings, so clear the slot first
+    memset(slot, 0, sizeof(udp_datagram));
+    ssize_t ingress_len = recvfrom(socket, slot->bytes, BUFLEN, 0, (struct sockaddr *) &si_ingress, &slen_ingress);
+    if (ingress_len <= 0 || ingress_len > UINT8_MAX) {
+        return;
+    }
+    slot->address = getDevice_address(&si_ingress);
+    slot->length = (uint16_t) ingress_len;
+    ingress.commit_slot();
+}
+
+bool UdpSocketImpl::loop_ingress() {
+    // handle at most the datagrams queued so far, so the core loop is not starved
+    uint32_t queued = ingress.size();
+    for (uint32_t i = 0; i < queued; i++) {
+        udp_datagram *datagram = ingress.front();
+        if (datagram == nullptr) {
+            break;
+        }
+        mqttsn->receiveData(&datagram->address, (uint8_t *) &datagram->bytes);
+        ingress.release_slot();
+    }
+    if (queued == 0) {
+        // nothing to do, do not spin
+        usleep(1000);
+    }
     return s >= 0;
 }
 
@@ -58,7 +132,7 @@ device_address *UdpSocketImpl::getBroadcastAddress() {
         return &broadcast_address;
     }
     uint32_t broadcast_ip_address = INADDR_BROADCAST;
-    uint16_t broadcast_port = PORT;
+    uint16_t broadcast_port = htons(PORT);
     memcpy(&broadcast_address.bytes, &broadcast_ip_address, sizeof(broadcast_ip_address));
     memcpy(&broadcast_address.bytes[sizeof(broadcast_ip_address)], &broadcast_port, sizeof(broadcast_port));
     return &broadcast_address;
@@ -173,6 +247,27 @@ bool UdpSocketImpl::send(device_address *destination, uint8_t *bytes, uint16_t b
     return send(destination, bytes, bytes_len);
 }
 
+bool UdpSocketImpl::send(device_address *destination, uint8_t *header, uint16_t header_len, const uint8_t *payload,
+                         uint16_t payload_len) {
+    si_other.sin_addr.s_addr = getIp_address(destination);
+    si_other.sin_port = getPort(destination);
+    struct iovec parts[2];
+    parts[0].iov_base = header;
+    parts[0].iov_len = header_len;
+    parts[1].iov_base = (void *) payload;
+    parts[1].iov_len = payload_len;
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &si_other;
+    message.msg_namelen = slen;
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    if (sendmsg(s, &message, 0) == -1) {
+        // we ignore it
+    }
+    return s >= 0;
+}
+
 bool UdpSocketImpl::loop() {
     if (s < 0) {
         // socket disconnected
@@ -183,6 +278,9 @@ bool UdpSocketImpl::loop() {
         }
         return false;
     }
+    if (ingress_thread_enabled) {
+        return loop_ingress();
+    }
     //listening for data for 300 ms
     //printf("Waiting for data...");
     memset(&buf, 0, BUFLEN);
@@ -200,6 +298,24 @@ bool UdpSocketImpl::loop() {
     return s >= 0;
 }
 
+bool UdpSocketImpl::receive_available() {
+    if (s < 0) {
+        return false;
+    }
+    // bounded, so a flood of datagrams does not starve the broker connection
+    for (uint16_t i = 0; i < UDP_MAXIMUM_RECEIVE_BATCH; i++) {
+        memset(&buf, 0, BUFLEN);
+        if ((recv_len = recvfrom(s, buf, BUFLEN, MSG_DONTWAIT, (struct sockaddr *) &si_other, &slen)) == -1) {
+            break;
+        }
+        if (recv_len <= UINT8_MAX) {
+            device_address client_address = getDevice_address(&si_other);
+            mqttsn->receiveData(&client_address, (uint8_t *) &buf);
+        }
+    }
+    return true;
+}
+
 device_address UdpSocketImpl::getDevice_address(sockaddr_in *addr) const {
     device_address address;
     memset(&address, 0, sizeof(address));
@@ -230,6 +346,8 @@ uint16_t UdpSocketImpl::getPort(device_address *address) const {
 }
 
 void UdpSocketImpl::disconnect() {
-    close(s);
-    s = -1;
+    int socket_fd = s.exchange(-1);
+    if (socket_fd >= 0) {
+        close(socket_fd);
+    }
 }
@@ -14,10 +14,21 @@
 #include <sys/ioctl.h>
 #include <netdb.h>
 #include <ifaddrs.h>
+#include <atomic>
+#include <thread>
 #include "../SocketInterface.h"
+#include "SpscRingBuffer.h"
 
 #define BUFLEN 255	//Max length of buffer
 #define PORT 8888	//The port on which to listen for incoming data
+#define UDP_INGRESS_QUEUE_SIZE 64 // datagrams buffered by the ingress thread, must be a power of two
+#define UDP_MAXIMUM_RECEIVE_BATCH 64 // datagrams handled by receive_available at once
+
+struct udp_datagram {
+    device_address address;
+    uint16_t length;
+    uint8_t bytes[BUFLEN];
+};
 
 /**
  * This is a example implementation for the SocketInterface based on Linux UDP Sockets.
@@ -27,7 +38,9 @@ class UdpSocketImpl : public SocketInterface{
 public:
     struct sockaddr_in si_me, si_other;
 
-    int s, i, recv_len;
+    // read by the ingress thread, set by begin only after the socket is bound and configured
+    std::atomic<int> s{-1};
+    int i, recv_len;
     socklen_t slen = sizeof(si_other);
     char buf[BUFLEN];
 
@@ -36,9 +49,32 @@ public:
     device_address broadcast_address;
 
     LoggerInterface *logger;
+
+private:
+    bool ingress_thread_enabled = false;
+    std::atomic<bool> ingress_thread_started{false};
+    SpscRingBuffer<udp_datagram, UDP_INGRESS_QUEUE_SIZE> ingress;
 public:
     bool begin();
 
+    /**
+     * Receives the datagrams in a separate thread, call it before begin.
+     * The ingress thread empties the kernel buffer into a bounded queue, so a slow core (e.g. a slow SD write)
+     * does not let the kernel drop datagrams. loop then hands the queued datagrams to the MqttSnMessageHandler.
+     * @param enabled true for a separate ingress thread, false to receive in loop (default)
+     */
+    void setIngressThread(bool enabled);
+
+    /**
+     * @return number of datagrams dropped by the ingress thread because the queue was full
+     */
+    uint32_t get_ingress_dropped_count();
+
+    /**
+     * @return highest number of datagrams queued by the ingress thread at the same time
+     */
+    uint32_t get_ingress_high_water_mark();
+
     void setMqttSnMessageHandler(MqttSnMessageHandler *mqttSnMessageHandler) override;
 
     void setLogger(LoggerInterface *logger) override;
@@ -53,8 +89,17 @@ public:
 
     bool send(device_address *destination, uint8_t *bytes, uint16_t bytes_len, uint8_t signal_strength) override;
 
+    bool send(device_address *destination, uint8_t *header, uint16_t header_len, const uint8_t *payload,
+              uint16_t payload_len) override;
+
     bool loop() override;
 
+    /**
+     * Handles the datagrams already received without waiting, for event loops like the EpollReactor.
+     * @return false if the socket is disconnected
+     */
+    bool receive_available();
+
     device_address getDevice_address(sockaddr_in *addr) const;
 
     uint32_t getIp_address(device_address *address) const;
@@ -63,6 +108,12 @@ public:
 
     void disconnect();
 
+private:
+    static void run_ingress_thread(UdpSocketImpl *udpSocket);
+
+    void receive_ingress();
+
+    bool loop_ingress();
 
 };
 
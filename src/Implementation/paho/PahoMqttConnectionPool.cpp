@@ -0,0 +1,234 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include "PahoMqttConnectionPool.h"
+
+void PooledPahoConnection::notify_connected() {
+    connected = true;
+    resubscribe_pending = true;
+}
+
+void PooledPahoConnection::notify_disconnected() {
+    connected = false;
+}
+
+bool PahoMqttConnectionPool::setConnectionCount(uint8_t count) {
+    if (count == 0 || count > BROKER_POOL_MAXIMUM_CONNECTIONS) {
+        return false;
+    }
+    this->connection_count = count;
+    return true;
+}
+
+uint8_t PahoMqttConnectionPool::get_connection(const char *topic) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = topic; *c != '\0'; c++) {
+        hash ^= (uint8_t) *c;
+        hash *= 16777619u;
+    }
+    return (uint8_t) (hash % connection_count);
+}
+
+bool PahoMqttConnectionPool::begin() {
+    uint16_t packet_id_span = (uint16_t) (UINT16_MAX / connection_count);
+    for (uint8_t i = 0; i < connection_count; i++) {
+        PooledPahoConnection &connection = connections[i];
+        sprintf(client_id_suffixes[i], "%d", i);
+        connection.setClientIdSuffix(client_id_suffixes[i]);
+        connection.setPacketIdRange((uint16_t) (1 + i * packet_id_span), (uint16_t) ((i + 1) * packet_id_span));
+        // otherwise loop would wait in yield for each connection one after another
+        connection.setBrokerThread(true);
+        // the broker shall publish the will once, when the first connection is lost
+        connection.setWillEnabled(i == 0);
+        if (!connection.begin()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void PahoMqttConnectionPool::setCore(Core *core) {
+    this->core = core;
+    for (uint8_t i = 0; i < BROKER_POOL_MAXIMUM_CONNECTIONS; i++) {
+        connections[i].setCore(core);
+    }
+}
+
+void PahoMqttConnectionPool::setLogger(LoggerInterface *logger) {
+    for (uint8_t i = 0; i < BROKER_POOL_MAXIMUM_CONNECTIONS; i++) {
+        connections[i].setLogger(logger);
+    }
+}
+
+void PahoMqttConnectionPool::setServer(uint8_t *ip, uint16_t port) {
+    for (uint8_t i = 0; i < connection_count; i++) {
+        connections[i].setServer(ip, port);
+    }
+}
+
+void PahoMqttConnectionPool::setServer(const char *hostname, uint16_t port) {
+    for (uint8_t i = 0; i < connection_count; i++) {
+        connections[i].setServer(hostname, port);
+    }
+}
+
+// the connections connect themselves in loop with the configured client id and their own suffix,
+// connecting all of them with the same client id would make the broker close the others
+
+bool PahoMqttConnectionPool::connect(const char *) {
+    return false;
+}
+
+bool PahoMqttConnectionPool::connect(const char *, const char *, const char *) {
+    return false;
+}
+
+bool PahoMqttConnectionPool::connect(const char *, const char *, uint8_t, bool, const uint8_t *, const uint16_t) {
+    return false;
+}
+
+bool PahoMqttConnectionPool::connect(const char *, const char *, const char *, const char *, uint8_t, bool,
+                                     const uint8_t *, const uint16_t) {
+    return false;
+}
+
+void PahoMqttConnectionPool::disconnect() {
+    for (uint8_t i = 0; i < connection_count; i++) {
+        connections[i].disconnect();
+    }
+}
+
+bool PahoMqttConnectionPool::publish(const char *topic, const uint8_t *payload, uint16_t plength, uint8_t qos,
+                                     bool retained) {
+    return connections[get_connection(topic)].publish(topic, payload, plength, qos, retained);
+}
+
+bool PahoMqttConnectionPool::publish_async(const char *topic, const uint8_t *payload, uint16_t plength, bool retained,
+                                           uint16_t *packet_id) {
+    return connections[get_connection(topic)].publish_async(topic, payload, plength, retained, packet_id);
+}
+
+bool PahoMqttConnectionPool::subscribe(const char *topic, uint8_t qos) {
+    return connections[get_connection(topic)].subscribe(topic, qos);
+}
+
+bool PahoMqttConnectionPool::subscribe_all(const char *topic_names, uint16_t topic_count, uint8_t qos) {
+    return split_by_connection(topic_names, topic_count, qos, true);
+}
+
+bool PahoMqttConnectionPool::unsubscribe_all(const char *topic_names, uint16_t topic_count) {
+    return split_by_connection(topic_names, topic_count, 0, false);
+}
+
+bool PahoMqttConnectionPool::split_by_connection(const char *topic_names, uint16_t topic_count, uint8_t qos,
+                                                 bool subscribe) {
+    bool succeeded = true;
+    char connection_topic_names[BROKER_POOL_SUBSCRIBE_BUFFER_LENGTH];
+    for (uint8_t i = 0; i < connection_count; i++) {
+        // one pass over the topic names per connection, each connection gets its topics in as few batches as possible
+        if (subscribe && resubscribing && !connections[i].resubscribe_pending) {
+            continue;
+        }
+        uint16_t connection_topic_count = 0;
+        uint16_t position = 0;
+        const char *topic_name = topic_names;
+        for (uint16_t j = 0; j < topic_count; j++) {
+            uint16_t topic_name_length = (uint16_t) (strlen(topic_name) + 1);
+            if (get_connection(topic_name) == i) {
+                if (position + topic_name_length > sizeof(connection_topic_names)) {
+                    succeeded &= send_batch(i, connection_topic_names, connection_topic_count, qos, subscribe);
+                    connection_topic_count = 0;
+                    position = 0;
+                }
+                memcpy(&connection_topic_names[position], topic_name, topic_name_length);
+                position += topic_name_length;
+                connection_topic_count++;
+            }
+            topic_name += topic_name_length;
+        }
+        if (connection_topic_count > 0) {
+            succeeded &= send_batch(i, connection_topic_names, connection_topic_count, qos, subscribe);
+        }
+    }
+    return succeeded;
+}
+
+bool PahoMqttConnectionPool::send_batch(uint8_t connection, const char *topic_names, uint16_t topic_count,
+                                        uint8_t qos, bool subscribe) {
+    if (subscribe) {
+        return connections[connection].subscribe_all(topic_names, topic_count, qos);
+    }
+    return connections[connection].unsubscribe_all(topic_names, topic_count);
+}
+
+bool PahoMqttConnectionPool::unsubscribe(const char *topic) {
+    if (topic == nullptr) {
+        return true;
+    }
+    return connections[get_connection(topic)].unsubscribe(topic);
+}
+
+bool PahoMqttConnectionPool::receive_publish(const char *, uint16_t, const uint8_t *, uint32_t, bool) {
+    // each connection receives its publishes itself
+    return false;
+}
+
+bool PahoMqttConnectionPool::receive_puback(uint16_t) {
+    // each connection receives its PUBACKs itself
+    return false;
+}
+
+uint32_t PahoMqttConnectionPool::get_broker_dropped_count() {
+    uint32_t dropped_count = 0;
+    for (uint8_t i = 0; i < connection_count; i++) {
+        dropped_count += connections[i].get_broker_dropped_count();
+    }
+    return dropped_count;
+}
+
+uint32_t PahoMqttConnectionPool::get_broker_high_water_mark() {
+    // each connection has its own queue, the fullest one is the limit
+    uint32_t high_water_mark = 0;
+    for (uint8_t i = 0; i < connection_count; i++) {
+        uint32_t connection_high_water_mark = connections[i].get_broker_high_water_mark();
+        if (connection_high_water_mark > high_water_mark) {
+            high_water_mark = connection_high_water_mark;
+        }
+    }
+    return high_water_mark;
+}
+
+uint32_t PahoMqttConnectionPool::get_broker_oversize_count() {
+    uint32_t oversize_count = 0;
+    for (uint8_t i = 0; i < connection_count; i++) {
+        oversize_count += connections[i].get_broker_oversize_count();
+    }
+    return oversize_count;
+}
+
+bool PahoMqttConnectionPool::loop() {
+    uint8_t connected_count = 0;
+    for (uint8_t i = 0; i < connection_count; i++) {
+        connections[i].loop();
+        if (connections[i].connected) {
+            connected_count++;
+        }
+    }
+    if (notified_connected && connected_count < connection_count) {
+        // a connection is lost, tell the core once
+        notified_connected = false;
+        core->notify_mqtt_disconnected();
+    } else if (!notified_connected && connected_count == connection_count) {
+        notified_connected = true;
+        // the core resubscribes all topics, only the reconnected connections need them
+        resubscribing = true;
+        core->notify_mqtt_connected();
+        resubscribing = false;
+        for (uint8_t i = 0; i < connection_count; i++) {
+            connections[i].resubscribe_pending = false;
+        }
+    }
+    return notified_connected;
+}
@@ -0,0 +1,137 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_PAHOMQTTCONNECTIONPOOL_H
+#define GATEWAY_PAHOMQTTCONNECTIONPOOL_H
+
+#include "PahoMqttMessageHandler.h"
+
+#define BROKER_POOL_MAXIMUM_CONNECTIONS 8
+#define BROKER_POOL_SUBSCRIBE_BUFFER_LENGTH 1024 // topic names of a single connection (un)subscribed at once
+
+class PahoMqttConnectionPool;
+
+/**
+ * A connection of the PahoMqttConnectionPool, it reports its connection state to the pool instead of the core.
+ */
+class PooledPahoConnection : public PahoMqttMessageHandler {
+public:
+    bool connected = false;
+    // set when the connection is established, its topics are subscribed again with the next resubscription
+    bool resubscribe_pending = false;
+
+protected:
+    void notify_connected() override;
+
+    void notify_disconnected() override;
+};
+
+/**
+ * Several connections to the broker used like a single one.
+ * Each connection has its own client id (the connection number is appended), broker thread and packet buffer.
+ * Publishes and subscriptions are assigned to a connection by a hash of the topic name,
+ * so the order of the publishes of a topic is kept and a topic is unsubscribed on the connection it is subscribed.
+ * The packet ids are split into disjoint ranges, so the core can match the PUBACKs of all connections.
+ * The core is told connected when all connections are established and disconnected when one of them is lost.
+ * The resubscription of the core following it is only send on the connections established since the last one,
+ * the others kept their subscriptions and would get the retained messages again.
+ * The will of the gateway is registered on the first connection only.
+ *
+ * Usage:
+ *  PahoMqttConnectionPool mqtt;
+ *  mqtt.setConnectionCount(4);
+ *  gateway.setMqttInterface(&mqtt);
+ */
+class PahoMqttConnectionPool : public MqttMessageHandlerInterface {
+private:
+    PooledPahoConnection connections[BROKER_POOL_MAXIMUM_CONNECTIONS];
+    char client_id_suffixes[BROKER_POOL_MAXIMUM_CONNECTIONS][4];
+    uint8_t connection_count = 1;
+    Core *core = nullptr;
+    bool notified_connected = false;
+    // true while the core resubscribes, subscribe_all skips the connections without resubscribe_pending then
+    bool resubscribing = false;
+
+public:
+    /**
+     * Sets the number of connections, call it before begin.
+     * @param count between 1 and BROKER_POOL_MAXIMUM_CONNECTIONS
+     * @return false if the count is out of range
+     */
+    bool setConnectionCount(uint8_t count);
+
+    /**
+     * @return the number of the connection carrying the publishes and the subscription of the topic
+     */
+    uint8_t get_connection(const char *topic);
+
+    /**
+     * @return number of publishes from the broker dropped by all connections
+     */
+    uint32_t get_broker_dropped_count() override;
+
+    /**
+     * @return highest number of publishes queued at the same time by a single connection
+     */
+    uint32_t get_broker_high_water_mark() override;
+
+    /**
+     * @return number of publishes from the broker dropped by all connections because they are too large
+     */
+    uint32_t get_broker_oversize_count() override;
+
+    bool begin() override;
+
+    void setCore(Core *core) override;
+
+    void setLogger(LoggerInterface *logger) override;
+
+    void setServer(uint8_t *ip, uint16_t port) override;
+
+    void setServer(const char *hostname, uint16_t port) override;
+
+    bool connect(const char *id) override;
+
+    bool connect(const char *id, const char *user, const char *pass) override;
+
+    bool connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const uint8_t *willMessage,
+                 const uint16_t willMessageLength) override;
+
+    bool connect(const char *id, const char *user, const char *pass, const char *willTopic, uint8_t willQos,
+                 bool willRetain, const uint8_t *willMessage, const uint16_t willMessageLength) override;
+
+    void disconnect() override;
+
+    bool publish(const char *topic, const uint8_t *payload, uint16_t plength, uint8_t qos, bool retained) override;
+
+    bool publish_async(const char *topic, const uint8_t *payload, uint16_t plength, bool retained,
+                       uint16_t *packet_id) override;
+
+    bool subscribe(const char *topic, uint8_t qos) override;
+
+    bool subscribe_all(const char *topic_names, uint16_t topic_count, uint8_t qos) override;
+
+    bool unsubscribe(const char *topic) override;
+
+    bool unsubscribe_all(const char *topic_names, uint16_t topic_count) override;
+
+    bool receive_publish(const char *topic, uint16_t topic_length, const uint8_t *payload, uint32_t length,
+                         bool retain) override;
+
+    bool receive_puback(uint16_t packet_id) override;
+
+    bool loop() override;
+
+private:
+    /**
+     * Splits the topic names by their connection and subscribes or unsubscribes them on each connection in batches
+     * of BROKER_POOL_SUBSCRIBE_BUFFER_LENGTH bytes.
+     */
+    bool split_by_connection(const char *topic_names, uint16_t topic_count, uint8_t qos, bool subscribe);
+
+    bool send_batch(uint8_t connection, const char *topic_names, uint16_t topic_count, uint8_t qos, bool subscribe);
+};
+
+
+#endif //GATEWAY_PAHOMQTTCONNECTIONPOOL_H
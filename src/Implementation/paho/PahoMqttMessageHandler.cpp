@@ -1,20 +1,37 @@
+#include <thread>
+#include <poll.h>
 #include "PahoMqttMessageHandler.h"
 #include "../../MqttMessageHandlerInterface.h"
 
 void messageArrived(MQTT::MessageData& md);
 
-MqttMessageHandlerInterface *__mqttMessageHandler = nullptr;
+void publishAcknowledged(unsigned short packet_id);
+
+bool readPaused();
+
+// paho only takes plain function pointers as message handler,
+// thread_local lets each thread (e.g. each shard of the ShardedGateway) have its own handler
+thread_local MqttMessageHandlerInterface *__mqttMessageHandler = nullptr;
 
 void messageArrived(MQTT::MessageData& md){
     MQTT::Message &message = md.message;
-    char topic_name_buffer[1024];
-    memset(topic_name_buffer,0,1024);
-    if (md.topicName.lenstring.len < 1024) {
-        memcpy(topic_name_buffer, md.topicName.lenstring.data, md.topicName.lenstring.len);
-        __mqttMessageHandler->receive_publish(topic_name_buffer, (uint8_t *) message.payload, (uint32_t) message.payloadlen);
+    // topic and payload point into the read buffer of paho, they are copied only once into the publish queue
+    if (md.topicName.lenstring.len <= UINT16_MAX) {
+        __mqttMessageHandler->receive_publish(md.topicName.lenstring.data, (uint16_t) md.topicName.lenstring.len,
+                                              (uint8_t *) message.payload, (uint32_t) message.payloadlen,
+                                              message.retained);
     }
 }
 
+void publishAcknowledged(unsigned short packet_id){
+    __mqttMessageHandler->receive_puback(packet_id);
+}
+
+bool readPaused(){
+    // paho is only used by the PahoMqttMessageHandler, so the handler of this thread is one
+    return static_cast<PahoMqttMessageHandler *>(__mqttMessageHandler)->is_queue_full();
+}
+
 
 bool PahoMqttMessageHandler::begin() {
     if (core == nullptr) {
@@ -22,10 +39,90 @@ bool PahoMqttMessageHandler::begin() {
     }
     __mqttMessageHandler = this;
     ipstack = IPStack();
-    client = new MQTT::Client<IPStack, Countdown>(ipstack);
+    client = new MQTT::Client<IPStack, Countdown, BROKER_PACKET_SIZE, 5>(ipstack);
+    client->setPublishAckHandler(publishAcknowledged);
+    // a publish read while the queue is full would be acknowledged to the broker and dropped afterwards
+    client->setReadPausedHandler(readPaused);
+    client->setPacketIdRange(first_packet_id, last_packet_id);
+    // all broker publishes go to the default message handler, the core dispatches them to the clients,
+    // so the number of subscriptions is not limited by the MAX_MESSAGE_HANDLERS of paho
+    client->setDefaultMessageHandler(messageArrived);
+    // gateways restarted together shall not reconnect in lockstep
+    jitter.seed((uint32_t) get_milliseconds() ^ (uint32_t) (uintptr_t) this);
+    if (broker_thread_enabled && !broker_thread_started) {
+        broker_thread_started = true;
+        std::thread(run_broker_thread, this).detach();
+    }
     return true;
 }
 
+void PahoMqttMessageHandler::setBrokerThread(bool enabled) {
+    this->broker_thread_enabled = enabled;
+}
+
+void PahoMqttMessageHandler::setPacketIdRange(uint16_t first, uint16_t last) {
+    this->first_packet_id = first;
+    this->last_packet_id = last;
+}
+
+void PahoMqttMessageHandler::notify_connected() {
+    core->notify_mqtt_connected();
+}
+
+void PahoMqttMessageHandler::notify_disconnected() {
+    core->notify_mqtt_disconnected();
+}
+
+uint32_t PahoMqttMessageHandler::get_broker_dropped_count() {
+    // the publishes paho skipped never reached the queue
+    return publishes.get_rejected_count() + (uint32_t) client->getOversizeCount();
+}
+
+uint32_t PahoMqttMessageHandler::get_broker_high_water_mark() {
+    return publishes.get_high_water_mark();
+}
+
+uint32_t PahoMqttMessageHandler::get_broker_oversize_count() {
+    return oversize_count.load(std::memory_order_relaxed) + (uint32_t) client->getOversizeCount();
+}
+
+void PahoMqttMessageHandler::run_broker_thread(PahoMqttMessageHandler *handler) {
+    // messageArrived is called in this thread
+    __mqttMessageHandler = handler;
+    while (true) {
+        int socket = -1;
+        bool buffered = false;
+        bool paused = false;
+        {
+            std::lock_guard<std::mutex> lock(handler->client_mutex);
+            // a command of the core thread may have lost the connection
+            handler->check_connection();
+            if (handler->client->isConnected()) {
+                socket = handler->ipstack.getSocket();
+                buffered = handler->ipstack.available() > 0;
+                paused = handler->is_queue_full();
+            }
+        }
+        if (socket < 0 || paused) {
+            // wait for loop to connect or to deliver the queue
+            std::this_thread::sleep_for(std::chrono::milliseconds(socket < 0 ? 10 : 1));
+            continue;
+        }
+        if (!buffered) {
+            // wait without the client_mutex, so the core thread is not blocked while the broker is quiet
+            // the socket may be closed by the core thread meanwhile, then poll returns early
+            struct pollfd readable = {socket, POLLIN, 0};
+            poll(&readable, 1, BROKER_THREAD_YIELD_MS);
+        }
+        std::lock_guard<std::mutex> lock(handler->client_mutex);
+        if (handler->client->isConnected()) {
+            // reads the packets received so far and sends the keep alive if due
+            handler->client->yield(1);
+            handler->check_connection();
+        }
+    }
+}
+
 void PahoMqttMessageHandler::setCore(Core *core) {
     this->core = core;
 }
@@ -54,6 +151,16 @@ void PahoMqttMessageHandler::setServer(const char *hostname, uint16_t port) {
 }
 
 
+void PahoMqttMessageHandler::setClientIdSuffix(const char *suffix) {
+    this->client_id_suffix = suffix;
+}
+
+
+void PahoMqttMessageHandler::setWillEnabled(bool enabled) {
+    this->will_enabled = enabled;
+}
+
+
 bool PahoMqttMessageHandler::connect(const char *id) {
     int rc;
     if (hostname != nullptr) {
@@ -173,8 +280,11 @@ bool PahoMqttMessageHandler::connect(const char *id, const char *user, const cha
 }
 
 void PahoMqttMessageHandler::disconnect() {
+    std::lock_guard<std::mutex> lock(client_mutex);
+    __mqttMessageHandler = this;
     client->disconnect();
     ipstack.disconnect();
+    connected.store(false, std::memory_order_release);
 }
 
 bool PahoMqttMessageHandler::publish(const char *topic, const uint8_t *payload, uint16_t plength, uint8_t qos,
@@ -195,10 +305,29 @@ bool PahoMqttMessageHandler::publish(const char *topic, const uint8_t *payload,
     message.retained = retained;
     message.dup = false;
 
+    std::lock_guard<std::mutex> lock(client_mutex);
+    __mqttMessageHandler = this;
     int rc = client->publish(topic, message);
+    if (rc != 0) {
+        check_connection();
+    }
     return rc == 0;
 }
 
+bool PahoMqttMessageHandler::publish_async(const char *topic, const uint8_t *payload, uint16_t plength, bool retained,
+                                           uint16_t *packet_id) {
+    std::lock_guard<std::mutex> lock(client_mutex);
+    __mqttMessageHandler = this;
+    unsigned short id = 0;
+    int rc = client->publishAsync(topic, (void *) payload, plength, id, MQTT::QOS1, retained);
+    if (rc != 0) {
+        check_connection();
+        return false;
+    }
+    *packet_id = id;
+    return true;
+}
+
 bool PahoMqttMessageHandler::subscribe(const char *topic, uint8_t qos) {
     MQTT::QoS _qos;
     if (qos == 0) {
@@ -211,10 +340,45 @@ bool PahoMqttMessageHandler::subscribe(const char *topic, uint8_t qos) {
         return false;
     }
 
-    int rc = client->subscribe(topic, _qos, messageArrived);
+    std::lock_guard<std::mutex> lock(client_mutex);
+    __mqttMessageHandler = this;
+    deliver_while_waiting = true;
+    int rc = client->subscribe(topic, _qos, nullptr);
+    deliver_while_waiting = false;
     return rc == 0;
 }
 
+bool PahoMqttMessageHandler::subscribe_all(const char *topic_names, uint16_t topic_count, uint8_t qos) {
+    if (qos > 2) {
+        return false;
+    }
+    bool subscribed = true;
+    const char *topic_filters[BROKER_SUBSCRIBE_BATCH_SIZE];
+    const char *topic_name = topic_names;
+    uint16_t remaining = topic_count;
+    std::lock_guard<std::mutex> lock(client_mutex);
+    __mqttMessageHandler = this;
+    // the retained messages of the topics arrive together with the SUBACKs
+    deliver_while_waiting = true;
+    while (remaining > 0) {
+        uint16_t batch_size = remaining < BROKER_SUBSCRIBE_BATCH_SIZE ? remaining : BROKER_SUBSCRIBE_BATCH_SIZE;
+        for (uint16_t i = 0; i < batch_size; i++) {
+            topic_filters[i] = topic_name;
+            topic_name += strlen(topic_name) + 1;
+        }
+        remaining -= batch_size;
+        int rc = client->subscribeMany(batch_size, topic_filters, (MQTT::QoS) qos);
+        if (rc != 0) {
+            subscribed = false;
+            if (!client->isConnected()) {
+                break;
+            }
+        }
+    }
+    deliver_while_waiting = false;
+    return subscribed;
+}
+
 
 
 bool PahoMqttMessageHandler::unsubscribe(const char *topic) {
@@ -224,65 +388,303 @@ bool PahoMqttMessageHandler::unsubscribe(const char *topic) {
     if (strlen(topic) == 0) {
         return true;
     }
+    std::lock_guard<std::mutex> lock(client_mutex);
+    __mqttMessageHandler = this;
+    deliver_while_waiting = true;
     int rc = client->unsubscribe(topic);
+    deliver_while_waiting = false;
     return rc == 0;
 }
 
-bool PahoMqttMessageHandler::receive_publish(char *topic, uint8_t *payload, uint32_t length) {
-    CORE_RESULT publish_result = core->publish(topic, payload, length, false);
-    return publish_result == SUCCESS;}
+bool PahoMqttMessageHandler::unsubscribe_all(const char *topic_names, uint16_t topic_count) {
+    bool unsubscribed = true;
+    const char *topic_filters[BROKER_SUBSCRIBE_BATCH_SIZE];
+    const char *topic_name = topic_names;
+    uint16_t remaining = topic_count;
+    std::lock_guard<std::mutex> lock(client_mutex);
+    __mqttMessageHandler = this;
+    deliver_while_waiting = true;
+    while (remaining > 0) {
+        uint16_t batch_size = remaining < BROKER_SUBSCRIBE_BATCH_SIZE ? remaining : BROKER_SUBSCRIBE_BATCH_SIZE;
+        for (uint16_t i = 0; i < batch_size; i++) {
+            topic_filters[i] = topic_name;
+            topic_name += strlen(topic_name) + 1;
+        }
+        remaining -= batch_size;
+        int rc = client->unsubscribeMany(batch_size, topic_filters);
+        if (rc != 0) {
+            unsubscribed = false;
+            if (!client->isConnected()) {
+                break;
+            }
+        }
+    }
+    deliver_while_waiting = false;
+    return unsubscribed;
+}
+
+bool PahoMqttMessageHandler::receive_publish(const char *topic, uint16_t topic_length, const uint8_t *payload,
+                                             uint32_t length, bool retain) {
+    if (topic_length > BROKER_PUBLISH_TOPIC_LENGTH || length > BROKER_PUBLISH_PAYLOAD_LENGTH) {
+        // the core cannot forward it anyway
+        oversize_count.store(oversize_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        publishes.reject();
+        return false;
+    }
+    broker_publish *slot = publishes.acquire_slot();
+    if (slot == nullptr && deliver_while_waiting) {
+        // the core thread waits for an ack, as consumer of the queue it can make room itself
+        deliver_publishes();
+        slot = publishes.acquire_slot();
+    }
+    if (slot == nullptr) {
+        publishes.reject();
+        return false;
+    }
+    memcpy(slot->topic, topic, topic_length);
+    slot->topic[topic_length] = '\0';
+    memcpy(slot->payload, payload, length);
+    slot->payload_length = (uint16_t) length;
+    slot->retain = retain;
+    publishes.commit_slot();
+    return true;
+}
+
+bool PahoMqttMessageHandler::receive_puback(uint16_t packet_id) {
+    if (pubacks.push(packet_id)) {
+        return true;
+    }
+    if (deliver_while_waiting) {
+        deliver_publishes();
+        return pubacks.push(packet_id);
+    }
+    // if dropped, the client retransmits its publish
+    return false;
+}
+
+bool PahoMqttMessageHandler::is_queue_full() {
+    return publishes.size() >= publishes.capacity() || pubacks.size() >= pubacks.capacity();
+}
+
+void PahoMqttMessageHandler::deliver_publishes() {
+    uint16_t packet_id;
+    while (pubacks.pop(packet_id)) {
+        core->notify_mqtt_puback_arrived(packet_id);
+    }
+    broker_publish *publish;
+    while ((publish = publishes.front()) != nullptr) {
+        core->publish(publish->topic, publish->payload, publish->payload_length, publish->retain);
+        publishes.release_slot();
+    }
+}
+
+bool PahoMqttMessageHandler::is_connected() {
+    return connected.load(std::memory_order_acquire);
+}
+
+void PahoMqttMessageHandler::check_connection() {
+    if (client->isConnected() && ipstack.isClosed()) {
+        client->disconnect();
+        ipstack.disconnect();
+    }
+    connected.store(client->isConnected(), std::memory_order_release);
+}
 
 bool PahoMqttMessageHandler::loop() {
-    if (client->isConnected()) {
-        client->yield(300);
-    }else{
-        // core->notify_mqtt_disconnected();
-        if(getConfigAndConnect()){
-            core->notify_mqtt_connected();
-            return true;
+    if (broker_thread_enabled && is_connected()) {
+        deliver_publishes();
+        return true;
+    }
+    if (!broker_thread_enabled && client->isConnected()) {
+        __mqttMessageHandler = this;
+        // yield returns early while the queue is full, deliver in between until the time is up
+        uint64_t now = get_milliseconds();
+        uint64_t deadline = now + BROKER_LOOP_YIELD_MS;
+        while (now < deadline && client->isConnected()) {
+            int rc = client->yield((unsigned long) (deadline - now));
+            deliver_publishes();
+            if (rc != MQTT::SUCCESS) {
+                // timed out reading or the connection is lost
+                break;
+            }
+            now = get_milliseconds();
         }
+        check_connection();
+        return true;
+    }
+    if (notified_connected) {
+        // the connection is lost, tell the core once
+        notified_connected = false;
+        notify_disconnected();
+    }
+    bool connected;
+    {
+        std::lock_guard<std::mutex> lock(client_mutex);
+        __mqttMessageHandler = this;
+        connected = continue_connect();
+    }
+    if (connected) {
+        notified_connected = true;
+        notify_connected();
+        return true;
+    }
+    return false;
+}
+
+bool PahoMqttMessageHandler::receive_available() {
+    if (!client->isConnected()) {
         return false;
     }
+    // the IPStack buffers whole chunks of the socket, epoll does not report the bytes already buffered,
+    // so keep on cycling as long as packets are taken out of the buffer
+    // deliver in between, so the publish queue does not overflow
+    __mqttMessageHandler = this;
+    int buffered;
+    do {
+        buffered = ipstack.available();
+        client->yield(1);
+        deliver_publishes();
+    } while (client->isConnected() && ipstack.available() > 0 && ipstack.available() != buffered);
+    check_connection();
     return true;
 }
 
+int PahoMqttMessageHandler::getSocket() {
+    if (!client->isConnected()) {
+        return -1;
+    }
+    return ipstack.getSocket();
+}
+
+int PahoMqttMessageHandler::getConnectingSocket(bool *writable) {
+    if (client->isConnected() || connection_state == BROKER_DISCONNECTED) {
+        return -1;
+    }
+    *writable = connection_state == BROKER_TCP_CONNECTING;
+    return ipstack.getSocket();
+}
+
+int32_t PahoMqttMessageHandler::getNextTimeout() {
+    if (client->isConnected()) {
+        return client->keepAliveLeftMs();
+    }
+    uint64_t now = get_milliseconds();
+    uint64_t deadline = connection_state == BROKER_DISCONNECTED ? next_connect_attempt : connect_deadline;
+    if (deadline <= now) {
+        return 0;
+    }
+    return (int32_t) (deadline - now);
+}
+
 bool PahoMqttMessageHandler::getConfigAndConnect() {
     uint8_t server_ip[4];
     memset(&server_ip, 0, sizeof(server_ip));
     uint16_t server_port = 0;
-    char client_id[24];
-    memset(&client_id, 0, sizeof(client_id));
-    if (core->get_mqtt_config((uint8_t *) &server_ip, &server_port, (char *) &client_id)) {
-        // login
-        char username[24];
-        memset(&username, 0, sizeof(username));
-        char password[24];
-        memset(&password, 0, sizeof(password));
-        // will
-        char will_topic[255];
-        memset(&will_topic, 0, sizeof(will_topic));
-        char will_msg[255];
-        memset(&will_msg, 0, sizeof(will_msg));
-        uint8_t will_qos = 0;
-        bool will_retain = false;
-
-        bool has_mqtt_login_config, has_mqtt_will;
-        has_mqtt_login_config = core->get_mqtt_login_config((char *) &username, (char *) password);
-        has_mqtt_will = core->get_mqtt_will(will_topic, will_msg, &will_qos, &will_retain);
-
-        setServer(server_ip, server_port);
-        if (has_mqtt_login_config && has_mqtt_will) {
-            return connect(client_id, username, password, will_topic, will_qos, will_retain, (const uint8_t *) will_msg,
-                           (const uint16_t) (strlen(will_msg) + 1));
-        } else if (has_mqtt_login_config) {
-            return connect(client_id, username, password);
-        } else if (has_mqtt_will) {
-            return connect(client_id, will_topic, will_qos, will_retain, (const uint8_t *) will_msg,
-                           (const uint16_t) (strlen(will_msg) + 1));
-        } else {
-            return connect(client_id);
+    memset(&connect_config, 0, sizeof(connect_config));
+    char *client_id = connect_config.client_id;
+    if (!core->get_mqtt_config((uint8_t *) &server_ip, &server_port, client_id)) {
+        return false;
+    }
+    if (client_id_suffix != nullptr) {
+        size_t maximum_length = sizeof(connect_config.client_id) - 1 - 1 - strlen(client_id_suffix);
+        if (strlen(client_id) > maximum_length) {
+            client_id[maximum_length] = 0;
         }
+        strcat(client_id, "-");
+        strcat(client_id, client_id_suffix);
+    }
+    connect_config.has_login = core->get_mqtt_login_config(connect_config.username, connect_config.password);
+    connect_config.has_will = will_enabled &&
+                              core->get_mqtt_will(connect_config.will_topic, connect_config.will_msg,
+                                                  &connect_config.will_qos, &connect_config.will_retain);
+    if (connect_config.has_will && connect_config.will_qos > 2) {
+        return false;
+    }
 
+    setServer(server_ip, server_port);
+    return ipstack.connectAsync((uint32_t) ip_address, port) == 0;
+}
+
+bool PahoMqttMessageHandler::continue_connect() {
+    uint64_t now = get_milliseconds();
+    if (connection_state == BROKER_DISCONNECTED) {
+        if (now < next_connect_attempt) {
+            return false;
+        }
+        if (!getConfigAndConnect()) {
+            connect_failed(now);
+            return false;
+        }
+        connection_state = BROKER_TCP_CONNECTING;
+        connect_deadline = now + BROKER_CONNECT_TIMEOUT_MS;
     }
-    return false;
+    if (now >= connect_deadline) {
+        connect_failed(now);
+        return false;
+    }
+
+    if (connection_state == BROKER_TCP_CONNECTING) {
+        int rc = ipstack.connectPoll(0);
+        if (rc == 0) {
+            return false;
+        }
+        if (rc < 0) {
+            connect_failed(now);
+            return false;
+        }
+        // same protocol versions and options as the blocking connect methods
+        MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+        data.MQTTVersion = (connect_config.has_login || connect_config.has_will) ? 4 : 3;
+        data.clientID.cstring = connect_config.client_id;
+        if (connect_config.has_login) {
+            data.username.cstring = connect_config.username;
+            data.password.cstring = connect_config.password;
+        }
+        if (connect_config.has_will) {
+            data.willFlag = 1;
+            data.will.topicName.cstring = connect_config.will_topic;
+            data.will.message.cstring = connect_config.will_msg;
+            data.will.qos = (MQTT::QoS) connect_config.will_qos;
+            if (connect_config.has_login) {
+                data.will.retained = (unsigned char) connect_config.will_retain; // TODO check
+            }
+        }
+        if (client->connectAsync(data) != MQTT::SUCCESS) {
+            connect_failed(now);
+            return false;
+        }
+        connection_state = BROKER_MQTT_CONNECTING;
+    }
+
+    int rc = client->connectPoll(0);
+    if (rc == MQTT::CONNECT_PENDING && !ipstack.isClosed()) {
+        return false;
+    }
+    if (rc != MQTT::SUCCESS) {
+        connect_failed(now);
+        return false;
+    }
+    connection_state = BROKER_DISCONNECTED;
+    reconnect_backoff = 0;
+    connected.store(true, std::memory_order_release);
+    return true;
+}
+
+void PahoMqttMessageHandler::connect_failed(uint64_t now) {
+    ipstack.disconnect();
+    connection_state = BROKER_DISCONNECTED;
+    if (reconnect_backoff == 0) {
+        reconnect_backoff = BROKER_RECONNECT_MINIMUM_MS;
+    } else if (reconnect_backoff < BROKER_RECONNECT_MAXIMUM_MS / 2) {
+        reconnect_backoff *= 2;
+    } else {
+        reconnect_backoff = BROKER_RECONNECT_MAXIMUM_MS;
+    }
+    // wait between half and the full backoff
+    next_connect_attempt = now + reconnect_backoff / 2 + jitter() % (reconnect_backoff / 2 + 1);
+}
+
+uint64_t PahoMqttMessageHandler::get_milliseconds() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
 }
@@ -4,7 +4,55 @@
 #include <MQTTClient.h>
 #include <linux.cpp>
 #include <netinet/in.h>
+#include <mutex>
+#include <random>
 #include "../../CoreInterface.h"
+#include "../SpscRingBuffer.h"
+
+#ifndef BROKER_PACKET_SIZE
+#define BROKER_PACKET_SIZE 512 // bytes of the send and of the read buffer of paho, larger packets are dropped
+#endif
+#if BROKER_PACKET_SIZE > IPSTACK_READ_BUFFER_SIZE
+#error "BROKER_PACKET_SIZE must not be larger than IPSTACK_READ_BUFFER_SIZE"
+#endif
+#define BROKER_QUEUE_SIZE 16 // publishes buffered from the broker, must be a power of two
+#define BROKER_PUBLISH_TOPIC_LENGTH 255
+#define BROKER_PUBLISH_PAYLOAD_LENGTH 255
+#define BROKER_THREAD_YIELD_MS 100 // the broker thread waits this long for the socket without holding the client
+#define BROKER_LOOP_YIELD_MS 300 // time loop reads from the broker without a broker thread
+#define BROKER_PUBACK_QUEUE_SIZE 32 // PUBACKs of asynchronous publishes buffered, must be a power of two
+#define BROKER_SUBSCRIBE_BATCH_SIZE 64 // topics handed to paho by subscribe_all and unsubscribe_all at once
+#define BROKER_RECONNECT_MINIMUM_MS 1000 // backoff after the first failed connect
+#define BROKER_RECONNECT_MAXIMUM_MS 60000 // the backoff doubles with each failed connect up to this
+#define BROKER_CONNECT_TIMEOUT_MS 10000 // for the TCP handshake and the CONNACK together
+
+enum BROKER_CONNECTION_STATE {
+    BROKER_DISCONNECTED, // waiting for the next connect attempt
+    BROKER_TCP_CONNECTING,
+    BROKER_MQTT_CONNECTING // CONNECT send, waiting for the CONNACK
+};
+
+/**
+ * Configuration of a connect attempt, read from the persistence when the attempt starts.
+ */
+struct broker_connect_config {
+    char client_id[24];
+    char username[24];
+    char password[24];
+    char will_topic[255];
+    char will_msg[255];
+    uint8_t will_qos;
+    bool will_retain;
+    bool has_login;
+    bool has_will;
+};
+
+struct broker_publish {
+    char topic[BROKER_PUBLISH_TOPIC_LENGTH + 1];
+    uint8_t payload[BROKER_PUBLISH_PAYLOAD_LENGTH];
+    uint16_t payload_length;
+    bool retain;
+};
 
 class PahoMqttMessageHandler : public MqttMessageHandlerInterface{
 private:
@@ -20,6 +68,53 @@ public:
 
     virtual void setServer(const char* hostname, uint16_t port);
 
+    /**
+     * Appends "-suffix" to the configured client id, e.g. if several connections share the same configuration.
+     * The client id is shortened to keep the result within 23 characters.
+     * @param suffix to append, nullptr for none
+     */
+    void setClientIdSuffix(const char *suffix);
+
+    /**
+     * Registers the will of the gateway at the broker when connecting, call it before begin.
+     * Connections sharing a configuration register it on one of them only, so the will is published once.
+     * @param enabled true to register the configured will (default), false to connect without will
+     */
+    void setWillEnabled(bool enabled);
+
+    /**
+     * Reads from the broker in a separate thread, call it before begin.
+     * The broker thread waits for the socket to become readable, then calls yield and queues the received
+     * publishes, loop hands them to the core.
+     * Reconnecting stays in loop, because it reads the configuration from the persistence.
+     * The client is guarded by a mutex, as paho is not thread-safe. It is locked only to read and send,
+     * never while waiting for the broker.
+     * @param enabled true for a separate broker thread, false to read in loop (default)
+     */
+    void setBrokerThread(bool enabled);
+
+    /**
+     * Restricts the packet ids of the publishes to first..last, call it before begin.
+     * Connections sharing a core need disjoint ranges, as the core matches the PUBACKs by packet id only.
+     */
+    void setPacketIdRange(uint16_t first, uint16_t last);
+
+    /**
+     * @return number of publishes from the broker dropped because the queue was full or they were too large
+     */
+    uint32_t get_broker_dropped_count() override;
+
+    /**
+     * @return highest number of publishes from the broker queued at the same time
+     */
+    uint32_t get_broker_high_water_mark() override;
+
+    /**
+     * @return number of publishes from the broker dropped because they are larger than BROKER_PACKET_SIZE,
+     * or because their topic or payload is longer than the core can forward
+     */
+    uint32_t get_broker_oversize_count() override;
+
     virtual bool connect(const char *id);
 
     virtual bool connect(const char *id, const char *user, const char *pass);
@@ -36,23 +131,139 @@ public:
 
     virtual bool publish(const char *topic, const uint8_t *payload, uint16_t plength, uint8_t qos, bool retained);
 
+    virtual bool publish_async(const char *topic, const uint8_t *payload, uint16_t plength, bool retained,
+                               uint16_t *packet_id);
+
     virtual bool subscribe(const char *topic, uint8_t qos);
 
+    virtual bool subscribe_all(const char *topic_names, uint16_t topic_count, uint8_t qos);
+
     virtual bool unsubscribe(const char *topic);
 
-    virtual bool receive_publish(char *topic, uint8_t *payload, uint32_t length);
+    virtual bool unsubscribe_all(const char *topic_names, uint16_t topic_count);
+
+    virtual bool receive_publish(const char *topic, uint16_t topic_length, const uint8_t *payload, uint32_t length,
+                                 bool retain);
+
+    virtual bool receive_puback(uint16_t packet_id);
 
     virtual bool loop();
 
+    /**
+     * Asked by paho before it reads the next packet in yield, reading pauses while it returns true.
+     * The publishes wait in the socket then, instead of being acknowledged to the broker and dropped.
+     * Yield returns early, loop delivers the queue and the broker thread reads on after it released the client_mutex.
+     * @return true if the publishes or the PUBACKs from the broker cannot be queued anymore
+     */
+    bool is_queue_full();
+
+    /**
+     * Handles the packets already received from the broker and sends the keep alive if due, without waiting long.
+     * For event loops like the EpollReactor, reconnecting is still done by loop.
+     * @return false if not connected
+     */
+    bool receive_available();
+
+    /**
+     * @return the file descriptor of the broker connection, -1 if not connected
+     */
+    int getSocket();
+
+    /**
+     * Gets the socket of the connect in progress, so an event loop calls loop as soon as it is ready.
+     * @param writable set to true while the TCP handshake is in progress, false while the CONNACK is awaited
+     * @return the file descriptor, -1 if no connect is in progress
+     */
+    int getConnectingSocket(bool *writable);
+
+    /**
+     * Gets the time until the keep alive is due or the next connect attempt starts or times out.
+     * @return the milliseconds until loop or receive_available have to be called again, -1 if nothing is due
+     */
+    int32_t getNextTimeout();
+
     IPStack ipstack;
-    MQTT::Client<IPStack, Countdown, 512, 5> *client;
+    MQTT::Client<IPStack, Countdown, BROKER_PACKET_SIZE, 5> *client;
     const char *hostname = nullptr;
     uint16_t port = 0;
+
+protected:
+    /**
+     * Called by loop once the connection to the broker is established, tells the core.
+     */
+    virtual void notify_connected();
+
+    /**
+     * Called by loop once the connection to the broker is lost, tells the core.
+     */
+    virtual void notify_disconnected();
+
 private:
     Core *core = nullptr;
-    bool getConfigAndConnect() ;
+
+    BROKER_CONNECTION_STATE connection_state = BROKER_DISCONNECTED;
+    broker_connect_config connect_config;
+    uint64_t connect_deadline = 0;
+    uint64_t next_connect_attempt = 0;
+    uint32_t reconnect_backoff = 0;
+    std::minstd_rand jitter;
+
+    /**
+     * Reads the configuration and starts a non-blocking connect to the broker.
+     * @return false if there is no configuration or the socket cannot be opened
+     */
+    bool getConfigAndConnect();
+
+    /**
+     * Advances the connect state machine without blocking: waits for the next attempt, the TCP handshake
+     * and the CONNACK. Call it with the client_mutex locked.
+     * @return true if the connection to the broker is established
+     */
+    bool continue_connect();
+
+    /**
+     * Closes the attempt and schedules the next one with exponential backoff and jitter.
+     */
+    void connect_failed(uint64_t now);
+
+    static uint64_t get_milliseconds();
     int64_t ip_address = -1;
+    const char *client_id_suffix = nullptr;
+    bool will_enabled = true;
     LoggerInterface *logger;
+
+    // received publishes are queued and given to the core after yield, so persistence never runs inside of yield
+    // the producer is the thread holding the client_mutex while calling yield, publish or subscribe
+    SpscRingBuffer<broker_publish, BROKER_QUEUE_SIZE> publishes;
+    // PUBACKs of asynchronous publishes, queued the same way
+    SpscRingBuffer<uint16_t, BROKER_PUBACK_QUEUE_SIZE> pubacks;
+    std::atomic<uint32_t> oversize_count{0}; // written by the producer of publishes
+    // whoever locks it points __mqttMessageHandler of its thread to this handler, as paho calls back into it
+    std::mutex client_mutex;
+    uint16_t first_packet_id = 1;
+    uint16_t last_packet_id = UINT16_MAX;
+    bool broker_thread_enabled = false;
+    bool broker_thread_started = false;
+    bool notified_connected = false;
+    // state of the client after the last locked operation, so loop does not wait for the client_mutex to check it
+    std::atomic<bool> connected{false};
+    // set by the subscription commands, the core calls them outside of client transactions
+    bool deliver_while_waiting = false;
+
+    void deliver_publishes();
+
+    /**
+     * Closes the client if the broker closed the connection, so loop notifies the core and reconnects.
+     * Call it with the client_mutex locked.
+     */
+    void check_connection();
+
+    /**
+     * @return true if the client was connected after the last operation on it, without locking the client_mutex
+     */
+    bool is_connected();
+
+    static void run_broker_thread(PahoMqttMessageHandler *handler);
 };
 
 
@@ -20,6 +20,7 @@
  *    Ian Craggs - fix for bug 475749 - packetid modified twice
  *******************************************************************************/
 #include <string.h>
+#include <atomic>
 
 #if !defined(MQTTCLIENT_H)
 #define MQTTCLIENT_H
@@ -35,6 +36,12 @@
 #if !defined(MQTTCLIENT_QOS2)
     #define MQTTCLIENT_QOS2 0
 #endif
+#if !defined(MAX_SUBSCRIBE_TOPIC_FILTERS)
+    #define MAX_SUBSCRIBE_TOPIC_FILTERS 32 // topic filters subscribeMany packs into one subscribe packet
+#endif
+#if !defined(MAX_INFLIGHT_SUBSCRIBES)
+    #define MAX_INFLIGHT_SUBSCRIBES 8 // subscribe packets subscribeMany sends before waiting for their subacks
+#endif
 
 namespace MQTT
 {
@@ -43,7 +50,7 @@ namespace MQTT
 enum QoS { QOS0, QOS1, QOS2 };
 
 // all failure return codes must be negative
-enum returnCode { BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
+enum returnCode { CONNECT_PENDING = -3, BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
 
 
 struct Message
@@ -72,16 +79,28 @@ class PacketId
 public:
     PacketId()
     {
+        first = 1;
+        last = MAX_PACKET_ID;
         next = 0;
     }
 
+    // restricts the packet ids, e.g. if several clients share one id space
+    void setRange(int first, int last)
+    {
+        this->first = first;
+        this->last = last;
+        next = first - 1;
+    }
+
     int getNext()
     {
-        return next = (next == MAX_PACKET_ID) ? 1 : next + 1;
+        return next = (next >= last || next < first) ? first : next + 1;
     }
 
 private:
     static const int MAX_PACKET_ID = 65535;
+    int first;
+    int last;
     int next;
 };
 
@@ -103,6 +122,10 @@ public:
 
     typedef void (*messageHandler)(MessageData&);
 
+    typedef void (*publishAckHandler)(unsigned short);
+
+    typedef bool (*readPausedHandler)();
+
     /** Construct the client
      *  @param network - pointer to an instance of the Network class - must be connected to the endpoint
      *      before calling MQTT connect
@@ -118,6 +141,40 @@ public:
         defaultMessageHandler.attach(mh);
     }
 
+    /** Set the callback invoked with the packet id of every PUBACK received, e.g. for publishAsync
+     *  @param ah - pointer to the callback function
+     */
+    void setPublishAckHandler(publishAckHandler ah)
+    {
+        ackHandler = ah;
+    }
+
+    /** Set the callback asked before a packet is read in yield, e.g. to stop reading while the receiver is behind
+     *  If it returns true, the packet stays in the network and yield returns early.
+     *  Commands waiting for their ack do not ask it, otherwise they would wait until they time out.
+     *  @param rh - pointer to the callback function
+     */
+    void setReadPausedHandler(readPausedHandler rh)
+    {
+        pausedHandler = rh;
+    }
+
+    /** Restricts the packet ids used by this client to first..last
+     *  @param first - the lowest packet id, at least 1
+     *  @param last - the highest packet id, at most 65535
+     */
+    void setPacketIdRange(int first, int last)
+    {
+        packetid.setRange(first, last);
+    }
+
+    /** @return the number of received packets skipped because they are larger than MAX_MQTT_PACKET_SIZE
+     */
+    unsigned long getOversizeCount()
+    {
+        return oversizeCount.load(std::memory_order_relaxed);
+    }
+
     /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
      *  The nework object must be connected to the network endpoint before calling this
      *  Default connect options are used
@@ -132,6 +189,20 @@ public:
      */
     int connect(MQTTPacket_connectData& options);
 
+    /** MQTT Connect - send an MQTT connect packet down the network without waiting for the Connack
+     *  The nework object must be connected to the network endpoint before calling this
+     *  Call connectPoll until it does not return CONNECT_PENDING.
+     *  @param options - connect options
+     *  @return success code -
+     */
+    int connectAsync(MQTTPacket_connectData& options);
+
+    /** Reads the Connack of connectAsync
+     *  @param timeout_ms - the time to wait for the Connack, in milliseconds
+     *  @return CONNECT_PENDING if the Connack did not arrive yet, success code or the return code of the Connack -
+     */
+    int connectPoll(unsigned long timeout_ms);
+
     /** MQTT Publish - send an MQTT publish packet and wait for all acks to complete for all QoSs
      *  @param topic - the topic to publish to
      *  @param message - the message to send
@@ -160,20 +231,51 @@ public:
      */
     int publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
 
+    /** MQTT Publish - send an MQTT publish packet without waiting for its acks
+     *  The PUBACK is passed to the publish ack handler when it arrives during a later yield or command.
+     *  @param topic - the topic to publish to
+     *  @param payload - the data to send
+     *  @param payloadlen - the length of the data
+     *  @param id - the packet id used - returned
+     *  @param qos - the QoS to send the publish at
+     *  @param retained - whether the message should be retained
+     *  @return success code -
+     */
+    int publishAsync(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
+
     /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param qos - the MQTT QoS to subscribe at
-     *  @param mh - the callback function to be invoked when a message is received for this subscription
+     *  @param mh - the callback function to be invoked when a message is received for this subscription,
+     *      0 to deliver the messages to the default message handler without using a message handler slot
      *  @return success code -
      */
     int subscribe(const char* topicFilter, enum QoS qos, messageHandler mh);
 
+    /** MQTT Subscribe - subscribe many topic filters with as few subscribe packets as possible
+     *  The topic filters are packed into subscribe packets up to the packet size, the packets are sent
+     *  back-to-back and the subacks are awaited together. The messages are delivered to the default message handler.
+     *  @param count - the number of topic filters
+     *  @param topicFilters - the topic filters
+     *  @param qos - the MQTT QoS to subscribe all topic filters at
+     *  @return success code - FAILURE if the broker refused any of the topic filters
+     */
+    int subscribeMany(int count, const char* const* topicFilters, enum QoS qos);
+
     /** MQTT Unsubscribe - send an MQTT unsubscribe packet and wait for the unsuback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @return success code -
      */
     int unsubscribe(const char* topicFilter);
 
+    /** MQTT Unsubscribe - unsubscribe many topic filters with as few unsubscribe packets as possible
+     *  The counterpart of subscribeMany, the packets are sent back-to-back and the unsubacks are awaited together.
+     *  @param count - the number of topic filters
+     *  @param topicFilters - the topic filters
+     *  @return success code -
+     */
+    int unsubscribeMany(int count, const char* const* topicFilters);
+
     /** MQTT Disconnect - send an MQTT disconnect packet, and clean up any state
      *  @return success code -
      */
@@ -195,15 +297,27 @@ public:
         return isconnected;
     }
 
+    /** The time until yield sends the next keep alive, for event loops waiting on the network
+     *  @return the milliseconds until the PINGREQ is due, -1 if none is due, e.g. while the PINGRESP is outstanding
+     */
+    int keepAliveLeftMs()
+    {
+        if (!isconnected || keepAliveInterval == 0 || ping_outstanding)
+            return -1;
+        int sent_left_ms = last_sent.left_ms();
+        int received_left_ms = last_received.left_ms();
+        return sent_left_ms < received_left_ms ? sent_left_ms : received_left_ms;
+    }
+
 private:
 
 	void cleanSession();
     int cycle(Timer& timer);
     int waitfor(int packet_type, Timer& timer);
     int keepalive();
-    int publish(int len, Timer& timer, enum QoS qos);
+    int publish(int len, Timer& timer, enum QoS qos, unsigned short id);
+    int connackArrived(Timer& timer);
 
-    int decodePacket(int* value, int timeout);
     int readPacket(Timer& timer);
     int sendPacket(int length, Timer& timer);
     int deliverMessage(MQTTString& topicName, Message& message);
@@ -214,6 +328,9 @@ private:
 
     unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
     unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    std::atomic<unsigned long> oversizeCount; // read by other threads than the one reading the packets
+    int partialLen; // bytes of the fixed header in readbuf, read by a readPacket that timed out before the body
+    int skipLen; // bytes of a packet larger than readbuf still to skip
 
     Timer last_sent, last_received;
     unsigned int keepAliveInterval;
@@ -230,6 +347,10 @@ private:
 
     FP<void, MessageData&> defaultMessageHandler;
 
+    publishAckHandler ackHandler;
+
+    readPausedHandler pausedHandler;
+
     bool isconnected;
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
@@ -280,6 +401,11 @@ template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
 MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
 {
     this->command_timeout_ms = command_timeout_ms;
+    ackHandler = 0;
+    pausedHandler = 0;
+    oversizeCount = 0;
+    partialLen = 0;
+    skipLen = 0;
 	cleanSession();
 }
 
@@ -347,7 +473,15 @@ int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
         rc = SUCCESS;
     }
     else
+    {
+        if (sent > 0)
+        {
+            // the broker would read the next packet as the rest of this one
+            isconnected = false;
+            ipstack.disconnect();
+        }
         rc = FAILURE;
+    }
         
 #if defined(MQTT_DEBUG)
     char printbuf[150];
@@ -357,67 +491,77 @@ int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
 }
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
-{
-    unsigned char c;
-    int multiplier = 1;
-    int len = 0;
-    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
-
-    *value = 0;
-    do
-    {
-        int rc = MQTTPACKET_READ_ERROR;
-
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
-        {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
-        }
-        rc = ipstack.read(&c, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (c & 127) * multiplier;
-        multiplier *= 128;
-    } while ((c & 128) != 0);
-exit:
-    return len;
-}
-
-
 /**
  * If any read fails in this method, then we should disconnect from the network, as on reconnect
  * the packets can be retried.
+ * A packet not received completely within the timeout is continued by the next call: the fixed header stays
+ * in readbuf and the network keeps the bytes of an incomplete read buffered, so the stream stays aligned.
  * @param timeout the max time to wait for the packet read to complete, in milliseconds
  * @return the MQTT packet type, or -1 if none
  */
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& timer)
 {
+    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
     int rc = FAILURE;
     MQTTHeader header = {0};
     int len = 0;
     int rem_len = 0;
 
-    /* 1. read the header byte.  This has the packet type in it */
-    if (ipstack.read(readbuf, 1, timer.left_ms()) != 1)
-        goto exit;
+    if (skipLen == 0)
+    {
+        /* 1. read the header byte.  This has the packet type in it */
+        if (partialLen == 0)
+        {
+            if (ipstack.read(readbuf, 1, timer.left_ms()) != 1)
+                goto exit;
+            partialLen = 1;
+        }
 
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(&rem_len, timer.left_ms());
-    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
+        /* 2. read the remaining length.  This is variable in itself */
+        while (partialLen == 1 || (readbuf[partialLen - 1] & 128) != 0)
+        {
+            if (partialLen > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+            {
+                // bad data, the start of the next packet cannot be found
+                partialLen = 0;
+                isconnected = false;
+                ipstack.disconnect();
+                goto exit;
+            }
+            if (ipstack.read(readbuf + partialLen, 1, timer.left_ms()) != 1)
+                goto exit;
+            partialLen++;
+        }
+        len = partialLen;
+        MQTTPacket_decodeBuf(readbuf + 1, &rem_len);
 
-	if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
-	{
-		rc = BUFFER_OVERFLOW;
-		goto exit;
-	}
+        if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
+        {
+            oversizeCount++;
+            partialLen = 0;
+            skipLen = rem_len;
+        }
+    }
+
+    if (skipLen > 0)
+    {
+        // skip the packet, so the next one is read from its start
+        while (skipLen > 0)
+        {
+            int chunk_len = (skipLen < MAX_MQTT_PACKET_SIZE) ? skipLen : MAX_MQTT_PACKET_SIZE;
+            if (ipstack.read(readbuf, chunk_len, timer.left_ms()) != chunk_len)
+                goto exit;
+            skipLen -= chunk_len;
+        }
+        rc = BUFFER_OVERFLOW;
+        goto exit;
+    }
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
     if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
         goto exit;
+    partialLen = 0;
 
     header.byte = readbuf[0];
     rc = header.bits.type;
@@ -510,6 +654,12 @@ int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
     timer.countdown_ms(timeout_ms);
     while (!timer.expired())
     {
+        if (pausedHandler != 0 && pausedHandler())
+        {
+            // leave the packets in the network until the receiver caught up, but keep the connection alive
+            keepalive();
+            break;
+        }
         if (cycle(timer) < 0)
         {
             rc = FAILURE;
@@ -539,9 +689,18 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 			rc = packet_type;
 			break;
         case CONNACK:
-        case PUBACK:
         case SUBACK:
             break;
+        case PUBACK:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                rc = FAILURE;
+            else if (ackHandler != 0)
+                ackHandler(mypacketid);
+            break;
+        }
         case PUBLISH:
 		{
             MQTTString topicName = MQTTString_initializer;
@@ -660,6 +819,29 @@ int MQTT::Client<Network, Timer, a, b>::waitfor(int packet_type, Timer& timer)
 
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options)
+{
+    Timer connect_timer(command_timeout_ms);
+    int rc = FAILURE;
+
+    if (isconnected) // don't send connect packet again if we are already connected
+        goto exit;
+
+    if ((rc = connectAsync(options)) != SUCCESS)
+        goto exit; // there was a problem
+
+    // this will be a blocking call, wait for the connack
+    if (waitfor(CONNACK, connect_timer) == CONNACK)
+        rc = connackArrived(connect_timer);
+    else
+        rc = FAILURE;
+
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connectAsync(MQTTPacket_connectData& options)
 {
     Timer connect_timer(command_timeout_ms);
     int rc = FAILURE;
@@ -668,6 +850,9 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     if (isconnected) // don't send connect packet again if we are already connected
         goto exit;
 
+    // a new connection starts with a new packet
+    partialLen = 0;
+    skipLen = 0;
     this->keepAliveInterval = options.keepAliveInterval;
     this->cleansession = options.cleansession;
     if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options)) <= 0)
@@ -677,21 +862,45 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
 
     if (this->keepAliveInterval > 0)
         last_received.countdown(this->keepAliveInterval);
-    // this will be a blocking call, wait for the connack
-    if (waitfor(CONNACK, connect_timer) == CONNACK)
+
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connectPoll(unsigned long timeout_ms)
+{
+    if (isconnected)
+        return SUCCESS;
+
+    Timer timer(timeout_ms);
+    int packet_type = readPacket(timer);
+    if (packet_type == CONNACK)
     {
-        unsigned char connack_rc = 255;
-        bool sessionPresent = false;
-        if (MQTTDeserialize_connack((unsigned char*)&sessionPresent, &connack_rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
-            rc = connack_rc;
-        else
-            rc = FAILURE;
+        Timer connect_timer(command_timeout_ms);
+        return connackArrived(connect_timer);
     }
+    if (packet_type == BUFFER_OVERFLOW)
+        return FAILURE;
+    return CONNECT_PENDING; // nothing read yet, the caller has to detect a closed network itself
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connackArrived(Timer& connect_timer)
+{
+    int rc = FAILURE;
+    unsigned char connack_rc = 255;
+    bool sessionPresent = false;
+    if (MQTTDeserialize_connack((unsigned char*)&sessionPresent, &connack_rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        rc = connack_rc;
     else
         rc = FAILURE;
 
 #if MQTTCLIENT_QOS2
     // resend any inflight publish
+    int len = 0;
     if (inflightMsgid > 0 && inflightQoS == QOS2 && pubrel)
     {
         if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, inflightMsgid)) <= 0)
@@ -705,11 +914,10 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     if (inflightMsgid > 0)
     {
         memcpy(sendbuf, pubbuf, MAX_MQTT_PACKET_SIZE);
-        rc = publish(inflightLen, connect_timer, inflightQoS);
+        rc = publish(inflightLen, connect_timer, inflightQoS, inflightMsgid);
     }
 #endif
 
-exit:
     if (rc == SUCCESS)
         isconnected = true;
     return rc;
@@ -747,7 +955,9 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::su
         unsigned short mypacketid;
         if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
             rc = grantedQoS; // 0, 1, 2 or 0x80
-        if (rc != 0x80)
+        if (rc != 0x80 && messageHandler == 0)
+            rc = 0; // the default message handler receives the messages, no slot needed
+        else if (rc != 0x80)
         {
             for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
             {
@@ -771,6 +981,98 @@ exit:
 }
 
 
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::subscribeMany(int count, const char* const* topicFilters, enum QoS qos)
+{
+    int rc = SUCCESS;
+    bool refused = false;
+    Timer timer;
+    MQTTString topics[MAX_SUBSCRIBE_TOPIC_FILTERS];
+    int qoss[MAX_SUBSCRIBE_TOPIC_FILTERS];
+    unsigned short inflight[MAX_INFLIGHT_SUBSCRIBES];
+    int next = 0;
+
+    if (!isconnected)
+        return FAILURE;
+
+    while (next < count)
+    {
+        // 1. send as many subscribe packets as allowed in flight
+        timer.countdown_ms(command_timeout_ms);
+        int inflight_count = 0;
+        while (next < count && inflight_count < MAX_INFLIGHT_SUBSCRIBES)
+        {
+            int topic_count = 0;
+            int rem_len = 2; // packet id
+            while (next + topic_count < count && topic_count < MAX_SUBSCRIBE_TOPIC_FILTERS)
+            {
+                int topic_len = 2 + (int) strlen(topicFilters[next + topic_count]) + 1;
+                if (MQTTPacket_len(rem_len + topic_len) > MAX_MQTT_PACKET_SIZE)
+                    break;
+                topics[topic_count].cstring = (char*) topicFilters[next + topic_count];
+                topics[topic_count].lenstring.len = 0;
+                topics[topic_count].lenstring.data = 0;
+                qoss[topic_count] = qos;
+                rem_len += topic_len;
+                topic_count++;
+            }
+            if (topic_count == 0)
+            {
+                // the topic filter does not fit into a packet at all
+                refused = true;
+                next++;
+                continue;
+            }
+            unsigned short id = packetid.getNext();
+            int len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, id, topic_count, topics, qoss);
+            if (len <= 0 || (rc = sendPacket(len, timer)) != SUCCESS)
+            {
+                rc = FAILURE;
+                goto exit;
+            }
+            inflight[inflight_count++] = id;
+            next += topic_count;
+        }
+
+        // 2. wait for the subacks of all of them, publishes arriving in between are delivered as usual
+        while (inflight_count > 0)
+        {
+            if (timer.expired())
+            {
+                rc = FAILURE;
+                goto exit;
+            }
+            if (cycle(timer) != SUBACK)
+                continue;
+            int granted_count = 0;
+            int granted[MAX_SUBSCRIBE_TOPIC_FILTERS];
+            unsigned short mypacketid;
+            if (MQTTDeserialize_suback(&mypacketid, MAX_SUBSCRIBE_TOPIC_FILTERS, &granted_count, granted, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                continue;
+            for (int i = 0; i < inflight_count; ++i)
+            {
+                if (inflight[i] != mypacketid)
+                    continue;
+                inflight[i] = inflight[--inflight_count];
+                for (int j = 0; j < granted_count; ++j)
+                {
+                    if (granted[j] == 0x80)
+                        refused = true;
+                }
+                break;
+            }
+        }
+    }
+
+exit:
+    if (rc != SUCCESS)
+        cleanSession();
+    else if (refused)
+        rc = FAILURE;
+    return rc;
+}
+
+
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::unsubscribe(const char* topicFilter)
 {
@@ -815,8 +1117,105 @@ exit:
 }
 
 
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::unsubscribeMany(int count, const char* const* topicFilters)
+{
+    int rc = SUCCESS;
+    bool skipped = false;
+    Timer timer;
+    MQTTString topics[MAX_SUBSCRIBE_TOPIC_FILTERS];
+    unsigned short inflight[MAX_INFLIGHT_SUBSCRIBES];
+    int next = 0;
+
+    if (!isconnected)
+        return FAILURE;
+
+    while (next < count)
+    {
+        // 1. send as many unsubscribe packets as allowed in flight
+        timer.countdown_ms(command_timeout_ms);
+        int inflight_count = 0;
+        while (next < count && inflight_count < MAX_INFLIGHT_SUBSCRIBES)
+        {
+            int topic_count = 0;
+            int rem_len = 2; // packet id
+            while (next + topic_count < count && topic_count < MAX_SUBSCRIBE_TOPIC_FILTERS)
+            {
+                int topic_len = 2 + (int) strlen(topicFilters[next + topic_count]);
+                if (MQTTPacket_len(rem_len + topic_len) > MAX_MQTT_PACKET_SIZE)
+                    break;
+                topics[topic_count].cstring = (char*) topicFilters[next + topic_count];
+                topics[topic_count].lenstring.len = 0;
+                topics[topic_count].lenstring.data = 0;
+                rem_len += topic_len;
+                topic_count++;
+            }
+            if (topic_count == 0)
+            {
+                // the topic filter does not fit into a packet at all
+                skipped = true;
+                next++;
+                continue;
+            }
+            unsigned short id = packetid.getNext();
+            int len = MQTTSerialize_unsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, id, topic_count, topics);
+            if (len <= 0 || (rc = sendPacket(len, timer)) != SUCCESS)
+            {
+                rc = FAILURE;
+                goto exit;
+            }
+            inflight[inflight_count++] = id;
+            next += topic_count;
+        }
+
+        // 2. wait for the unsubacks of all of them, publishes arriving in between are delivered as usual
+        while (inflight_count > 0)
+        {
+            if (timer.expired())
+            {
+                rc = FAILURE;
+                goto exit;
+            }
+            if (cycle(timer) != UNSUBACK)
+                continue;
+            unsigned short mypacketid;
+            if (MQTTDeserialize_unsuback(&mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                continue;
+            for (int i = 0; i < inflight_count; ++i)
+            {
+                if (inflight[i] == mypacketid)
+                {
+                    inflight[i] = inflight[--inflight_count];
+                    break;
+                }
+            }
+        }
+    }
+
+    // remove the subscription message handlers associated with the topics, if there are any
+    for (int i = 0; i < count; ++i)
+    {
+        for (int j = 0; j < MAX_MESSAGE_HANDLERS; ++j)
+        {
+            if (messageHandlers[j].topicFilter != 0 && strcmp(messageHandlers[j].topicFilter, topicFilters[i]) == 0)
+            {
+                messageHandlers[j].topicFilter = 0;
+                break;
+            }
+        }
+    }
+
+exit:
+    if (rc != SUCCESS)
+        cleanSession();
+    else if (skipped)
+        rc = FAILURE;
+    return rc;
+}
+
+
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos)
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos, unsigned short id)
 {
     int rc;
 
@@ -826,17 +1225,22 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Time
 #if MQTTCLIENT_QOS1
     if (qos == QOS1)
     {
-        if (waitfor(PUBACK, timer) == PUBACK)
+        // PUBACKs of asynchronous publishes may arrive first, wait for the one with our packet id
+        rc = FAILURE;
+        while (waitfor(PUBACK, timer) == PUBACK)
         {
             unsigned short mypacketid;
             unsigned char dup, type;
             if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
+                break;
+            if (mypacketid == id)
+            {
+                if (inflightMsgid == mypacketid)
+                    inflightMsgid = 0;
+                rc = SUCCESS;
+                break;
+            }
         }
-        else
-            rc = FAILURE;
     }
 #elif MQTTCLIENT_QOS2
     else if (qos == QOS2)
@@ -899,7 +1303,36 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* t
     }
 #endif
 
-    rc = publish(len, timer, qos);
+    rc = publish(len, timer, qos, id);
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publishAsync(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    MQTTString topicString = MQTTString_initializer;
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+
+    topicString.cstring = (char*)topicName;
+
+    id = 0;
+    if (qos == QOS1 || qos == QOS2)
+        id = packetid.getNext();
+
+    len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id,
+              topicString, (unsigned char*)payload, payloadlen);
+    if (len <= 0)
+        goto exit;
+
+    if ((rc = sendPacket(len, timer)) != SUCCESS)
+        cleanSession();
 exit:
     return rc;
 }
@@ -27,19 +27,44 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 
+#ifndef IPSTACK_READ_BUFFER_SIZE
+#define IPSTACK_READ_BUFFER_SIZE 4096 // bytes received from the broker at once, must hold the largest packet
+#endif
 
 class IPStack 
 {
 public:    
     IPStack()
     {
-
+		mysock = -1;
+		closed = false;
+		read_start = 0;
+		read_end = 0;
     }
+
+	// true if the broker closed the connection or the socket failed
+	bool isClosed()
+	{
+		return closed;
+	}
+
+	int getSocket()
+	{
+		return mysock;
+	}
+
+	// number of bytes received from the socket but not read yet,
+	// event loops have to read them without waiting for the socket to become readable again
+	int available()
+	{
+		return read_end - read_start;
+	}
     
 	int Socket_error(const char* aString)
 	{
@@ -57,6 +82,9 @@ public:
 
 	int connect(uint32_t ip, int port)
 	{
+		closed = false;
+		read_start = 0;
+		read_end = 0;
 		int type = SOCK_STREAM;
 		struct sockaddr_in address;
 		int rc = 0;
@@ -80,8 +108,65 @@ public:
 		return rc;
 	}
 
+	// starts connecting without waiting for the TCP handshake, call connectPoll until it is done
+	// returns 0 if the handshake is started
+	int connectAsync(uint32_t ip, int port)
+	{
+		closed = false;
+		read_start = 0;
+		read_end = 0;
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_port = htons(port);
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(ip);
+
+		mysock = socket(AF_INET, SOCK_STREAM, 0);
+		if (mysock == -1)
+			return -1;
+		int flags = fcntl(mysock, F_GETFL, 0);
+		if (flags == -1 || fcntl(mysock, F_SETFL, flags | O_NONBLOCK) == -1)
+		{
+			disconnect();
+			return -1;
+		}
+		if (::connect(mysock, (struct sockaddr*)&address, sizeof(address)) == 0 || errno == EINPROGRESS)
+			return 0;
+		disconnect();
+		return -1;
+	}
+
+	// returns 1 if the connection of connectAsync is established, 0 if still connecting, -1 if it failed
+	int connectPoll(int timeout_ms)
+	{
+		if (mysock == -1)
+			return -1;
+		struct pollfd pfd = {mysock, POLLOUT, 0};
+		int ready = poll(&pfd, 1, timeout_ms);
+		if (ready == 0 || (ready == -1 && errno == EINTR))
+			return 0;
+		int error = 0;
+		socklen_t error_length = sizeof(error);
+		if (ready == -1 || getsockopt(mysock, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0)
+		{
+			disconnect();
+			return -1;
+		}
+		// back to blocking mode, read waits with poll anyway
+		int flags = fcntl(mysock, F_GETFL, 0);
+		if (flags == -1 || fcntl(mysock, F_SETFL, flags & ~O_NONBLOCK) == -1)
+		{
+			disconnect();
+			return -1;
+		}
+		return 1;
+	}
+
     int connect(const char* hostname, int port)
     {
+		closed = false;
+		read_start = 0;
+		read_end = 0;
 		int type = SOCK_STREAM;
 		struct sockaddr_in address;
 		int rc = -1;
@@ -133,56 +218,108 @@ public:
         return rc;
     }
 
+    // reads from a buffer refilled with everything the socket has, so the header byte, the remaining length
+    // and the body of a packet mostly cost a single recv instead of one per field
+    // on a timeout the bytes stay buffered for the next read
     int read(unsigned char* buffer, int len, int timeout_ms)
     {
-		struct timeval interval = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
-		if (interval.tv_sec < 0 || (interval.tv_sec == 0 && interval.tv_usec <= 0))
-		{
-			interval.tv_sec = 0;
-			interval.tv_usec = 100;
-		}
+		if (len > IPSTACK_READ_BUFFER_SIZE)
+			return -1;
 
-		setsockopt(mysock, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval));
+		struct timeval now, end_time;
+		gettimeofday(&now, NULL);
+		struct timeval interval = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+		timeradd(&now, &interval, &end_time);
 
-		int bytes = 0;
-		while (bytes < len)
+		while (read_end - read_start < len)
 		{
-			int rc = ::recv(mysock, &buffer[bytes], (size_t)(len - bytes), 0);
-			if (rc == -1)
+			if (read_start == read_end)
 			{
-				if (Socket_error("read") != 0)
-				{
-					bytes = -1;
-					break;
-				}
+				read_start = 0;
+				read_end = 0;
 			}
-			else
-				bytes += rc;
+			else if (IPSTACK_READ_BUFFER_SIZE - read_start < len)
+			{
+				memmove(read_buffer, &read_buffer[read_start], (size_t)(read_end - read_start));
+				read_end -= read_start;
+				read_start = 0;
+			}
+
+			int rc = ::recv(mysock, &read_buffer[read_end], (size_t)(IPSTACK_READ_BUFFER_SIZE - read_end), MSG_DONTWAIT);
+			if (rc > 0)
+			{
+				read_end += rc;
+				continue;
+			}
+			if (rc == 0)
+			{
+				// connection closed by the peer
+				closed = true;
+				return -1;
+			}
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				Socket_error("read");
+				closed = true;
+				return -1;
+			}
+
+			// nothing received yet, wait for the rest of the timeout
+			struct timeval left;
+			gettimeofday(&now, NULL);
+			timersub(&end_time, &now, &left);
+			if (left.tv_sec < 0 || (left.tv_sec == 0 && left.tv_usec <= 0))
+				return -1;
+			struct pollfd pfd = {mysock, POLLIN, 0};
+			if (poll(&pfd, 1, (int)(left.tv_sec * 1000 + (left.tv_usec + 999) / 1000)) == 0)
+				return -1;
 		}
-		return bytes;
+
+		memcpy(buffer, &read_buffer[read_start], (size_t)len);
+		read_start += len;
+		return len;
     }
     
+    // MSG_NOSIGNAL instead of socket options, no extra system call per packet
+    // waits at most timeout ms for room in the send buffer, returns the bytes sent, 0 if there was no room
     int write(unsigned char* buffer, int len, int timeout)
     {
-		struct timeval tv;
-
-		tv.tv_sec = 0;  /* 30 Secs Timeout */
-		tv.tv_usec = timeout * 1000;  // Not init'ing this can cause strange errors
-
-		setsockopt(mysock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,sizeof(struct timeval));
-		int	rc = ::write(mysock, buffer, len);
+		int	rc = ::send(mysock, buffer, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		{
+			struct pollfd pfd = {mysock, POLLOUT, 0};
+			if (poll(&pfd, 1, timeout) <= 0)
+				return 0;
+			rc = ::send(mysock, buffer, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+				return 0;
+		}
+		if (rc == -1)
+			closed = true;
 		//printf("write rc %d\n", rc);
 		return rc;
     }
 
 	int disconnect()
 	{
-		return ::close(mysock);
+		read_start = 0;
+		read_end = 0;
+		if (mysock == -1)
+			return 0;
+		int rc = ::close(mysock);
+		mysock = -1;
+		return rc;
 	}
     
 private:
 
     int mysock; 
+    bool closed;
+    unsigned char read_buffer[IPSTACK_READ_BUFFER_SIZE];
+    int read_start; // next buffered byte to read
+    int read_end; // end of the buffered bytes
     
 };
 
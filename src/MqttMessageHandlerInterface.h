@@ -39,24 +39,95 @@ public:
 
     virtual bool publish(const char *topic, const uint8_t *payload, uint16_t plength, uint8_t qos, bool retained) = 0;
 
+    /**
+     * Sends a QoS 1 publish without waiting for the PUBACK of the broker.
+     * The PUBACK is reported later by Core::notify_mqtt_puback_arrived with the returned packet id.
+     * @param packet_id put in the packet id of the publish
+     * @return false if the publish could not be send
+     */
+    virtual bool publish_async(const char *topic, const uint8_t *payload, uint16_t plength, bool retained,
+                               uint16_t *packet_id) = 0;
+
+    /**
+     * Subscribes a topic and waits for the SUBACK.
+     * Implementation Note:
+     * - Publishes received meanwhile, e.g. the retained messages, may be given to the core before it returns,
+     *   so the core calls the subscription methods outside of client transactions.
+     * @return true if the topic is subscribed
+     */
     virtual bool subscribe(const char *topic, uint8_t qos) = 0;
 
+    /**
+     * Subscribes many topics at once, e.g. to restore the subscriptions after a reconnect.
+     * Implementation Note:
+     * - Pack the topics into as few SUBSCRIBE packets as possible and do not wait for each SUBACK separately.
+     * - Like subscribe, publishes received meanwhile may be given to the core before it returns.
+     * @param topic_names zero terminated topic names one after another
+     * @param topic_count number of topic names
+     * @param qos to subscribe all topics at
+     * @return true if all topics are subscribed
+     */
+    virtual bool subscribe_all(const char *topic_names, uint16_t topic_count, uint8_t qos) = 0;
+
+    /**
+     * Unsubscribes a topic and waits for the UNSUBACK, like subscribe publishes received meanwhile may be given to
+     * the core before it returns.
+     */
     virtual bool unsubscribe(const char *topic) = 0;
 
+    /**
+     * Unsubscribes many topics at once, e.g. all topics of a client removing its subscriptions.
+     * Implementation Note:
+     * - Like subscribe_all, pack the topics into as few UNSUBSCRIBE packets as possible and do not wait for each
+     *   UNSUBACK separately, publishes received meanwhile may be given to the core before it returns.
+     * @param topic_names zero terminated topic names one after another
+     * @param topic_count number of topic names
+     * @return true if all topics are unsubscribed
+     */
+    virtual bool unsubscribe_all(const char *topic_names, uint16_t topic_count) = 0;
+
     /**
      * Call this method when you received a publish from the broker.
      * Implementation Note:
      * - Call publish in this method internally.
-     * @param topic
+     * - The topic and the payload are only valid during the call, they can point into the receive buffer.
+     * @param topic not zero terminated
+     * @param topic_length
      * @param payload
      * @param length
+     * @param retain flag of the message set by the broker
+     * @return true if everthing worked fine, else otherwise.
+     * // TODO adept message signature with qos
+     */
+    virtual bool receive_publish(const char *topic, uint16_t topic_length, const uint8_t *payload, uint32_t length,
+                                 bool retain) = 0;
+
+    /**
+     * Call this method when you received a PUBACK for a publish send by publish_async.
+     * Implementation Note:
+     * - Call notify_mqtt_puback_arrived of the core in this method internally.
+     * @param packet_id of the acknowledged publish
      * @return true if everthing worked fine, else otherwise.
-     * // TODO adept message signature with retain and qos
      */
-    virtual bool receive_publish(char* topic, uint8_t * payload, uint32_t length) = 0;
+    virtual bool receive_puback(uint16_t packet_id) = 0;
 
     virtual bool loop() = 0;
 
+    /**
+     * @return number of publishes from the broker dropped before they reached the core
+     */
+    virtual uint32_t get_broker_dropped_count() = 0;
+
+    /**
+     * @return highest number of publishes from the broker waiting for the core at the same time
+     */
+    virtual uint32_t get_broker_high_water_mark() = 0;
+
+    /**
+     * @return number of publishes from the broker dropped because they are too large
+     */
+    virtual uint32_t get_broker_oversize_count() = 0;
+
 };
 
 
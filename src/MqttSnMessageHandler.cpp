@@ -253,6 +253,10 @@ void MqttSnMessageHandler::send_advertise(device_address *address, uint8_t gw_id
     }
 }
 
+void MqttSnMessageHandler::send_advertise(uint8_t gw_id, uint16_t duration) {
+    send_advertise(socket->getBroadcastAddress(), gw_id, duration);
+}
+
 void MqttSnMessageHandler::parse_register(device_address *address, uint8_t *bytes) {
     msg_register *msg = (msg_register *) bytes;
     if (bytes[0] > 6 && bytes[1] == MQTTSN_REGISTER && msg->topic_id == 0x0000 &&
@@ -318,7 +322,7 @@ MqttSnMessageHandler::send_regack(device_address *address, uint16_t topic_id, ui
 void
 MqttSnMessageHandler::send_register(device_address *address, uint16_t topic_id, uint16_t msg_id, const char *topic_name) {
     msg_register to_send(topic_id, msg_id, topic_name);
-    if (!socket->send(address, (uint8_t *) &to_send, sizeof(msg_register) + sizeof(topic_name))) {
+    if (!socket->send(address, (uint8_t *) &to_send, to_send.length)) {
         core->notify_mqttsn_disconnected();
     }
 }
@@ -384,8 +388,16 @@ void MqttSnMessageHandler::handle_publish(device_address *address, uint8_t *data
     if (qos == -1) {
         return;
     }
+    if (result_publish == PUBACKPENDING) {
+        // the core sends the PUBACK when the broker acknowledged the publish
+        return;
+    }
     if (result_publish != SUCCESS && result_publish != TOPICIDNONEXISTENCE) { // aka client map error
 
+        if (qos == 1 && result_publish == FULL) {
+            send_puback(address, msg_id, topic_id, REJECTED_CONGESTION);
+            return;
+        }
         if (qos == 1) {
             send_puback(address, msg_id, topic_id, REJECTED_NOT_SUPPORTED);
             return;
@@ -721,7 +733,7 @@ void MqttSnMessageHandler::handle_disconnect(device_address *address, uint16_t d
 void MqttSnMessageHandler::parse_puback(device_address *address, uint8_t *bytes) {
     msg_puback *msg = (msg_puback *) bytes;
     if (bytes[0] == 7) {
-        handle_puback(address, msg->topic_id, msg->message_id, msg->return_code);
+        handle_puback(address, msg->message_id, msg->topic_id, msg->return_code);
     }
 }
 
@@ -735,8 +747,9 @@ void MqttSnMessageHandler::handle_puback(device_address *address, uint16_t msg_i
 
 bool MqttSnMessageHandler::send_publish(device_address *address, uint8_t *data, uint8_t data_len, uint16_t msg_id,
                                         uint16_t topic_id, bool short_topic, bool retain, uint8_t qos, bool dup) {
-    msg_publish to_send(dup, qos, retain, short_topic, topic_id, msg_id, data, data_len);
-    bool send_status = socket->send(address, (uint8_t *) &to_send, to_send.length);
+    // only the header is put into to_send, the payload is send from where it is
+    msg_publish_send to_send(dup, qos, retain, short_topic, topic_id, msg_id, data_len);
+    bool send_status = socket->send(address, (uint8_t *) &to_send, sizeof(msg_publish_send), data, data_len);
     if (!send_status) {
         core->notify_mqttsn_disconnected();
     }
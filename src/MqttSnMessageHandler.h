@@ -142,6 +142,13 @@ public:
 
     void send_advertise(device_address *address, uint8_t gw_id, uint16_t duration);
 
+    /**
+     * Broadcasts an ADVERTISE message to all clients.
+     * @param gw_id of the gateway
+     * @param duration in seconds until the next ADVERTISE is broadcasted
+     */
+    void send_advertise(uint8_t gw_id, uint16_t duration);
+
     void send_gwinfo(device_address *address, uint8_t radius, uint8_t gw_id, uint8_t *gw_add, uint8_t gw_add_len);
 
     void send_connack(device_address *address, return_code_t return_code);
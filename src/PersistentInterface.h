@@ -123,6 +123,15 @@ public: // topic
     */
     virtual char *get_predefined_topic_name(uint16_t topic_id)  = 0;
 
+    /**
+     * Gets the predefined topic id of a topic name, the reverse of get_predefined_topic_name.
+     * Predefined topic ids are known by all clients, so publishes to them need no registration.
+     * @param topic_name to look up
+     * @param topic_id put in the predefined topic id if found
+     * @return true if the topic name is predefined, false otherwise
+     */
+    virtual bool get_predefined_topic_id(const char *topic_name, uint16_t *topic_id) = 0;
+
     virtual void set_client_state(CLIENT_STATUS status) = 0;
 
     virtual void set_client_duration(uint32_t duration) = 0;
@@ -204,23 +213,91 @@ public: // subscription
      */
     virtual uint32_t get_global_topic_subscription_count(const char *topic_name) = 0;
 
+    /**
+     * Reads the topic names of all global subscriptions, e.g. to subscribe them again after a reconnect.
+     * The topic names are written zero terminated one after another into topic_names.
+     * Call it again with the updated cursor until completed is true. No client transaction is needed.
+     * @param topic_names buffer for the topic names
+     * @param topic_names_length size of the buffer, at least one maximum length topic name
+     * @param cursor position to continue reading at, 0 for the first call
+     * @param completed set to true if all topic names are read
+     * @return the number of topic names written into topic_names
+     */
+    virtual uint16_t get_global_subscriptions(char *topic_names, uint16_t topic_names_length, uint32_t *cursor,
+                                              bool *completed) = 0;
+
+    /**
+     * Removes the subscriptions of the client and decrements their global subscription counts in bulk.
+     * The topic names whose global subscription count dropped to 0 are written zero terminated one after another
+     * into unsubscribe_topic_names, so the caller can unsubscribe them at the broker.
+     * Only as many subscriptions are removed in one call as topic names surely fit into the buffer,
+     * call it again until completed is true.
+     * @param unsubscribe_topic_names buffer for the topic names to unsubscribe
+     * @param unsubscribe_topic_names_length size of the buffer, at least one maximum length topic name
+     * @param completed set to true if the client has no subscriptions left
+     * @return the number of topic names written into unsubscribe_topic_names
+     */
+    virtual uint16_t remove_all_subscriptions(char *unsubscribe_topic_names, uint16_t unsubscribe_topic_names_length,
+                                              bool *completed) = 0;
+
 public: // publish
 
-    void
+    bool
     add_new_client_publish(uint8_t *data, uint8_t data_len, uint16_t topic_id, bool retain,
                            uint8_t qos) {
-        this->add_client_publish(data, data_len, topic_id, retain, qos, false, 0);
+        return this->add_client_publish(data, data_len, topic_id, retain, qos, false, 0);
     }
 
-    virtual void add_client_publish(uint8_t *data, uint8_t data_len, uint16_t topic_id, bool retain,
+    /**
+     * Queues a publish for the client.
+     * The queue of each client is bounded in messages and bytes, if it is full the configured overflow policy
+     * decides: drop the oldest, drop the new or drop the oldest QoS 0 publish first.
+     * Publishes waiting for their acknowledge are never dropped.
+     * @return true if the publish is queued, false if it is dropped or an error occurred
+     */
+    virtual bool add_client_publish(uint8_t *data, uint8_t data_len, uint16_t topic_id, bool retain,
                                     uint8_t qos, bool dup, uint16_t msg_id) = 0;
 
+    /**
+     * Queues a publish for the client referencing a payload in the shared message store.
+     * The reference count of the message is incremented if the publish is queued, it is decremented again
+     * when the publish is removed, so the payload is saved only once for all clients.
+     * @param message_id returned by add_shared_message
+     * @param data_len length of the payload, used for the byte limit of the queue
+     * @param predefined_topic true if topic_id is a predefined topic id instead of a registered one
+     * @return true if the publish is queued, false if it is dropped or an error occurred
+     */
+    virtual bool add_client_shared_publish(uint16_t message_id, uint8_t data_len, uint16_t topic_id,
+                                           bool predefined_topic, bool retain, uint8_t qos) = 0;
+
+    /**
+     * Saves a payload once in the shared message store, independent of a client transaction.
+     * The message starts with a reference count of one held by the caller, which must be released by
+     * release_shared_message after the publishes for the clients are queued. A restart drops this reference,
+     * the reference counts are recounted from the queued publishes.
+     * @return the message id, 0 if the message cannot be saved
+     */
+    virtual uint16_t add_shared_message(const uint8_t *data, uint8_t data_len) = 0;
+
+    /**
+     * Decrements the reference count of the message, the message is deleted with its last reference.
+     */
+    virtual void release_shared_message(uint16_t message_id) = 0;
+
+    /**
+     * Gets the depth of the publish queue of the client, e.g. for monitoring.
+     * The depth is kept up to date with the queue, so it is read without scanning the queued publishes.
+     * @param publish_count number of queued publishes
+     * @param publish_bytes sum of the payload lengths of the queued publishes
+     */
+    virtual void get_client_publish_queue_depth(uint16_t *publish_count, uint32_t *publish_bytes) = 0;
+
     /**
      * Write data in the give pointer and removes it from saved publishes for the client
      * @param data
      * @param data_len put in data len 0 if an error occured
      * @param topic_id
-     * @param short_topic
+     * @param predefined_topic true if topic_id is a predefined topic id instead of a registered one
      * @param retain
      * @param qos
      * @param dup
@@ -228,20 +305,84 @@ public: // publish
      * @return
      */
     virtual void
-    get_next_publish(uint8_t *data, uint8_t *data_len, uint16_t *topic_id, bool *retain,
+    get_next_publish(uint8_t *data, uint8_t *data_len, uint16_t *topic_id, bool *predefined_topic, bool *retain,
                      uint8_t *qos,
                      bool *dup, uint16_t *publish_id) =0;
 
     virtual void set_publish_msg_id(uint16_t publish_id, uint16_t msg_id)=0;
 
+    /**
+     * Gets the publish which was send with the given msg_id, the publish is not removed.
+     * @param msg_id the publish was send with
+     * @param data_len put in data len 0 if an error occured or no publish has the msg_id
+     * @param publish_id put in publish_id 0 if an error occured or no publish has the msg_id
+     */
+    virtual void
+    get_publish_by_msg_id(uint16_t msg_id, uint8_t *data, uint8_t *data_len, uint16_t *topic_id,
+                          bool *predefined_topic, bool *retain, uint8_t *qos, bool *dup, uint16_t *publish_id)=0;
+
+    /**
+     * Marks a publish as retransmitted.
+     * @param publish_id
+     * @param dup flag the publish is send with from now on
+     * @param retransmition_timeout timestamp in milliseconds of the next retransmission, 0 if none is scheduled
+     */
+    virtual void set_publish_retransmission(uint16_t publish_id, bool dup, uint32_t retransmition_timeout)=0;
+
     virtual void remove_publish_by_msg_id(uint16_t msg_id)=0;
 
     virtual void remove_publish_by_publish_id(uint16_t msg_id)=0;
 
+public: // spool, publishes to the broker buffered while the broker is offline
+
+    /**
+     * Appends a publish to the spool.
+     * If the spool is full, the configured drop policy decides: either the oldest publish is dropped
+     * or the new publish is rejected. The caller must not append to a full spool while its oldest publish
+     * is in flight, the drop policy does not know about it.
+     * @return true if the publish is spooled, false if it is rejected or spooling is disabled
+     */
+    virtual bool add_spool_publish(const char *topic_name, const uint8_t *data, uint8_t data_len, uint8_t qos,
+                                   bool retain) = 0;
+
+    /**
+     * Gets a publish of the spool without removing it.
+     * @param position in the spool, 0 is the oldest publish
+     * @param topic_name buffer with room for a maximum length topic name
+     * @param data buffer with room for 255 bytes
+     * @return false if the spool has no publish at the position
+     */
+    virtual bool get_spool_publish(uint16_t position, char *topic_name, uint8_t *data, uint8_t *data_len,
+                                   uint8_t *qos, bool *retain) = 0;
+
+    /**
+     * Removes the oldest publish of the spool, e.g. after the broker acknowledged it.
+     */
+    virtual void remove_next_spool_publish() = 0;
+
+    /**
+     * @return the number of spooled publishes
+     */
+    virtual uint16_t get_spool_count() = 0;
+
+    /**
+     * @return the maximum number of spooled publishes, 0 if spooling is disabled
+     */
+    virtual uint16_t get_spool_capacity() = 0;
+
 public: // gateway configuration
 
+    /**
+     * @return seconds between two ADVERTISE messages, T_ADV if not configured
+     */
     virtual uint16_t get_advertise_duration() = 0;
 
+    /**
+     * @return the number of subscribed topics differing in a single level, for which the gateway subscribes a
+     * covering filter at the broker instead, 0 if the aggregation is disabled
+     */
+    virtual uint16_t get_subscription_aggregation_threshold() = 0;
+
     virtual bool get_gateway_id(uint8_t *gateway_id) = 0;
 
     virtual bool get_mqtt_config(uint8_t *server_ip, uint16_t *server_port, char *client_id) =0;
@@ -0,0 +1,93 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <string.h>
+#include "RetainedMessageCache.h"
+
+RetainedMessageCache::RetainedMessageCache() {
+    memset(&entries, 0, sizeof(entries));
+}
+
+void RetainedMessageCache::update(const char *topic_name, const uint8_t *payload, uint32_t payload_length,
+                                  bool retain) {
+    if (!retain || payload_length == 0 || payload_length > RETAINED_MESSAGE_PAYLOAD_LENGTH ||
+        strlen(topic_name) > RETAINED_MESSAGE_TOPIC_LENGTH) {
+        // not retained, deleted or not cacheable: an older cached message is outdated now
+        remove(topic_name);
+        return;
+    }
+    uint32_t topic_hash = hash(topic_name);
+    int32_t position = find(topic_name, topic_hash);
+    if (position == -1) {
+        position = find_replaceable();
+        memset(&entries[position], 0, sizeof(retained_message));
+        entries[position].topic_hash = topic_hash;
+        strcpy(entries[position].topic_name, topic_name);
+        entries[position].used = true;
+    }
+    retained_message &entry = entries[position];
+    memcpy(entry.payload, payload, payload_length);
+    entry.payload_length = (uint8_t) payload_length;
+    entry.last_used = ++clock;
+}
+
+bool RetainedMessageCache::get(const char *topic_name, uint8_t *payload, uint8_t *payload_length) {
+    int32_t position = find(topic_name, hash(topic_name));
+    if (position == -1) {
+        return false;
+    }
+    retained_message &entry = entries[position];
+    memcpy(payload, entry.payload, entry.payload_length);
+    *payload_length = entry.payload_length;
+    entry.last_used = ++clock;
+    return true;
+}
+
+bool RetainedMessageCache::contains(const char *topic_name) {
+    return find(topic_name, hash(topic_name)) != -1;
+}
+
+void RetainedMessageCache::remove(const char *topic_name) {
+    int32_t position = find(topic_name, hash(topic_name));
+    if (position == -1) {
+        return;
+    }
+    memset(&entries[position], 0, sizeof(retained_message));
+}
+
+void RetainedMessageCache::clear() {
+    memset(&entries, 0, sizeof(entries));
+}
+
+uint32_t RetainedMessageCache::hash(const char *topic_name) {
+    // FNV-1a
+    uint32_t topic_hash = 2166136261u;
+    for (const char *c = topic_name; *c != '\0'; c++) {
+        topic_hash ^= (uint8_t) *c;
+        topic_hash *= 16777619u;
+    }
+    return topic_hash;
+}
+
+int32_t RetainedMessageCache::find(const char *topic_name, uint32_t topic_hash) {
+    for (uint16_t i = 0; i < RETAINED_MESSAGE_CACHE_CAPACITY; i++) {
+        if (entries[i].used && entries[i].topic_hash == topic_hash && strcmp(entries[i].topic_name, topic_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+uint16_t RetainedMessageCache::find_replaceable() {
+    uint16_t oldest = 0;
+    for (uint16_t i = 0; i < RETAINED_MESSAGE_CACHE_CAPACITY; i++) {
+        if (!entries[i].used) {
+            return i;
+        }
+        if (entries[i].last_used < entries[oldest].last_used) {
+            oldest = i;
+        }
+    }
+    return oldest;
+}
@@ -0,0 +1,80 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_RETAINEDMESSAGECACHE_H
+#define GATEWAY_RETAINEDMESSAGECACHE_H
+
+#include <stdint.h>
+
+#ifndef RETAINED_MESSAGE_CACHE_CAPACITY
+#define RETAINED_MESSAGE_CACHE_CAPACITY 32 // topics with a cached retained message
+#endif
+
+#define RETAINED_MESSAGE_TOPIC_LENGTH 255
+#define RETAINED_MESSAGE_PAYLOAD_LENGTH 255
+
+struct retained_message {
+    uint32_t topic_hash;
+    uint32_t last_used;
+    char topic_name[RETAINED_MESSAGE_TOPIC_LENGTH + 1];
+    uint8_t payload[RETAINED_MESSAGE_PAYLOAD_LENGTH];
+    uint8_t payload_length;
+    bool used;
+};
+
+/**
+ * In-memory cache of the retained messages the broker delivered to the gateway, keyed by topic name.
+ * Topic names are compared by their hash first, so a lookup only compares the strings of a matching entry.
+ * The broker sets the retain flag only for messages delivered because of a new subscription, later messages on an
+ * established subscription arrive without it even if they replaced the retained message. So any message without the
+ * retain flag invalidates the cached entry of its topic, the cache never serves a stale retained message.
+ * If the cache is full the least recently used entry is replaced.
+ */
+class RetainedMessageCache {
+private:
+    retained_message entries[RETAINED_MESSAGE_CACHE_CAPACITY];
+    uint32_t clock = 0;
+
+public:
+    RetainedMessageCache();
+
+    /**
+     * Updates the cache with a message received from the broker.
+     * A retained message with an empty payload deletes the retained message of the topic.
+     * @param retain flag of the received message
+     */
+    void update(const char *topic_name, const uint8_t *payload, uint32_t payload_length, bool retain);
+
+    /**
+     * Gets the retained message of the topic.
+     * @param payload buffer with at least RETAINED_MESSAGE_PAYLOAD_LENGTH bytes
+     * @return false if no retained message is cached for the topic
+     */
+    bool get(const char *topic_name, uint8_t *payload, uint8_t *payload_length);
+
+    /**
+     * @return true if a retained message is cached for the topic
+     */
+    bool contains(const char *topic_name);
+
+    /**
+     * Removes the retained message of the topic, e.g. because the gateway unsubscribed from it.
+     */
+    void remove(const char *topic_name);
+
+    /**
+     * Removes all retained messages, e.g. because the connection to the broker was lost.
+     */
+    void clear();
+
+private:
+    static uint32_t hash(const char *topic_name);
+
+    int32_t find(const char *topic_name, uint32_t topic_hash);
+
+    uint16_t find_replaceable();
+};
+
+
+#endif //GATEWAY_RETAINEDMESSAGECACHE_H
@@ -0,0 +1,151 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <string.h>
+#include "RetransmissionScheduler.h"
+
+bool RetransmissionScheduler::schedule(device_address *address, uint16_t msg_id, uint16_t topic_id,
+                                       message_type type, uint32_t timestamp) {
+    cancel(address);
+    retransmission_entry entry;
+    memset(&entry, 0, sizeof(retransmission_entry));
+    memcpy(&entry.address, address, sizeof(device_address));
+    entry.msg_id = msg_id;
+    entry.topic_id = topic_id;
+    entry.type = type;
+    entry.retries = 0;
+    entry.deadline = get_deadline(timestamp, 0);
+    return push(&entry);
+}
+
+bool RetransmissionScheduler::reschedule(retransmission_entry *entry, uint32_t timestamp) {
+    entry->retries++;
+    entry->deadline = get_deadline(timestamp, entry->retries);
+    return push(entry);
+}
+
+bool RetransmissionScheduler::cancel(device_address *address, uint16_t msg_id, message_type type) {
+    int32_t position = find(address);
+    if (position == -1) {
+        return false;
+    }
+    if (heap[position].msg_id != msg_id || heap[position].type != type) {
+        return false;
+    }
+    remove_at((uint16_t) position);
+    return true;
+}
+
+bool RetransmissionScheduler::cancel(device_address *address) {
+    int32_t position = find(address);
+    if (position == -1) {
+        return false;
+    }
+    remove_at((uint16_t) position);
+    return true;
+}
+
+bool RetransmissionScheduler::pop_due(uint32_t timestamp, retransmission_entry *entry) {
+    if (size == 0) {
+        return false;
+    }
+    if (is_earlier(timestamp, heap[0].deadline)) {
+        return false;
+    }
+    memcpy(entry, &heap[0], sizeof(retransmission_entry));
+    remove_at(0);
+    return true;
+}
+
+bool RetransmissionScheduler::get_next_deadline(uint32_t *deadline) {
+    if (size == 0) {
+        return false;
+    }
+    *deadline = heap[0].deadline;
+    return true;
+}
+
+uint16_t RetransmissionScheduler::get_size() {
+    return size;
+}
+
+bool RetransmissionScheduler::has_room(device_address *address) {
+    return size < RETRANSMISSION_SCHEDULER_CAPACITY || find(address) != -1;
+}
+
+uint32_t RetransmissionScheduler::get_deadline(uint32_t timestamp, uint8_t retries) {
+    // exponential backoff: T_RETRY, 2*T_RETRY, 4*T_RETRY, ...
+    return timestamp + ((((uint32_t) T_RETRY) * 1000) << retries);
+}
+
+bool RetransmissionScheduler::is_earlier(uint32_t a, uint32_t b) {
+    // millisecond timestamps overflow, so only the difference is meaningful
+    return (int32_t) (a - b) < 0;
+}
+
+bool RetransmissionScheduler::push(retransmission_entry *entry) {
+    if (size >= RETRANSMISSION_SCHEDULER_CAPACITY) {
+        return false;
+    }
+    memcpy(&heap[size], entry, sizeof(retransmission_entry));
+    sift_up(size);
+    size++;
+    return true;
+}
+
+void RetransmissionScheduler::remove_at(uint16_t position) {
+    size--;
+    if (position == size) {
+        return;
+    }
+    memcpy(&heap[position], &heap[size], sizeof(retransmission_entry));
+    sift_down(position);
+    sift_up(position);
+}
+
+void RetransmissionScheduler::sift_up(uint16_t position) {
+    while (position > 0) {
+        uint16_t parent = (uint16_t) ((position - 1) / 2);
+        if (!is_earlier(heap[position].deadline, heap[parent].deadline)) {
+            return;
+        }
+        swap(position, parent);
+        position = parent;
+    }
+}
+
+void RetransmissionScheduler::sift_down(uint16_t position) {
+    while (true) {
+        uint16_t left = (uint16_t) (2 * position + 1);
+        uint16_t right = (uint16_t) (2 * position + 2);
+        uint16_t earliest = position;
+        if (left < size && is_earlier(heap[left].deadline, heap[earliest].deadline)) {
+            earliest = left;
+        }
+        if (right < size && is_earlier(heap[right].deadline, heap[earliest].deadline)) {
+            earliest = right;
+        }
+        if (earliest == position) {
+            return;
+        }
+        swap(position, earliest);
+        position = earliest;
+    }
+}
+
+void RetransmissionScheduler::swap(uint16_t a, uint16_t b) {
+    retransmission_entry tmp;
+    memcpy(&tmp, &heap[a], sizeof(retransmission_entry));
+    memcpy(&heap[a], &heap[b], sizeof(retransmission_entry));
+    memcpy(&heap[b], &tmp, sizeof(retransmission_entry));
+}
+
+int32_t RetransmissionScheduler::find(device_address *address) {
+    for (uint16_t i = 0; i < size; i++) {
+        if (memcmp(&heap[i].address, address, sizeof(device_address)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
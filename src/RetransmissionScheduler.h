@@ -0,0 +1,123 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_RETRANSMISSIONSCHEDULER_H
+#define GATEWAY_RETRANSMISSIONSCHEDULER_H
+
+#include <stdint.h>
+#include "global_defines.h"
+#include "mqttsn_messages.h"
+
+#ifndef RETRANSMISSION_SCHEDULER_CAPACITY
+#define RETRANSMISSION_SCHEDULER_CAPACITY 64 // clients with a message in flight, the others wait until an entry is free
+#endif
+
+struct retransmission_entry {
+    uint32_t deadline;
+    device_address address;
+    uint16_t msg_id;
+    uint16_t topic_id;
+    message_type type;
+    uint8_t retries;
+};
+
+/**
+ * Keeps track of the messages the gateway sent to its clients and which still await an acknowledge (PUBACK, REGACK).
+ * Entries are kept in a binary min-heap ordered by their deadline, so the next due retransmission is found without
+ * scanning the clients. There is always only one message in flight per client, so an entry is replaced if the
+ * same client is scheduled again.
+ *
+ * Usage:
+ *  schedule(...) after a message is sent
+ *  cancel(...) when the acknowledge arrives
+ *  pop_due(...) regularly, resend the popped message and reschedule(...) it or give up after N_RETRY retries
+ */
+class RetransmissionScheduler {
+private:
+    retransmission_entry heap[RETRANSMISSION_SCHEDULER_CAPACITY];
+    uint16_t size = 0;
+
+public:
+
+    /**
+     * Adds a message awaiting an acknowledge, it is due T_RETRY seconds after timestamp.
+     * An already scheduled message for the same address is replaced.
+     * @param address of the client
+     * @param msg_id of the send message
+     * @param topic_id of the send message
+     * @param type of the send message (MQTTSN_PUBLISH or MQTTSN_REGISTER)
+     * @param timestamp in milliseconds when the message was send
+     * @return false if no more space is available, true otherwise
+     */
+    bool schedule(device_address *address, uint16_t msg_id, uint16_t topic_id, message_type type, uint32_t timestamp);
+
+    /**
+     * Reinserts a popped entry with an increased retry count and exponential backoff.
+     * @param entry which was popped by pop_due
+     * @param timestamp in milliseconds when the message was resend
+     * @return false if no more space is available, true otherwise
+     */
+    bool reschedule(retransmission_entry *entry, uint32_t timestamp);
+
+    /**
+     * Removes the scheduled message with the given msg_id and type for the address.
+     * @return true if a message was removed, false otherwise
+     */
+    bool cancel(device_address *address, uint16_t msg_id, message_type type);
+
+    /**
+     * Removes any scheduled message for the address.
+     * @return true if a message was removed, false otherwise
+     */
+    bool cancel(device_address *address);
+
+    /**
+     * Removes the entry with the earliest deadline if it is due.
+     * @param timestamp current time in milliseconds
+     * @param entry filled with the removed entry
+     * @return true if an entry was due and removed, false otherwise
+     */
+    bool pop_due(uint32_t timestamp, retransmission_entry *entry);
+
+    /**
+     * Gets the earliest deadline, e.g. to sleep until the next retransmission is due.
+     * @return false if no message is scheduled
+     */
+    bool get_next_deadline(uint32_t *deadline);
+
+    uint16_t get_size();
+
+    /**
+     * @return true if a message for the address can be scheduled, because there is space or the address already
+     * has an entry which is replaced
+     */
+    bool has_room(device_address *address);
+
+    /**
+     * Calculates when a message is due, starting with T_RETRY seconds and doubled with each retry.
+     * @param timestamp in milliseconds when the message was send
+     * @param retries how often the message was already retransmitted
+     * @return the deadline in milliseconds
+     */
+    static uint32_t get_deadline(uint32_t timestamp, uint8_t retries);
+
+private:
+
+    static bool is_earlier(uint32_t a, uint32_t b);
+
+    bool push(retransmission_entry *entry);
+
+    void remove_at(uint16_t position);
+
+    void sift_up(uint16_t position);
+
+    void sift_down(uint16_t position);
+
+    void swap(uint16_t a, uint16_t b);
+
+    int32_t find(device_address *address);
+};
+
+
+#endif //GATEWAY_RETRANSMISSIONSCHEDULER_H
@@ -4,3 +4,17 @@
 
 #include "SocketInterface.h"
 
+bool SocketInterface::send(device_address *destination, uint8_t *header, uint16_t header_len, const uint8_t *payload,
+                           uint16_t payload_len) {
+    uint8_t buffer[UINT8_MAX + 1];
+    if (header_len > sizeof(buffer)) {
+        return send(destination, header, header_len);
+    }
+    if (header_len + payload_len > sizeof(buffer)) {
+        payload_len = (uint16_t) (sizeof(buffer) - header_len);
+    }
+    memcpy(buffer, header, header_len);
+    memcpy(&buffer[header_len], payload, payload_len);
+    return send(destination, buffer, (uint16_t) (header_len + payload_len));
+}
+
@@ -88,6 +88,21 @@ public:
      */
     virtual bool send(device_address* destination, uint8_t* bytes, uint16_t bytes_len, uint8_t signal_strength) = 0;
 
+    /**
+     * Sends a single message put together from a header and a payload, without copying the payload first.
+     * Implementation Note:
+     * - Network stacks with scatter-gather support (e.g. sendmsg) shall override it.
+     *   The default implementation puts both parts into one buffer and calls send.
+     * @param destination is the abstract destination address to send the message
+     * @param header is the pointer to the header bytes of the message
+     * @param header_len is the length of the header
+     * @param payload is the pointer to the payload bytes following the header
+     * @param payload_len is the length of the payload, header_len + payload_len maximum is 256
+     * @return true if the connection to the network still exist.
+     */
+    virtual bool send(device_address* destination, uint8_t* header, uint16_t header_len, const uint8_t* payload,
+                      uint16_t payload_len);
+
     virtual bool loop() = 0;
 
 };
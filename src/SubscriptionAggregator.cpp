@@ -0,0 +1,194 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <string.h>
+#include "SubscriptionAggregator.h"
+
+SubscriptionAggregator::SubscriptionAggregator() {
+    memset(&filters, 0, sizeof(filters));
+}
+
+void SubscriptionAggregator::set_threshold(uint16_t threshold) {
+    this->threshold = threshold;
+}
+
+uint16_t SubscriptionAggregator::get_threshold() {
+    return threshold;
+}
+
+bool SubscriptionAggregator::is_enabled() {
+    // a filter covering a single topic saves nothing
+    return threshold > 1;
+}
+
+bool SubscriptionAggregator::has_room() {
+    for (uint16_t i = 0; i < SUBSCRIPTION_AGGREGATOR_CAPACITY; i++) {
+        if (!filters[i].used) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SubscriptionAggregator::overlaps(const char *filter) {
+    for (uint16_t i = 0; i < SUBSCRIPTION_AGGREGATOR_CAPACITY; i++) {
+        if (filters[i].used && overlap(filters[i].filter, filter)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SubscriptionAggregator::add(const char *filter, uint16_t topic_count) {
+    if (strlen(filter) > SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH) {
+        return false;
+    }
+    for (uint16_t i = 0; i < SUBSCRIPTION_AGGREGATOR_CAPACITY; i++) {
+        if (!filters[i].used) {
+            strcpy(filters[i].filter, filter);
+            filters[i].topic_count = topic_count;
+            filters[i].used = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SubscriptionAggregator::is_covered(const char *topic_name) {
+    return find_covering(topic_name) != -1;
+}
+
+bool SubscriptionAggregator::cover(const char *topic_name) {
+    int32_t position = find_covering(topic_name);
+    if (position == -1) {
+        return false;
+    }
+    filters[position].topic_count++;
+    return true;
+}
+
+bool SubscriptionAggregator::uncover(const char *topic_name, char *released_filter) {
+    released_filter[0] = 0;
+    int32_t position = find_covering(topic_name);
+    if (position == -1) {
+        return false;
+    }
+    aggregated_filter &entry = filters[position];
+    if (entry.topic_count > 0) {
+        entry.topic_count--;
+    }
+    if (entry.topic_count == 0) {
+        strcpy(released_filter, entry.filter);
+        memset(&entry, 0, sizeof(aggregated_filter));
+    }
+    return true;
+}
+
+uint16_t SubscriptionAggregator::get_count() {
+    uint16_t count = 0;
+    for (uint16_t i = 0; i < SUBSCRIPTION_AGGREGATOR_CAPACITY; i++) {
+        if (filters[i].used) {
+            count++;
+        }
+    }
+    return count;
+}
+
+const char *SubscriptionAggregator::get_filter(uint16_t index) {
+    if (index >= SUBSCRIPTION_AGGREGATOR_CAPACITY || !filters[index].used) {
+        return nullptr;
+    }
+    return filters[index].filter;
+}
+
+bool SubscriptionAggregator::get_candidate(const char *topic_name, uint8_t level, char *filter) {
+    if (has_wildcards(topic_name)) {
+        return false;
+    }
+    const char *level_start = topic_name;
+    for (uint8_t i = 0; i < level; i++) {
+        level_start = strchr(level_start, '/');
+        if (level_start == nullptr) {
+            return false;
+        }
+        level_start++;
+    }
+    const char *level_end = strchr(level_start, '/');
+    if (level_end == nullptr) {
+        level_end = level_start + strlen(level_start);
+    }
+    size_t prefix_length = (size_t) (level_start - topic_name);
+    size_t suffix_length = strlen(level_end);
+    if (prefix_length + 1 + suffix_length > SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH) {
+        return false;
+    }
+    memcpy(filter, topic_name, prefix_length);
+    filter[prefix_length] = '+';
+    memcpy(&filter[prefix_length + 1], level_end, suffix_length + 1);
+    return true;
+}
+
+bool SubscriptionAggregator::matches(const char *filter, const char *topic_name) {
+    if (has_wildcards(topic_name)) {
+        // a '+' of the subscribed name would be compared as a literal level
+        return false;
+    }
+    while (*filter != 0 && *topic_name != 0) {
+        if (*filter == '+') {
+            // the wildcard consumes the whole level of the topic name
+            while (*topic_name != 0 && *topic_name != '/') {
+                topic_name++;
+            }
+            filter++;
+            continue;
+        }
+        if (*filter != *topic_name) {
+            return false;
+        }
+        filter++;
+        topic_name++;
+    }
+    if (*filter == '+' && *topic_name == 0) {
+        // an empty last level matches too
+        filter++;
+    }
+    return *filter == 0 && *topic_name == 0;
+}
+
+bool SubscriptionAggregator::has_wildcards(const char *topic_name) {
+    return strchr(topic_name, '+') != nullptr || strchr(topic_name, '#') != nullptr;
+}
+
+int32_t SubscriptionAggregator::find_covering(const char *topic_name) {
+    if (has_wildcards(topic_name)) {
+        // subscriptions with wildcards are always subscribed on their own
+        return -1;
+    }
+    for (uint16_t i = 0; i < SUBSCRIPTION_AGGREGATOR_CAPACITY; i++) {
+        if (filters[i].used && matches(filters[i].filter, topic_name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool SubscriptionAggregator::overlap(const char *filter, const char *other_filter) {
+    while (true) {
+        const char *level_end = strchr(filter, '/');
+        const char *other_level_end = strchr(other_filter, '/');
+        size_t level_length = level_end == nullptr ? strlen(filter) : (size_t) (level_end - filter);
+        size_t other_level_length =
+                other_level_end == nullptr ? strlen(other_filter) : (size_t) (other_level_end - other_filter);
+        bool wildcard = (level_length == 1 && *filter == '+') || (other_level_length == 1 && *other_filter == '+');
+        if (!wildcard && (level_length != other_level_length || memcmp(filter, other_filter, level_length) != 0)) {
+            return false;
+        }
+        if (level_end == nullptr || other_level_end == nullptr) {
+            // both filters need the same number of levels
+            return level_end == nullptr && other_level_end == nullptr;
+        }
+        filter = level_end + 1;
+        other_filter = other_level_end + 1;
+    }
+}
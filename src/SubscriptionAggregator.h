@@ -0,0 +1,127 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#ifndef GATEWAY_SUBSCRIPTIONAGGREGATOR_H
+#define GATEWAY_SUBSCRIPTIONAGGREGATOR_H
+
+#include <stdint.h>
+
+#ifndef SUBSCRIPTION_AGGREGATOR_CAPACITY
+#define SUBSCRIPTION_AGGREGATOR_CAPACITY 16 // covering filters subscribed at the broker at the same time
+#endif
+
+#ifndef SUBSCRIPTION_AGGREGATOR_MAXIMUM_LEVELS
+#define SUBSCRIPTION_AGGREGATOR_MAXIMUM_LEVELS 8 // topic levels a covering filter may replace by a '+'
+#endif
+
+#define SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH 255
+
+struct aggregated_filter {
+    char filter[SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1];
+    uint16_t topic_count;
+    bool used;
+};
+
+/**
+ * Bookkeeping of the covering filters the gateway subscribed at the broker instead of single topics.
+ * A covering filter replaces exactly one level of the topic names it covers by a '+', e.g. site/+/cmd covers
+ * site/1/cmd and site/2/cmd. Each subscribed topic is covered by at most one filter, the filter counts the
+ * topics it covers and is unsubscribed with the last of them.
+ * The broker delivers all messages matching the filter, the core only forwards messages of topics having
+ * subscribers, so the routing to the clients stays exact.
+ */
+class SubscriptionAggregator {
+private:
+    aggregated_filter filters[SUBSCRIPTION_AGGREGATOR_CAPACITY];
+    uint16_t threshold = 0;
+
+public:
+    SubscriptionAggregator();
+
+    /**
+     * @param threshold number of topics a covering filter is subscribed for, 0 disables the aggregation
+     */
+    void set_threshold(uint16_t threshold);
+
+    uint16_t get_threshold();
+
+    bool is_enabled();
+
+    /**
+     * @return true if another covering filter can be added
+     */
+    bool has_room();
+
+    /**
+     * @return true if a topic could match both the filter and one of the covering filters
+     */
+    bool overlaps(const char *filter);
+
+    /**
+     * Adds a covering filter subscribed at the broker.
+     * The filter must not overlap another covering filter, so each topic is counted by a single filter.
+     * @param topic_count number of subscribed topics the filter covers
+     * @return false if the aggregator is full
+     */
+    bool add(const char *filter, uint16_t topic_count);
+
+    /**
+     * @return true if the topic is covered by a filter
+     */
+    bool is_covered(const char *topic_name);
+
+    /**
+     * Counts a newly subscribed topic for the filter covering it.
+     * @return false if no filter covers the topic, it has to be subscribed at the broker
+     */
+    bool cover(const char *topic_name);
+
+    /**
+     * Uncounts an unsubscribed topic from the filter covering it.
+     * If it was the last topic of the filter, the filter is removed and copied into released_filter.
+     * @param released_filter buffer with at least SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1 bytes, set to an empty
+     * string if the filter still covers other topics
+     * @return false if no filter covers the topic, it has to be unsubscribed at the broker
+     */
+    bool uncover(const char *topic_name, char *released_filter);
+
+    /**
+     * @return the number of covering filters
+     */
+    uint16_t get_count();
+
+    /**
+     * @param index of the filter, less than SUBSCRIPTION_AGGREGATOR_CAPACITY
+     * @return the covering filter at the index or nullptr if the slot is unused
+     */
+    const char *get_filter(uint16_t index);
+
+    /**
+     * Builds the covering filter of a topic name by replacing a single level with a '+'.
+     * @param level index of the replaced level, starting at 0
+     * @param filter buffer with at least SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1 bytes
+     * @return false if the topic has no such level or already contains wildcards
+     */
+    static bool get_candidate(const char *topic_name, uint8_t level, char *filter);
+
+    /**
+     * A subscribed filter never matches, e.g. a client subscription to exactly a/+/c is not covered by a/+/c,
+     * it stays subscribed on its own.
+     * @return true if the topic name matches the filter, only the single level wildcard '+' is supported
+     */
+    static bool matches(const char *filter, const char *topic_name);
+
+    /**
+     * @return true if the subscribed name contains '+' or '#', so it is a filter and no topic name
+     */
+    static bool has_wildcards(const char *topic_name);
+
+private:
+    int32_t find_covering(const char *topic_name);
+
+    static bool overlap(const char *filter, const char *other_filter);
+};
+
+
+#endif //GATEWAY_SUBSCRIPTIONAGGREGATOR_H
@@ -11,6 +11,7 @@ enum CORE_RESULT : int16_t {
     FULL = -4,
     MOREPUBLISHESAVAILABLE = -5,
     TOOMUCHDATA = -6,
+    PUBACKPENDING = -7, // the core sends the PUBACK to the client itself, when the broker acknowledged
 };
 
 
@@ -1,10 +1,13 @@
 
 #include <paho/PahoMqttMessageHandler.h>
+#include <paho/PahoMqttConnectionPool.h>
 #include <UdpSocketImpl.h>
 #include "Gateway.h"
 #include "Implementation/SDPersistentImpl.h"
 #include "Implementation/ArduinoLogger.h"
 #include "Implementation/ArduinoSystem.h"
+#include "Implementation/ShardedGateway.h"
+#include "Implementation/EpollReactor.h"
 
 
 Gateway gateway;
@@ -12,9 +15,14 @@ UdpSocketImpl udpSocket;
 SDPersistentImpl persistent;
 
 PahoMqttMessageHandler mqtt;
+PahoMqttConnectionPool mqttPool;
+MqttMessageHandlerInterface *mqttInterface = &mqtt;
 ArduinoLogger logger;
 ArduinoSystem systemImpl;
 
+ShardedGateway shardedGateway;
+EpollReactor reactor;
+
 std::string getexepath()
 {
     char result[ PATH_MAX ];
@@ -24,7 +32,6 @@ std::string getexepath()
 
 // TODOS:
 // implement message saving
-// implement resubscribing on startup
 
 void setup() {
     logger.start_log("Linux MQTT-SN Gateway version 0.0.1a starting", 1);
@@ -32,7 +39,7 @@ void setup() {
 
     gateway.setLoggerInterface(&logger);
     gateway.setSocketInterface(&udpSocket);
-    gateway.setMqttInterface(&mqtt);
+    gateway.setMqttInterface(mqttInterface);
     gateway.setPersistentInterface(&persistent);
     gateway.setSystemInterface(&systemImpl);
 
@@ -47,8 +54,71 @@ void setup() {
 int main(int argc, char* argv[]) {
     std::string workingDir = getexepath() + "/../DB";
     workingDir = "/home/bele/git/arduino-mqtt-sn-gateway/cmake-build-debug/DB";
+
+    // --shards N spreads the clients over N threads
+    // --pipeline receives datagrams and broker publishes in separate threads
+    // --reactor waits with epoll on the UDP socket and the broker connection instead of polling them
+    // --connections N spreads publishes and subscriptions over N broker connections by topic
+    uint8_t shard_count = 0;
+    bool use_reactor = false;
+    bool use_connections = false;
+    bool use_pipeline = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shard_count = (uint8_t) atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            use_pipeline = true;
+            udpSocket.setIngressThread(true);
+            mqtt.setBrokerThread(true);
+        } else if (strcmp(argv[i], "--reactor") == 0) {
+            use_reactor = true;
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            use_connections = true;
+            uint8_t connection_count = (uint8_t) atoi(argv[i + 1]);
+            if (connection_count > 1 && mqttPool.setConnectionCount(connection_count)) {
+                mqttInterface = &mqttPool;
+            }
+        }
+    }
+    if (use_reactor && use_pipeline) {
+        // the reactor waits on the sockets the ingress and broker threads read
+        logger.log("Error starting gateway, --reactor cannot be combined with --pipeline", 0);
+        return 1;
+    }
+    if (shard_count > 0 && (use_reactor || use_pipeline)) {
+        // the router thread owns the UDP socket and each shard reads its own broker connection in its loop
+        logger.log("Error starting gateway, --shards cannot be combined with --reactor or --pipeline", 0);
+        return 1;
+    }
+    if (shard_count > 0) {
+        logger.log("Linux MQTT-SN Gateway version 0.0.1a starting sharded", 1);
+        if (use_connections) {
+            logger.log("Broker connection pool not used, each shard has its own broker connection", 1);
+        }
+        shardedGateway.setLogger(&logger);
+        if (!shardedGateway.begin(workingDir.c_str(), shard_count)) {
+            logger.log("Error starting sharded gateway", 0);
+            systemImpl.exit();
+        }
+        while (true) {
+            shardedGateway.loop();
+        }
+    }
+
     persistent.setRootPath((char *) workingDir.c_str());
     setup();
+    if (use_reactor && mqttInterface != &mqtt) {
+        logger.log("Reactor not started, it supports a single broker connection only", 1);
+    }
+    if (use_reactor && mqttInterface == &mqtt) {
+        if (!reactor.begin(&gateway, &udpSocket, &mqtt)) {
+            logger.log("Error starting reactor", 0);
+            systemImpl.exit();
+        }
+        while (reactor.loop()) {
+        }
+        systemImpl.exit();
+    }
     while(true){
         gateway.loop();
     }
@@ -108,11 +108,31 @@ struct message_header {
 #pragma pack(pop)
 #endif
 
+/**
+ * 16 bit field of a message in network byte order (big-endian), as the MQTT-SN specification requires.
+ * Two single bytes, so the messages have the wire layout without padding.
+ * It converts from and to uint16_t, so the fields are read and written like host order integers.
+ */
+struct uint16_be {
+    uint8_t msb;
+    uint8_t lsb;
+
+    uint16_be() = default;
+
+    uint16_be(uint16_t value) : msb((uint8_t) (value >> 8)), lsb((uint8_t) (value & 0xFF)) {
+    }
+
+    operator uint16_t() const {
+        return (uint16_t) ((msb << 8) | lsb);
+    }
+};
+static_assert(sizeof(uint16_be) == 2, "a 16 bit field has 2 bytes");
+
 #pragma pack(push, 1)
 
 struct msg_advertise : public message_header {
     uint8_t gw_id;
-    uint16_t duration;
+    uint16_be duration;
 
     msg_advertise(uint8_t gw_id, uint16_t duration) : gw_id(gw_id), duration(duration) {
         length = 5;
@@ -145,7 +165,7 @@ struct msg_gwinfo : public message_header {
 struct msg_connect : public message_header {
     uint8_t flags;
     uint8_t protocol_id;
-    uint16_t duration;
+    uint16_be duration;
     char client_id[24];
 
     msg_connect(bool will, bool clean_session, uint8_t protocol_id, uint16_t duration,  const char *client_id){
@@ -227,8 +247,8 @@ struct msg_willmsgreq : public message_header {
 */
 
 struct msg_register : public message_header {
-    uint16_t topic_id;
-    uint16_t message_id;
+    uint16_be topic_id;
+    uint16_be message_id;
     char topic_name[UINT8_MAX - 6];
 
     msg_register(uint16_t topic_id, uint16_t message_id, const char *topic_name) :
@@ -240,8 +260,8 @@ struct msg_register : public message_header {
 };
 
 struct msg_regack : public message_header {
-    uint16_t topic_id;
-    uint16_t message_id;
+    uint16_be topic_id;
+    uint16_be message_id;
     return_code_t return_code;
 
     msg_regack(uint16_t topic_id, uint16_t message_id, return_code_t return_code) :
@@ -253,8 +273,8 @@ struct msg_regack : public message_header {
 
 struct msg_publish : public message_header {
     uint8_t flags;
-    uint16_t topic_id;
-    uint16_t message_id;
+    uint16_be topic_id;
+    uint16_be message_id;
     uint8_t data[UINT8_MAX - 7];
 
     msg_publish(bool dup, int8_t qos, bool retain, bool short_topic, uint16_t topic_id, uint16_t msg_id,
@@ -262,46 +282,57 @@ struct msg_publish : public message_header {
         memset(this, 0, sizeof(this));
         this->length = ((uint8_t) 7) + s_data_len;
         this->type = MQTTSN_PUBLISH;
-        this->flags = 0x0;
+        this->flags = get_flags(dup, qos, retain, short_topic);
+        this->topic_id = topic_id;
+        this->message_id = msg_id;
+        memcpy(this->data, s_data, s_data_len);
+    }
+
+    static uint8_t get_flags(bool dup, int8_t qos, bool retain, bool short_topic) {
+        uint8_t flags = 0x0;
         if (dup) {
-            this->flags |= FLAG_DUP;
+            flags |= FLAG_DUP;
         }
         if (retain) {
-            this->flags |= FLAG_RETAIN;
+            flags |= FLAG_RETAIN;
         }
         if (short_topic) {
-            this->flags |= FLAG_TOPIC_SHORT_NAME;
+            flags |= FLAG_TOPIC_SHORT_NAME;
         } else {
-            this->flags |= FLAG_TOPIC_PREDEFINED_ID;
+            flags |= FLAG_TOPIC_PREDEFINED_ID;
         }
         if (qos == 0) {
-            this->flags |= FLAG_QOS_0;
+            flags |= FLAG_QOS_0;
         } else if (qos == 1) {
-            this->flags |= FLAG_QOS_1;
+            flags |= FLAG_QOS_1;
         } else if (qos == 2) {
-            this->flags |= FLAG_QOS_2;
+            flags |= FLAG_QOS_2;
         } else if (qos == -1) {
-            this->flags |= FLAG_QOS_M1;
+            flags |= FLAG_QOS_M1;
         }
-        this->topic_id = topic_id;
-        this->message_id = msg_id;
-        memcpy(this->data, s_data, s_data_len);
+        return flags;
     }
 };
 
+// only the header, the payload is send from where it is
 struct msg_publish_send : public message_header {
     uint8_t flags;
-    uint8_t topic_id_msb;
-    uint8_t topic_id_lsb;
-    uint8_t message_id_msb;
-    uint8_t message_id_lsb;
-    uint8_t data[0];
+    uint16_be topic_id;
+    uint16_be message_id;
+
+    msg_publish_send(bool dup, int8_t qos, bool retain, bool short_topic, uint16_t topic_id, uint16_t msg_id,
+                     uint8_t data_len) : topic_id(topic_id), message_id(msg_id) {
+        this->length = ((uint8_t) 7) + data_len;
+        this->type = MQTTSN_PUBLISH;
+        this->flags = msg_publish::get_flags(dup, qos, retain, short_topic);
+    }
 };
+static_assert(sizeof(msg_publish_send) == 7, "the PUBLISH header has 7 bytes");
 
 
 struct msg_puback : public message_header {
-    uint16_t topic_id;
-    uint16_t message_id;
+    uint16_be topic_id;
+    uint16_be message_id;
     return_code_t return_code;
 
 
@@ -311,10 +342,11 @@ struct msg_puback : public message_header {
         type = MQTTSN_PUBACK;
     }
 };
+static_assert(sizeof(msg_puback) == 7, "the PUBACK has 7 bytes");
 
 
 struct msg_pubqos2 : public message_header {
-    uint16_t message_id;
+    uint16_be message_id;
 };
 
 struct msg_subscribe : public message_header {
@@ -323,8 +355,8 @@ struct msg_subscribe : public message_header {
 
 
 struct msg_subscribe_shorttopic : public msg_subscribe {
-    uint16_t message_id;
-    uint16_t topic_id;
+    uint16_be message_id;
+    uint16_be topic_id;
 
     msg_subscribe_shorttopic(bool short_topic, uint16_t topic_id, uint16_t msg_id, uint8_t qos, bool dup) {
         memset(this, 0, sizeof(this));
@@ -355,7 +387,7 @@ struct msg_subscribe_shorttopic : public msg_subscribe {
 
 
 struct msg_subscribe_topicname : public msg_subscribe {
-    uint16_t message_id;
+    uint16_be message_id;
     char topic_name[250];
 
     msg_subscribe_topicname(const char *topic_name, uint16_t msg_id, uint8_t qos, bool dup) {
@@ -379,8 +411,8 @@ struct msg_subscribe_topicname : public msg_subscribe {
 
 struct msg_suback : public message_header {
     uint8_t flags;
-    uint16_t topic_id;
-    uint16_t message_id;
+    uint16_be topic_id;
+    uint16_be message_id;
     return_code_t return_code;
 
     msg_suback(uint8_t qos, uint16_t topic_id, uint16_t msg_id, return_code_t return_code) {
@@ -399,27 +431,26 @@ struct msg_suback : public message_header {
         this->return_code = return_code;
     }
 };
+static_assert(sizeof(msg_suback) == 8, "the SUBACK has 8 bytes");
 
 struct msg_unsubscribe : public message_header {
     uint8_t flags;
-    uint16_t message_id;
+    uint16_be message_id;
     union {
         char topic_name[0];
-        uint16_t topic_id;
+        uint16_be topic_id;
     };
 };
 
 struct msg_unsubscribe_send : public message_header {
     uint8_t flags;
-    uint8_t message_id_msb;
-    uint8_t message_id_lsb;
-    uint8_t topic_id_msb;
-    uint8_t topic_id_lsb;
+    uint16_be message_id;
+    uint16_be topic_id;
 };
 
 
 struct msg_unsuback : public message_header {
-    uint16_t message_id;
+    uint16_be message_id;
 
     msg_unsuback(uint16_t msg_id) : message_id(msg_id) {
         length = 4;
@@ -443,7 +474,7 @@ struct msg_pingreq : public message_header {
 };
 
 struct msg_disconnect : public message_header {
-    uint16_t duration;
+    uint16_be duration;
 };
 
 struct msg_willtopicresp : public message_header {
@@ -455,7 +486,7 @@ struct msg_willmsgresp : public message_header {
 };
 
 struct msg_pubrec : public message_header {
-    uint16_t message_id;
+    uint16_be message_id;
 
     msg_pubrec(uint16_t msg_id) : message_id(msg_id) {
         length = 4;
@@ -464,7 +495,7 @@ struct msg_pubrec : public message_header {
 };
 
 struct msg_pubrel : public message_header {
-    uint16_t message_id;
+    uint16_be message_id;
 
     msg_pubrel(uint16_t msg_id) : message_id(msg_id) {
         length = 4;
@@ -473,7 +504,7 @@ struct msg_pubrel : public message_header {
 };
 
 struct msg_pubcomp : public message_header {
-    uint16_t message_id;
+    uint16_be message_id;
 
     msg_pubcomp(uint16_t msg_id) : message_id(msg_id) {
         length = 4;
@@ -0,0 +1,90 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <cstdio>
+#include "../src/mqttsn_messages.h"
+
+static int failures = 0;
+
+#define EXPECT_EQUAL(expected, actual) \
+    if ((expected) != (actual)) { \
+        printf("%s:%d: expected %d, got %d\n", __FILE__, __LINE__, (int) (expected), (int) (actual)); \
+        failures++; \
+    }
+
+/**
+ * The gateway sends a PUBLISH to a client, the client echoes topic id and message id in its PUBACK.
+ * The gateway has to read back the ids it sent, or the retransmission entry of the PUBLISH is never matched.
+ */
+static void test_publish_puback_round_trip() {
+    uint8_t payload[] = {'o', 'n'};
+    msg_publish_send publish(false, 1, false, true, 0x0102, 0x0A0B, sizeof(payload));
+    uint8_t *publish_bytes = (uint8_t *) &publish;
+    EXPECT_EQUAL(7, sizeof(publish));
+    EXPECT_EQUAL(9, publish_bytes[0]);
+    EXPECT_EQUAL(MQTTSN_PUBLISH, publish_bytes[1]);
+    EXPECT_EQUAL(FLAG_QOS_1 | FLAG_TOPIC_SHORT_NAME, publish_bytes[2]);
+    EXPECT_EQUAL(0x01, publish_bytes[3]);
+    EXPECT_EQUAL(0x02, publish_bytes[4]);
+    EXPECT_EQUAL(0x0A, publish_bytes[5]);
+    EXPECT_EQUAL(0x0B, publish_bytes[6]);
+
+    // the client answers with the ids as it read them from the wire
+    uint8_t puback_bytes[] = {7, MQTTSN_PUBACK, publish_bytes[3], publish_bytes[4], publish_bytes[5],
+                              publish_bytes[6], ACCEPTED};
+    msg_puback *puback = (msg_puback *) puback_bytes;
+    EXPECT_EQUAL(0x0102, (uint16_t) puback->topic_id);
+    EXPECT_EQUAL(0x0A0B, (uint16_t) puback->message_id);
+    EXPECT_EQUAL(ACCEPTED, puback->return_code);
+}
+
+/**
+ * A client sends a PUBLISH to the gateway, the gateway acknowledges it with the ids of the client.
+ */
+static void test_client_publish_puback_round_trip() {
+    uint8_t publish_bytes[] = {9, MQTTSN_PUBLISH, FLAG_QOS_1 | FLAG_TOPIC_SHORT_NAME, 0x00, 0x03, 0x12, 0x34, 'o',
+                               'n'};
+    msg_publish *publish = (msg_publish *) publish_bytes;
+    EXPECT_EQUAL(0x0003, (uint16_t) publish->topic_id);
+    EXPECT_EQUAL(0x1234, (uint16_t) publish->message_id);
+    EXPECT_EQUAL('o', publish->data[0]);
+
+    msg_puback puback(publish->topic_id, publish->message_id, ACCEPTED);
+    uint8_t *puback_bytes = (uint8_t *) &puback;
+    EXPECT_EQUAL(7, puback_bytes[0]);
+    EXPECT_EQUAL(MQTTSN_PUBACK, puback_bytes[1]);
+    EXPECT_EQUAL(0x00, puback_bytes[2]);
+    EXPECT_EQUAL(0x03, puback_bytes[3]);
+    EXPECT_EQUAL(0x12, puback_bytes[4]);
+    EXPECT_EQUAL(0x34, puback_bytes[5]);
+    EXPECT_EQUAL(ACCEPTED, puback_bytes[6]);
+}
+
+static void test_suback_and_regack_are_big_endian() {
+    msg_suback suback(1, 0x0102, 0x0304, ACCEPTED);
+    uint8_t *suback_bytes = (uint8_t *) &suback;
+    EXPECT_EQUAL(8, suback_bytes[0]);
+    EXPECT_EQUAL(0x01, suback_bytes[3]);
+    EXPECT_EQUAL(0x02, suback_bytes[4]);
+    EXPECT_EQUAL(0x03, suback_bytes[5]);
+    EXPECT_EQUAL(0x04, suback_bytes[6]);
+
+    msg_regack regack(0x0506, 0x0708, ACCEPTED);
+    uint8_t *regack_bytes = (uint8_t *) &regack;
+    EXPECT_EQUAL(0x05, regack_bytes[2]);
+    EXPECT_EQUAL(0x06, regack_bytes[3]);
+    EXPECT_EQUAL(0x07, regack_bytes[4]);
+    EXPECT_EQUAL(0x08, regack_bytes[5]);
+}
+
+int main() {
+    test_publish_puback_round_trip();
+    test_client_publish_puback_round_trip();
+    test_suback_and_regack_are_big_endian();
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+//
+// Created by bele on 19.10.26.
+//
+
+#include <cstdio>
+#include <cstring>
+#include "../src/SubscriptionAggregator.h"
+
+static int failures = 0;
+
+#define EXPECT_TRUE(condition) \
+    if (!(condition)) { \
+        printf("%s:%d: expected %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    }
+
+static void test_matches_topic_names() {
+    EXPECT_TRUE(SubscriptionAggregator::matches("a/+/c", "a/b/c"));
+    EXPECT_TRUE(SubscriptionAggregator::matches("a/+/c", "a//c"));
+    EXPECT_TRUE(!SubscriptionAggregator::matches("a/+/c", "a/b/d"));
+    EXPECT_TRUE(!SubscriptionAggregator::matches("a/+/c", "a/b/c/d"));
+}
+
+/**
+ * A client subscription to exactly a/+/c is a filter, not a topic covered by the covering filter a/+/c.
+ * It must neither be counted for the filter nor be unsubscribed at the broker.
+ */
+static void test_subscribed_filters_are_not_covered() {
+    EXPECT_TRUE(!SubscriptionAggregator::matches("a/+/c", "a/+/c"));
+    EXPECT_TRUE(!SubscriptionAggregator::matches("a/+/c", "a/#"));
+    EXPECT_TRUE(SubscriptionAggregator::has_wildcards("a/+/c"));
+    EXPECT_TRUE(SubscriptionAggregator::has_wildcards("a/#"));
+    EXPECT_TRUE(!SubscriptionAggregator::has_wildcards("a/b/c"));
+
+    SubscriptionAggregator aggregator;
+    aggregator.set_threshold(2);
+    EXPECT_TRUE(aggregator.add("a/+/c", 2));
+    EXPECT_TRUE(aggregator.is_covered("a/b/c"));
+    EXPECT_TRUE(!aggregator.is_covered("a/+/c"));
+    EXPECT_TRUE(!aggregator.cover("a/+/c"));
+    char released_filter[SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1];
+    EXPECT_TRUE(!aggregator.uncover("a/+/c", released_filter));
+}
+
+static void test_candidates() {
+    char filter[SUBSCRIPTION_AGGREGATOR_FILTER_LENGTH + 1];
+    EXPECT_TRUE(SubscriptionAggregator::get_candidate("a/b/c", 1, filter));
+    EXPECT_TRUE(strcmp(filter, "a/+/c") == 0);
+    EXPECT_TRUE(!SubscriptionAggregator::get_candidate("a/b/c", 3, filter));
+    EXPECT_TRUE(!SubscriptionAggregator::get_candidate("a/+/c", 0, filter));
+}
+
+int main() {
+    test_matches_topic_names();
+    test_subscribed_filters_are_not_covered();
+    test_candidates();
+    if (failures > 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}